@@ -1,10 +1,98 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
-#ifdef USING_SSE2
-#include <emmintrin.h>
-#include <tmmintrin.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Pixel buffers from GBmpAllocator start on this boundary, enough for any vector load.
+#define GBMP_ALIGNMENT 64
+// Buffers of at least this many bytes are mapped on their own, 2 MB aligned and backed by huge pages
+// where the system has them (Linux), see GBmpAllocator::SetHugePages.
+#ifndef GBMP_HUGEPAGE_MIN
+#define GBMP_HUGEPAGE_MIN ((size_t)8 << 20)
+#endif
+
+// SIMD kernels are compiled for every level and picked at run time, see GBmpKernels.
+// USING_SSE2 and USING_AVX2 are no longer needed, GBMP_NO_SIMD builds the scalar kernels only.
+#if !defined(GBMP_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define GBMP_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define GBMP_TARGET(isa)
+#else
+#include <cpuid.h>
+#define GBMP_TARGET(isa) __attribute__((target(isa)))
 #endif
+#endif
+
+enum GBmpCompression { // biCompression values ParseHeader accepts.
+    GBI_RGB = 0,
+    GBI_RLE8 = 1,
+    GBI_RLE4 = 2,
+    GBI_BITFIELDS = 3,
+    GBI_ALPHABITFIELDS = 6,
+};
+
+enum GBmpRowCodec { // how a file row turns into 8-bit gray or 32-bit pixels, see GBmp::DecodeLine.
+    GROW_BIT1, // black and white palette: set bits become 0xFF.
+    GROW_INDEX1, // any other 1-bit palette.
+    GROW_COPY, // 8-bit with the plain gray palette, 32-bit in B, G, R, 4th byte order.
+    GROW_BGR24,
+    GROW_INDEX4, // through the palette, to gray when all of its colors are gray.
+    GROW_INDEX8,
+    GROW_RGB555,
+    GROW_RGB565,
+    GROW_SWAPRB32, // 32-bit in R, G, B, 4th byte order.
+    GROW_MASKS, // 16/32-bit bit fields of any other layout.
+};
+
+struct GBmpLayout { // what the file headers say about the pixel array.
+    int iWidth;
+    int iHeight;
+    int iBitCount;
+    bool bTopDown;
+    size_t nOffBits;
+    size_t nSrcLnBytes; // file rows are padded to 4 bytes, 0 for RLE files.
+    size_t nSrcLen; // bytes of pixel data, for RLE files the whole stream.
+    int iCompression; // GBmpCompression
+    int iCodec; // GBmpRowCodec
+    bool bGray; // decodes to 8-bit gray, otherwise to 32-bit.
+    unsigned char iFieldShift[4]; // GROW_MASKS: B, G, R, 4th byte field positions and widths, width 0 gives 0.
+    unsigned char iFieldBits[4];
+    unsigned char gray[256]; // 1/4/8-bit palette as gray values (bGray) and as 32-bit pixels with a 0 4th byte.
+    uint32_t palette[256];
+
+    // RLE files are one stream, decoded whole by GBmp; they have no rows to seek to.
+    inline bool IsRle() const { return iCompression == GBI_RLE8 || iCompression == GBI_RLE4; }
+};
 
 template <uint32_t... Values>
 struct DwordArray {
@@ -16,462 +104,458 @@ constexpr auto generatePalette(std::integer_sequence<uint32_t, Indices...>)
     return DwordArray<(Indices * 65793)...> {};
 }
 
-class GBmp // line buffer is not align to 4.
+enum GSimdLevel {
+    GSIMD_SCALAR,
+    GSIMD_SSE2,
+    GSIMD_SSSE3,
+    GSIMD_AVX2,
+    GSIMD_AVX512BW,
+};
+
+class GCpu // what the host supports, probed once with cpuid.
 {
-#pragma pack(push, 2)
-    struct GBITMAPFILEHEADER {
-        unsigned short bfType;
-        unsigned long bfSize;
-        unsigned short bfReserved1;
-        unsigned short bfReserved2;
-        unsigned long bfOffBits;
-    };
-    struct GBITMAPINFOHEADER {
-        unsigned long biSize;
-        long biWidth;
-        long biHeight;
-        unsigned short biPlanes;
-        unsigned short biBitCount;
-        unsigned long biCompression;
-        unsigned long biSizeImage;
-        long biXPelsPerMeter;
-        long biYPelsPerMeter;
-        unsigned long biClrUsed;
-        unsigned long biClrImportant;
-    };
-#pragma pack(pop)
 public:
-    GBmp(void)
-        : m_iWidth(0)
-        , m_iHeight(0)
-        , m_pImage(0)
-        , m_bGray(0) {};
-    GBmp(const void* pBuffer, int iWid, int iHei, bool bGray)
-        : m_iWidth(iWid)
-        , m_iHeight(iHei)
-        , m_bGray(bGray)
-    {
-        int iPxlBytes = bGray ? 1 : 4;
-        m_pImage = new unsigned char[iWid * iHei * iPxlBytes];
-        memcpy(m_pImage, pBuffer, iWid * iHei * iPxlBytes);
-    }
-    GBmp(const GBmp&) = delete;
-    GBmp(GBmp&& o) noexcept
-        : m_iWidth(0)
-        , m_iHeight(0)
-        , m_pImage(0)
-        , m_bGray(0)
+    static GSimdLevel Detect()
     {
-        std::swap(m_iWidth, o.m_iWidth);
-        std::swap(m_iHeight, o.m_iHeight);
-        std::swap(m_pImage, o.m_pImage);
-        std::swap(m_bGray, o.m_bGray);
+        static const GSimdLevel s_level = Probe();
+        return s_level;
     }
-    ~GBmp(void) { Release(); }
 
-    bool LoadBmp(const char* strFileName)
+private:
+    static GSimdLevel Probe()
     {
-        FILE* inputFile = fopen(strFileName, "rb");
-        if (inputFile == 0) {
-            return false;
+#ifdef GBMP_X86
+        int regs1[4], regs7[4] = { 0, 0, 0, 0 };
+        Cpuid(0, regs1);
+        int iMaxLeaf = regs1[0];
+        Cpuid(1, regs1);
+        if (iMaxLeaf >= 7) {
+            Cpuid(7, regs7);
+        }
+        bool bSse2 = (regs1[3] >> 26) & 1;
+        bool bSsse3 = (regs1[2] >> 9) & 1;
+        bool bOsXSave = (regs1[2] >> 27) & 1;
+        uint64_t uXcr0 = bOsXSave ? XGetBv() : 0;
+        bool bAvx2 = (regs7[1] >> 5) & 1 && (uXcr0 & 0x6) == 0x6;
+        bool bAvx512bw = (regs7[1] >> 16) & 1 && (regs7[1] >> 30) & 1 && (uXcr0 & 0xE6) == 0xE6;
+        if (bAvx512bw && bAvx2) {
+            return GSIMD_AVX512BW;
+        }
+        if (bAvx2 && bSsse3) {
+            return GSIMD_AVX2;
+        }
+        if (bSsse3 && bSse2) {
+            return GSIMD_SSSE3;
         }
+        if (bSse2) {
+            return GSIMD_SSE2;
+        }
+#endif
+        return GSIMD_SCALAR;
+    }
+#ifdef GBMP_X86
+    static void Cpuid(int iLeaf, int regs[4])
+    {
+#ifdef _MSC_VER
+        __cpuidex(regs, iLeaf, 0);
+#else
+        unsigned int a, b, c, d;
+        __cpuid_count(iLeaf, 0, a, b, c, d);
+        regs[0] = a, regs[1] = b, regs[2] = c, regs[3] = d;
+#endif
+    }
+    static uint64_t XGetBv()
+    {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        unsigned int a, d;
+        __asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        return ((uint64_t)d << 32) | a;
+#endif
+    }
+#endif
+};
 
-        GBITMAPFILEHEADER bf = { 0 };
-        GBITMAPINFOHEADER bi = { 0 };
-        bool bRet = true;
-        try {
-            fread(reinterpret_cast<char*>(&bf), 1, sizeof(bf), inputFile);
-            if (bf.bfType != 'MB') {
-                return false;
-            }
+typedef void (*GTransposeTileFn)(const unsigned char*, ptrdiff_t, unsigned char*, ptrdiff_t);
 
-            int iOldBufferLen = m_iWidth * m_iHeight * (m_bGray ? 1 : 4);
-            fread(reinterpret_cast<char*>(&bi), 1, sizeof(bi), inputFile);
-            switch (bi.biBitCount) {
-            case 1:
-            case 8:
-                m_bGray = true;
-                break;
-            case 24:
-            case 32:
-                m_bGray = false;
-                break;
-            default:
-                return false;
-            }
-            bool btopdown = bi.biHeight < 0;
-            int iPxlBytes = m_bGray ? 1 : 4;
-            m_iWidth = bi.biWidth;
-            m_iHeight = btopdown ? -bi.biHeight : bi.biHeight;
-            int iNewBufferLen = m_iWidth * m_iHeight * iPxlBytes;
-            if (iOldBufferLen != iNewBufferLen) {
-                delete[] m_pImage;
-                m_pImage = new unsigned char[iNewBufferLen];
-            }
-            fseek(inputFile, bf.bfOffBits - bi.biSize - sizeof(GBITMAPFILEHEADER), SEEK_CUR);
-            if (bi.biBitCount == 1) {
-                int iBufLen = (iNewBufferLen + 7) / 8;
-                char* cont = new char[iBufLen];
-                int iread = fread(cont, 1, iBufLen, inputFile);
-                int iWidLn = iread / m_iHeight;
-                for (int i = 0; i < m_iHeight; i++) {
-                    unsigned char* pDstLn = m_pImage + i * m_iWidth;
-                    char* pSrcLn = cont + i * iWidLn;
-                    for (int j = 0; j < m_iWidth / 8; j++) {
-                        unsigned char* pImg = pDstLn + j * 8;
-                        unsigned char bDatum = pSrcLn[j];
-                        for (int k = 0; k < 8; k++) {
-                            unsigned char bBit = 1 << (7 - k);
-                            unsigned char bData = bDatum & bBit;
-                            pImg[k] = (!!bData) * 0xFF;
-                        }
-                    }
-                    int iDoGroup = m_iWidth / 8;
-                    if (m_iWidth > iDoGroup * 8) {
-                        unsigned char bDatum = pSrcLn[iDoGroup];
-                        unsigned char* pImg = pDstLn + iDoGroup * 8;
-                        for (int k = 0; k < m_iWidth - iDoGroup * 8; k++) {
-                            unsigned char bBit = 1 << (7 - k);
-                            unsigned char bData = bDatum & bBit;
-                            pImg[k] = (!!bData) * 0xFF;
-                        }
+struct GByteSums { // running min, max, sum and sum of squares of bytes, by byte offset mod 4.
+    unsigned char iMin[4];
+    unsigned char iMax[4];
+    uint64_t nSum[4];
+    uint64_t nSumSq[4];
+};
+
+// One table of pixel kernels per instruction set level. A kernel without a variant at some level
+// keeps the one of the level below, so every table is complete. The active table is picked at
+// first use from GCpu::Detect() and can be lowered with SetLevel, e.g. to compare against scalar.
+struct GBmpKernels {
+    void (*pfnToGray)(const uint32_t* pSrc, unsigned char* pDst, size_t nCount); // may run in place.
+    // Pixel layout changes: 24-bit rows to 32-bit with iAlpha as the 4th byte and back, B and R trading
+    // places (BGRA <-> RGBA, may run in place), gray to 32-bit with iAlpha. The gray expansion may also
+    // run in place with the gray in the last quarter of the output row.
+    void (*pfnRGB24ToRGB32)(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iAlpha);
+    void (*pfnRGB32ToRGB24)(const unsigned char* pSrc, unsigned char* pDst, int nWidth);
+    void (*pfnSwapRB32)(const unsigned char* pSrc, unsigned char* pDst, size_t nCount);
+    void (*pfnGrayToRGB32)(const unsigned char* pSrc, unsigned char* pDst, size_t nCount, unsigned char iAlpha);
+    void (*pfnReverse8)(unsigned char* pLo, unsigned char* pHi, size_t nCount);
+    void (*pfnReverse32)(uint32_t* pLo, uint32_t* pHi, size_t nCount);
+    GTransposeTileFn pfnTranspose8[2]; // widest tile first.
+    int iTranspose8Tile[2];
+    GTransposeTileFn pfnTranspose32[2];
+    int iTranspose32Tile[2];
+    // 1-bit rows, leftmost pixel in bit 7 of byte 0: set bits become 0xFF, gray >= iThreshold sets a bit.
+    void (*pfnBit1ToGray8)(const unsigned char* pSrc, unsigned char* pDst, int nWidth);
+    void (*pfnGrayToBit1)(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iThreshold);
+    // 2x2 box average of two rows, (a + b + c + d + 2) >> 2 per channel, for nDst output pixels.
+    void (*pfnHalve8)(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst);
+    void (*pfnHalve32)(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst);
+    // Horizontal resize taps: output pixel x sums source pixels pIndex[x * nTaps + t] times their weights
+    // (7 fraction bits) per channel into 16 bits.
+    void (*pfnResizeH8)(const unsigned char* pSrc, int16_t* pDst, const int* pIndex, const int16_t* pWeights, int nTaps, int nWidth);
+    void (*pfnResizeH32)(const unsigned char* pSrc, int16_t* pDst, const int* pIndex, const int16_t* pWeights, int nTaps, int nWidth);
+    // Vertical resize taps: dst = (sum of ppRows[t][i] * pWeights[t] + (1 << 20)) >> 21, rows carry 7 fraction
+    // bits and the weights 14.
+    void (*pfnResizeV)(const int16_t* const* ppRows, const int16_t* pWeights, int nTaps, unsigned char* pDst, size_t nCount);
+    // Area resize column sums, pSum[i] += pSrc[i] * w; weights past 16 bits take the scalar loop.
+    void (*pfnAreaSum)(const unsigned char* pSrc, uint32_t w, uint32_t* pSum, size_t nCount);
+    // Adds nBytes bytes to sums; byte i goes to entry i % 4, so a 32-bit row keeps its channels apart.
+    void (*pfnByteSums)(const unsigned char* pSrc, size_t nBytes, GByteSums& sums);
+    // Palette lookups of 8-bit and 4-bit index rows (4-bit: leftmost pixel in the high nibble of byte 0),
+    // to gray through a byte table or to 32-bit through a table of pixels.
+    void (*pfnIndex8ToGray8)(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut);
+    void (*pfnIndex8ToRGB32)(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const uint32_t* pPalette);
+    void (*pfnIndex4ToGray8)(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut);
+    void (*pfnIndex4ToRGB32)(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const uint32_t* pPalette);
+    // 16-bit 5-5-5 (top bit unused) or 5-6-5 pixels to 32-bit with a 0 4th byte; channels widen to 8 bits
+    // by repeating their top bits.
+    void (*pfnRGB16ToRGB32)(const unsigned char* pSrc, unsigned char* pDst, int nWidth, bool b565);
+
+    // Byte with its bits in reverse order.
+    static const unsigned char* BitReverseTable()
+    {
+        static const struct Table {
+            unsigned char v[256];
+            Table(void)
+            {
+                for (int i = 0; i < 256; i++) {
+                    int r = 0;
+                    for (int k = 0; k < 8; k++) {
+                        r |= ((i >> k) & 1) << (7 - k);
                     }
+                    v[i] = (unsigned char)r;
                 }
-                delete[] cont;
-            }
-            if (bi.biBitCount == 32) {
-                fread(m_pImage, 1, m_iWidth * m_iHeight * 4, inputFile);
-            }
-            if (bi.biBitCount == 24) {
-                unsigned char* pBuf = new unsigned char[iNewBufferLen];
-                fread(pBuf, 1, iNewBufferLen, inputFile);
-                RGB24ToRGB32(pBuf, m_pImage, m_iWidth, m_iHeight);
-                delete[] pBuf;
-            }
-            if (bi.biBitCount == 8) {
-                int iLnBytes = (m_iWidth + 3) / 4 * 4;
-                unsigned char* pTemp = new unsigned char[iLnBytes];
-                for (int i = 0; i < m_iHeight; i++) {
-                    fread(pTemp, 1, iLnBytes, inputFile);
-                    unsigned char* pDst = m_pImage + i * m_iWidth;
-                    memcpy(pDst, pTemp, m_iWidth);
-                }
-                delete[] pTemp;
-            }
-            btopdown ? 0 : MirrorV();
-        } catch (...) {
-            if (m_pImage) {
-                delete[] m_pImage;
-                m_pImage = 0;
-                m_iWidth = m_iHeight = 0;
             }
-            bRet = false;
-        }
-        fclose(inputFile);
+        } s_table;
+        return s_table.v;
+    }
 
-        return bRet;
+    static const GBmpKernels& Get() { return Tables()[ActiveLevel().load(std::memory_order_relaxed)]; }
+    static GSimdLevel Level() { return (GSimdLevel)ActiveLevel().load(std::memory_order_relaxed); }
+    // Selects the kernels of level, clamped to what the host supports; returns the level in use.
+    static GSimdLevel SetLevel(GSimdLevel level)
+    {
+        GSimdLevel used = (std::min)(level, GCpu::Detect());
+        ActiveLevel().store(used, std::memory_order_relaxed);
+        return used;
     }
-    bool SaveBmp(const char* strFileName)
+
+private:
+    static std::atomic<int>& ActiveLevel()
     {
-        FILE* outputFile = fopen(strFileName, "wb");
-        if (outputFile == 0) {
-            return false;
+        static std::atomic<int> s_iLevel(GCpu::Detect());
+        return s_iLevel;
+    }
+    static const GBmpKernels* Tables()
+    {
+        static const GBmpKernels s_tables[] = { Build(GSIMD_SCALAR), Build(GSIMD_SSE2), Build(GSIMD_SSSE3),
+            Build(GSIMD_AVX2), Build(GSIMD_AVX512BW) };
+        return s_tables;
+    }
+    static GBmpKernels Build(GSimdLevel level)
+    {
+        GBmpKernels k = { ToGray_Scalar, RGB24ToRGB32_Scalar, RGB32ToRGB24_Scalar, SwapRB32_Scalar, GrayToRGB32_Scalar, Reverse8_Scalar, Reverse32_Scalar,
+            { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 }, Bit1ToGray8_Scalar, GrayToBit1_Scalar, Halve8_Scalar, Halve32_Scalar,
+            ResizeH_Scalar<1>, ResizeH_Scalar<4>, ResizeV_Scalar, AreaSum_Scalar, ByteSums_Scalar, Index8ToGray8_Scalar, Index8ToRGB32_Scalar,
+            Index4ToGray8_Scalar, Index4ToRGB32_Scalar, RGB16ToRGB32_Scalar };
+#ifdef GBMP_X86
+        if (level >= GSIMD_SSE2) {
+            k.pfnToGray = ToGray_SSE2;
+            k.pfnRGB24ToRGB32 = RGB24ToRGB32_SSE2;
+            k.pfnSwapRB32 = SwapRB32_SSE2;
+            k.pfnGrayToRGB32 = GrayToRGB32_SSE2;
+            k.pfnReverse8 = Reverse8_SSE2;
+            k.pfnReverse32 = Reverse32_SSE2;
+            k.pfnTranspose8[0] = TransposeTile8u16x16_SSE2, k.iTranspose8Tile[0] = 16;
+            k.pfnTranspose8[1] = TransposeTile8u8x8_SSE2, k.iTranspose8Tile[1] = 8;
+            k.pfnTranspose32[0] = TransposeTile32u4x4_SSE2, k.iTranspose32Tile[0] = 4;
+            k.pfnBit1ToGray8 = Bit1ToGray8_SSE2;
+            k.pfnGrayToBit1 = GrayToBit1_SSE2;
+            k.pfnHalve8 = Halve8_SSE2;
+            k.pfnHalve32 = Halve32_SSE2;
+            k.pfnResizeH32 = ResizeH32_SSE2;
+            k.pfnResizeV = ResizeV_SSE2;
+            k.pfnAreaSum = AreaSum_SSE2;
+            k.pfnByteSums = ByteSums_SSE2;
+            k.pfnRGB16ToRGB32 = RGB16ToRGB32_SSE2;
         }
-
-        unsigned long iLnBytes = m_bGray ? ((m_iWidth + 3) / 4 * 4) : m_iWidth * 4;
-        unsigned long iOffset = sizeof(GBITMAPFILEHEADER) + sizeof(GBITMAPINFOHEADER) + m_bGray * 256 * 4;
-        GBITMAPFILEHEADER bf { 'MB', iOffset + iLnBytes * m_iHeight, 0, 0, iOffset };
-        GBITMAPINFOHEADER bi { sizeof(bi), m_iWidth, -m_iHeight, 1, m_bGray ? 8u : 32u, 0, iLnBytes * m_iHeight };
-        fwrite(reinterpret_cast<const char*>(&bf), 1, sizeof(bf), outputFile);
-        fwrite(reinterpret_cast<const char*>(&bi), 1, sizeof(bi), outputFile);
-
-        if (m_bGray) {
-            constexpr auto MyDwordArray = generatePalette(std::make_integer_sequence<uint32_t, 256>());
-            fwrite(reinterpret_cast<const char*>(MyDwordArray.data), 1, sizeof(MyDwordArray.data), outputFile);
+        if (level >= GSIMD_SSSE3) {
+            k.pfnRGB24ToRGB32 = RGB24ToRGB32_SSSE3;
+            k.pfnRGB32ToRGB24 = RGB32ToRGB24_SSSE3;
+            k.pfnSwapRB32 = SwapRB32_SSSE3;
+            k.pfnReverse8 = Reverse8_SSSE3;
+            k.pfnGrayToBit1 = GrayToBit1_SSSE3;
+            k.pfnIndex4ToGray8 = Index4ToGray8_SSSE3;
+            k.pfnIndex4ToRGB32 = Index4ToRGB32_SSSE3;
+            k.pfnResizeH8 = ResizeH8_SSSE3;
         }
-
-        unsigned char* pLn = new unsigned char[iLnBytes];
-        memset(pLn, 0, iLnBytes);
-        int iLnLen = m_iWidth * (m_bGray ? 1 : 4);
-        for (int i = 0; i < m_iHeight; i++) {
-            memcpy(pLn, m_pImage + i * iLnLen, iLnLen);
-            fwrite(reinterpret_cast<char*>(pLn), 1, iLnBytes, outputFile);
+        if (level >= GSIMD_AVX2) {
+            k.pfnToGray = ToGray_AVX2;
+            k.pfnRGB24ToRGB32 = RGB24ToRGB32_AVX2;
+            k.pfnRGB32ToRGB24 = RGB32ToRGB24_AVX2;
+            k.pfnSwapRB32 = SwapRB32_AVX2;
+            k.pfnGrayToRGB32 = GrayToRGB32_AVX2;
+            k.pfnReverse8 = Reverse8_AVX2;
+            k.pfnReverse32 = Reverse32_AVX2;
+            k.pfnTranspose32[1] = TransposeTile32u4x4_SSE2, k.iTranspose32Tile[1] = 4;
+            k.pfnTranspose32[0] = TransposeTile32u8x8_AVX2, k.iTranspose32Tile[0] = 8;
+            k.pfnBit1ToGray8 = Bit1ToGray8_AVX2;
+            k.pfnGrayToBit1 = GrayToBit1_AVX2;
+            k.pfnHalve8 = Halve8_AVX2;
+            k.pfnHalve32 = Halve32_AVX2;
+            k.pfnResizeH8 = ResizeH8_AVX2;
+            k.pfnResizeV = ResizeV_AVX2;
+            k.pfnAreaSum = AreaSum_AVX2;
+            k.pfnByteSums = ByteSums_AVX2;
+            k.pfnIndex8ToGray8 = Index8ToGray8_AVX2;
+            k.pfnIndex8ToRGB32 = Index8ToRGB32_AVX2;
+            k.pfnIndex4ToGray8 = Index4ToGray8_AVX2;
+            k.pfnRGB16ToRGB32 = RGB16ToRGB32_AVX2;
         }
-        delete[] pLn;
-
-        return fclose(outputFile) == 0;
+        if (level >= GSIMD_AVX512BW) {
+            k.pfnToGray = ToGray_AVX512BW;
+            k.pfnRGB24ToRGB32 = RGB24ToRGB32_AVX512BW;
+            k.pfnRGB32ToRGB24 = RGB32ToRGB24_AVX512BW;
+            k.pfnSwapRB32 = SwapRB32_AVX512BW;
+            k.pfnReverse8 = Reverse8_AVX512BW;
+            k.pfnReverse32 = Reverse32_AVX512BW;
+            k.pfnGrayToBit1 = GrayToBit1_AVX512BW;
+        }
+#else
+        (void)level;
+#endif
+        return k;
     }
 
-    inline bool IsGray() { return m_bGray; }
-    inline void* Data() { return m_pImage; }
-    inline int GetWidth() { return m_iWidth; }
-    inline int GetHeight() { return m_iHeight; }
-
-    void SetImageSize(int iWid, int iHei, bool bGray)
+    // gray = (r * 9798 + g * 19235 + b * 3736 + 16384) >> 15, every variant is bit-exact to this.
+    static void ToGray_Scalar(const uint32_t* pSrc, unsigned char* pDst, size_t nCount)
     {
-        if (iWid == m_iWidth && iHei == m_iHeight && bGray == m_bGray) {
-            return;
-        } else {
-            if (m_pImage) {
-                delete[] m_pImage;
-                m_pImage = 0;
-                m_iWidth = m_iHeight = 0;
-            }
-            m_iWidth = iWid;
-            m_iHeight = iHei;
-            m_bGray = bGray;
-            m_pImage = new unsigned char[(__int64)iWid * iHei * (m_bGray ? 1 : 4)];
+        const unsigned char* pBGRA = (const unsigned char*)pSrc;
+        for (size_t i = 0; i < nCount; i++) {
+            int r = pBGRA[i * 4 + 2];
+            int g = pBGRA[i * 4 + 1];
+            int b = pBGRA[i * 4];
+            pDst[i] = (r * 9798 + g * 19235 + b * 3736 + 16384) / 32768;
         }
     }
-
-    void SetImage(const void* pImage, int iWid, int iHei, bool bGray)
+    static void RGB24ToRGB32_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iAlpha)
     {
-        SetImageSize(iWid, iHei, bGray);
-        int iCount = iWid * (bGray ? 1 : 4) * iHei;
-        memcpy(m_pImage, pImage, iCount);
+        for (int j = 0; j < nWidth; j++) {
+            const unsigned char* pSrcPxl = pSrc + j * 3;
+            unsigned char* pDstPxl = pDst + j * 4;
+            pDstPxl[0] = pSrcPxl[0];
+            pDstPxl[1] = pSrcPxl[1];
+            pDstPxl[2] = pSrcPxl[2];
+            pDstPxl[3] = iAlpha;
+        }
     }
-
-    void Release()
+    static void RGB32ToRGB24_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth)
     {
-        if (m_pImage) {
-            delete[] m_pImage;
-            m_pImage = 0;
-            m_iWidth = m_iHeight = 0;
+        for (int j = 0; j < nWidth; j++) {
+            const unsigned char* pSrcPxl = pSrc + j * 4;
+            unsigned char* pDstPxl = pDst + j * 3;
+            pDstPxl[0] = pSrcPxl[0];
+            pDstPxl[1] = pSrcPxl[1];
+            pDstPxl[2] = pSrcPxl[2];
         }
     }
-
-    void AttachData(void* pNewImage, int iWid, int iHei, bool bGray)
+    static void SwapRB32_Scalar(const unsigned char* pSrc, unsigned char* pDst, size_t nCount)
     {
-        if (m_pImage) {
-            delete[] m_pImage;
-            m_pImage = 0;
-            m_iWidth = m_iHeight = 0;
+        for (size_t i = 0; i < nCount; i++) {
+            unsigned char b = pSrc[i * 4];
+            pDst[i * 4] = pSrc[i * 4 + 2];
+            pDst[i * 4 + 1] = pSrc[i * 4 + 1];
+            pDst[i * 4 + 2] = b;
+            pDst[i * 4 + 3] = pSrc[i * 4 + 3];
         }
-        m_iWidth = iWid;
-        m_iHeight = iHei;
-        m_bGray = bGray;
-        m_pImage = static_cast<unsigned char*>(pNewImage);
     }
-    void* DetachData()
+    static void GrayToRGB32_Scalar(const unsigned char* pSrc, unsigned char* pDst, size_t nCount, unsigned char iAlpha)
     {
-        unsigned char* pImage = m_pImage;
-        m_pImage = 0;
-        m_iWidth = m_iHeight = 0;
-        return pImage;
+        for (size_t i = 0; i < nCount; i++) {
+            unsigned char v = pSrc[i];
+            pDst[i * 4] = pDst[i * 4 + 1] = pDst[i * 4 + 2] = v;
+            pDst[i * 4 + 3] = iAlpha;
+        }
     }
-
-    void MirrorV()
+    static void Reverse8_Scalar(unsigned char* pLo, unsigned char* pHi, size_t nCount)
     {
-        int iLnBytes = m_iWidth * (m_bGray ? 1 : 4);
-        unsigned char* pLn = new unsigned char[iLnBytes];
-        for (int i = 0; i < GetHeight() / 2; i++) {
-            unsigned char* pUpLn = (unsigned char*)Data() + i * iLnBytes;
-            unsigned char* pDnLn = (unsigned char*)Data() + (GetHeight() - 1 - i) * iLnBytes;
-            memcpy(pLn, pUpLn, iLnBytes);
-            memcpy(pUpLn, pDnLn, iLnBytes);
-            memcpy(pDnLn, pLn, iLnBytes);
+        for (size_t i = 0; i < nCount; i++) {
+            std::swap(pLo[i], pHi[nCount - 1 - i]);
         }
-        delete[] pLn;
     }
-    void MirrorH()
+    static void Reverse32_Scalar(uint32_t* pLo, uint32_t* pHi, size_t nCount)
     {
-        int iPxlBytes = m_bGray ? 1 : 4;
-        unsigned char* pTemp = new unsigned char[iPxlBytes];
-        for (int i = 0; i < m_iHeight; i++) {
-            unsigned char* pLn = m_pImage + i * m_iWidth * iPxlBytes;
-            for (int j = 0; j < m_iWidth / 2; j++) {
-                unsigned char* pSrc1 = pLn + j * iPxlBytes;
-                unsigned char* pSrc2 = pLn + (m_iWidth - 1 - j) * iPxlBytes;
-                memcpy(pTemp, pSrc1, iPxlBytes);
-                memcpy(pSrc1, pSrc2, iPxlBytes);
-                memcpy(pSrc2, pTemp, iPxlBytes);
-            }
+        for (size_t i = 0; i < nCount; i++) {
+            std::swap(pLo[i], pHi[nCount - 1 - i]);
         }
-        delete[] pTemp;
     }
-    void ReverseImage()
+    // A byte of bits expands to 8 gray bytes through a 256 entry table.
+    static void Bit1ToGray8_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth)
     {
-        if (!m_bGray) {
-            unsigned long* pTarget = (unsigned long*)m_pImage;
-#ifdef USING_SSE2
-            int iLoop = m_iWidth * m_iHeight * 4 / 32;
-            for (int i = 0; i < iLoop; i++) {
-                __m128i* pm128Top = (__m128i*)(pTarget + i * 4);
-                __m128i* pm128Bot = (__m128i*)(pTarget + m_iWidth * m_iHeight - i * 4 - 4);
-                __m128i m128Top = _mm_loadu_si128(pm128Top);
-                __m128i m128Bot = _mm_loadu_si128(pm128Bot);
-                m128Top = _mm_shuffle_epi32(m128Top, _MM_SHUFFLE(0, 1, 2, 3));
-                m128Bot = _mm_shuffle_epi32(m128Bot, _MM_SHUFFLE(0, 1, 2, 3));
-                _mm_storeu_si128(pm128Top, m128Bot);
-                _mm_storeu_si128(pm128Bot, m128Top);
-            }
-
-            for (int i = iLoop * 4; i < m_iWidth * m_iHeight / 2; i++) {
-                unsigned long swap = pTarget[i];
-                pTarget[i] = pTarget[m_iWidth * m_iHeight - 1 - i];
-                pTarget[m_iWidth * m_iHeight - 1 - i] = swap;
-            }
-#else
-            for (int i = 0; i < m_iWidth * m_iHeight / 2; i++) {
-                unsigned long swap = pTarget[i];
-                pTarget[i] = pTarget[m_iWidth * m_iHeight - 1 - i];
-                pTarget[m_iWidth * m_iHeight - 1 - i] = swap;
-            }
-#endif
-        } else {
-            unsigned char* pTarget = m_pImage;
-#ifdef USING_SSE2
-            int iLoop = m_iWidth * m_iHeight / 32;
-            for (int i = 0; i < iLoop; i++) {
-                __m128i* pm128Top = (__m128i*)(pTarget + i * 16);
-                __m128i* pm128Bot = (__m128i*)(pTarget + m_iWidth * m_iHeight - i * 16 - 16);
-                __m128i m128Top = _mm_loadu_si128(pm128Top);
-                __m128i m128Bot = _mm_loadu_si128(pm128Bot);
-                m128Top = _mm_shuffle_epi8(m128Top,
-                    _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
-                m128Bot = _mm_shuffle_epi8(m128Bot,
-                    _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
-
-                _mm_storeu_si128(pm128Top, m128Bot);
-                _mm_storeu_si128(pm128Bot, m128Top);
-            }
-
-            for (int i = iLoop * 16; i < m_iWidth * m_iHeight / 2; i++) {
-                unsigned char swap = pTarget[i];
-                pTarget[i] = pTarget[m_iWidth * m_iHeight - 1 - i];
-                pTarget[m_iWidth * m_iHeight - 1 - i] = swap;
-            }
-#else
-            for (int i = 0; i < m_iWidth * m_iHeight / 2; i++) {
-                unsigned char swap = pTarget[i];
-                pTarget[i] = pTarget[m_iWidth * m_iHeight - 1 - i];
-                pTarget[m_iWidth * m_iHeight - 1 - i] = swap;
+        static const struct Table {
+            unsigned char v[256][8];
+            Table(void)
+            {
+                for (int i = 0; i < 256; i++) {
+                    for (int k = 0; k < 8; k++) {
+                        v[i][k] = ((i >> (7 - k)) & 1) * 0xFF;
+                    }
+                }
             }
-#endif
+        } s_table;
+        int nBytes = nWidth / 8;
+        for (int j = 0; j < nBytes; j++) {
+            memcpy(pDst + j * 8, s_table.v[pSrc[j]], 8);
+        }
+        if (nWidth > nBytes * 8) {
+            memcpy(pDst + nBytes * 8, s_table.v[pSrc[nBytes]], nWidth - nBytes * 8);
         }
     }
-
-    operator unsigned char*() const { return m_pImage; }
-    GBmp Rotate270()
+    static void GrayToBit1_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iThreshold)
     {
-        GBmp bmpRot;
-        bmpRot.SetImageSize(m_iHeight, m_iWidth, m_bGray);
-        if (m_bGray) {
-            for (int x = 0; x < m_iWidth; x++) {
-                for (int y = 0; y < m_iHeight; y++) {
-                    int srcIndex = (m_iHeight - 1 - y) * m_iWidth + x;
-                    int dstIndex = x * m_iHeight + y;
-                    bmpRot.m_pImage[dstIndex] = m_pImage[srcIndex];
-                }
-            }
-        } else {
-            for (int x = 0; x < m_iWidth; x++) {
-                for (int y = 0; y < m_iHeight; y++) {
-                    int srcIndex = (m_iHeight - 1 - y) * m_iWidth + x;
-                    int dstIndex = x * m_iHeight + y;
-                    ((unsigned long*)bmpRot.m_pImage)[dstIndex] = ((unsigned long*)m_pImage)[srcIndex];
-                }
+        for (int j = 0; j < nWidth; j += 8) {
+            int iByte = 0;
+            for (int k = 0; k < 8 && j + k < nWidth; k++) {
+                iByte |= (pSrc[j + k] >= iThreshold) << (7 - k);
             }
+            pDst[j / 8] = (unsigned char)iByte;
         }
-        return bmpRot;
     }
-    GBmp Rotate90()
+    static void Halve8_Scalar(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst)
     {
-        GBmp bmpRot;
-        bmpRot.SetImageSize(m_iHeight, m_iWidth, m_bGray);
-        if (m_bGray) {
-            for (int y = 0; y < m_iHeight; y++) {
-                for (int x = 0; x < m_iWidth; x++) {
-                    int iOffSet = (m_iWidth - x - 1) * m_iHeight + y;
-                    unsigned char* pLnSrc = m_pImage + (y * m_iWidth + x);
-                    unsigned char* pLnDst = bmpRot.m_pImage + iOffSet;
-                    *pLnDst = *pLnSrc;
+        for (size_t i = 0; i < nDst; i++) {
+            pDst[i] = (unsigned char)((pLn0[2 * i] + pLn0[2 * i + 1] + pLn1[2 * i] + pLn1[2 * i + 1] + 2) >> 2);
+        }
+    }
+    static void Halve32_Scalar(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst)
+    {
+        for (size_t i = 0; i < nDst * 4; i++) {
+            size_t j = i / 4 * 8 + i % 4;
+            pDst[i] = (unsigned char)((pLn0[j] + pLn0[j + 4] + pLn1[j] + pLn1[j + 4] + 2) >> 2);
+        }
+    }
+    template <int PxlBytes>
+    static void ResizeH_Scalar(const unsigned char* pSrc, int16_t* pDst, const int* pIndex, const int16_t* pWeights, int nTaps, int nWidth)
+    {
+        for (int x = 0; x < nWidth; x++, pIndex += nTaps, pWeights += nTaps) {
+            int iSum[PxlBytes] = {};
+            for (int t = 0; t < nTaps; t++) {
+                const unsigned char* pPxl = pSrc + pIndex[t] * PxlBytes;
+                for (int c = 0; c < PxlBytes; c++) {
+                    iSum[c] += pPxl[c] * pWeights[t];
                 }
             }
-        } else {
-            for (int y = 0; y < m_iHeight; y++) {
-                for (int x = 0; x < m_iWidth; x++) {
-                    int iOffSet = (m_iWidth - x - 1) * m_iHeight + y;
-                    unsigned long* pLnSrc = ((unsigned long*)m_pImage) + (y * m_iWidth + x);
-                    unsigned long* pLnDst = ((unsigned long*)bmpRot.m_pImage) + iOffSet;
-                    *pLnDst = *pLnSrc;
-                }
+            for (int c = 0; c < PxlBytes; c++) {
+                pDst[x * PxlBytes + c] = (int16_t)iSum[c];
             }
         }
-        return bmpRot;
     }
-#ifdef USEING_IPP
-    GBmp Transpose_ipp()
+    static void ByteSums_Scalar(const unsigned char* pSrc, size_t nBytes, GByteSums& sums)
     {
-        GBmp bmpRot;
-        bmpRot.SetImageSize(m_iHeight, m_iWidth, m_bGray);
-        IppStatus status = ippiTranspose_8u_C1R(m_pImage, m_iWidth, bmpRot, m_iHeight, { m_iWidth, m_iHeight });
-        return bmpRot;
+        for (size_t i = 0; i < nBytes; i++) {
+            unsigned char v = pSrc[i];
+            sums.iMin[i & 3] = (std::min)(sums.iMin[i & 3], v);
+            sums.iMax[i & 3] = (std::max)(sums.iMax[i & 3], v);
+            sums.nSum[i & 3] += v;
+            sums.nSumSq[i & 3] += (uint32_t)v * v;
+        }
     }
-#endif
-    GBmp Rotate180()
+    static void ResizeV_Scalar(const int16_t* const* ppRows, const int16_t* pWeights, int nTaps, unsigned char* pDst, size_t nCount)
     {
-        GBmp bmpRot;
-        bmpRot.SetImageSize(m_iWidth, m_iHeight, m_bGray);
-        if (m_bGray) {
-            for (int i = 0; i < m_iWidth * m_iHeight; i++) {
-                bmpRot.m_pImage[i] = m_pImage[m_iWidth * m_iHeight - 1 - i];
-            }
-        } else {
-            for (int i = 0; i < m_iWidth * m_iHeight; i++) {
-                ((unsigned long*)bmpRot.m_pImage)[i] = ((unsigned long*)m_pImage)[m_iWidth * m_iHeight - 1 - i];
+        for (size_t i = 0; i < nCount; i++) {
+            int iSum = 1 << 20;
+            for (int t = 0; t < nTaps; t++) {
+                iSum += ppRows[t][i] * pWeights[t];
             }
+            pDst[i] = (unsigned char)(std::min)(iSum >> 21, 255);
+        }
+    }
+    static void AreaSum_Scalar(const unsigned char* pSrc, uint32_t w, uint32_t* pSum, size_t nCount)
+    {
+        for (size_t i = 0; i < nCount; i++) {
+            pSum[i] += pSrc[i] * w;
         }
-        return bmpRot;
     }
 
-    void CropImage(GBmp& imgSrc, int left, int top, int right, int bottom)
+    static void Index8ToGray8_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut)
     {
-        if (left < 0) {
-            left = 0;
+        for (int j = 0; j < nWidth; j++) {
+            pDst[j] = pLut[pSrc[j]];
         }
-        if (top < 0) {
-            top = 0;
+    }
+    static void Index8ToRGB32_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const uint32_t* pPalette)
+    {
+        for (int j = 0; j < nWidth; j++) {
+            memcpy(pDst + j * 4, pPalette + pSrc[j], 4);
         }
-        if (right > imgSrc.GetWidth()) {
-            right = imgSrc.GetWidth();
+    }
+    static void Index4ToGray8_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut)
+    {
+        for (int j = 0; j < nWidth; j++) {
+            pDst[j] = pLut[(pSrc[j / 2] >> (j & 1 ? 0 : 4)) & 0x0F];
         }
-        if (bottom > imgSrc.GetHeight()) {
-            bottom = imgSrc.GetHeight();
+    }
+    static void Index4ToRGB32_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const uint32_t* pPalette)
+    {
+        for (int j = 0; j < nWidth; j++) {
+            memcpy(pDst + j * 4, pPalette + ((pSrc[j / 2] >> (j & 1 ? 0 : 4)) & 0x0F), 4);
         }
-        SetImageSize(right - left, bottom - top, imgSrc.IsGray());
-        int iBytes = imgSrc.IsGray() ? 1 : 4;
-        const unsigned char* pBuffer = imgSrc;
-        const unsigned char* pLnSrc = pBuffer + (top * imgSrc.GetWidth() + left) * iBytes;
-        unsigned char* pLnDst = (unsigned char*)Data();
-        for (int i = 0; i < (bottom - top); i++) {
-            memcpy(pLnDst + i * (right - left) * iBytes, pLnSrc + i * imgSrc.GetWidth() * iBytes, (right - left) * iBytes);
+    }
+    static void RGB16ToRGB32_Scalar(const unsigned char* pSrc, unsigned char* pDst, int nWidth, bool b565)
+    {
+        for (int j = 0; j < nWidth; j++) {
+            int v = pSrc[j * 2] | (pSrc[j * 2 + 1] << 8);
+            int b = v & 0x1F;
+            int g = b565 ? (v >> 5) & 0x3F : (v >> 5) & 0x1F;
+            int r = b565 ? v >> 11 : (v >> 10) & 0x1F;
+            pDst[j * 4] = (unsigned char)((b << 3) | (b >> 2));
+            pDst[j * 4 + 1] = (unsigned char)(b565 ? (g << 2) | (g >> 4) : (g << 3) | (g >> 2));
+            pDst[j * 4 + 2] = (unsigned char)((r << 3) | (r >> 2));
+            pDst[j * 4 + 3] = 0;
         }
     }
 
-    void CopyImage(GBmp& imgSrc)
+    // Pixels to handle before pSrc reaches an iAlign boundary, 0 when it never can (odd offsets in
+    // mapped files). GBmp buffers are GBMP_ALIGNMENT aligned, so whole images need no head.
+    static size_t AlignHead(const uint32_t* pSrc, size_t iAlign, size_t nCount)
     {
-        SetImage(imgSrc.Data(), imgSrc.GetWidth(), imgSrc.GetHeight(), imgSrc.IsGray());
+        uintptr_t iAddr = (uintptr_t)pSrc;
+        if (iAddr & 3) {
+            return 0;
+        }
+        return (std::min)(nCount, ((iAlign - (iAddr & (iAlign - 1))) & (iAlign - 1)) / 4);
     }
 
-    void ToGray()
+#ifdef GBMP_X86
+    GBMP_TARGET("sse2")
+    static void ToGray_SSE2(const uint32_t* pSrc, unsigned char* pDst, size_t nCount)
     {
-        if (IsGray()) {
-            return;
-        }
-        unsigned char* pY = (unsigned char*)Data();
-        const unsigned long* pRGB8888 = (unsigned long*)Data();
-        int iLen = m_iWidth * m_iHeight;
-        m_bGray = true;
-#ifdef USING_SSE2
         __m128i m128xmmCo = _mm_set_epi16(0, 9798, 19235, 3736, 0, 9798, 19235, 3736);
         __m128i m128xmm0, m128xmm1, m128xmm2;
         __m128i m128Mask = _mm_set_epi32(0, -1, -1, -1);
-        unsigned long* pDst = (unsigned long*)pY;
-        int iLoop = iLen / 4;
-        int iLast = iLen & 3;
-        for (int i = 0; i < iLoop; i++) {
-            m128xmm0 = _mm_loadu_si128((__m128i*)(pRGB8888 + i * 4));
+        size_t iLoop = nCount / 4;
+        for (size_t i = 0; i < iLoop; i++) {
+            m128xmm0 = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
             m128xmm1 = _mm_unpacklo_epi8(m128xmm0, _mm_setzero_si128());
             m128xmm2 = _mm_unpackhi_epi8(m128xmm0, _mm_setzero_si128());
             m128xmm1 = _mm_madd_epi16(m128xmm1, m128xmmCo);
@@ -489,66 +573,5448 @@ public:
             m128xmm1 = _mm_srli_epi32(m128xmm1, 15);
             m128xmm1 = _mm_packs_epi32(m128xmm1, _mm_setzero_si128());
             m128xmm1 = _mm_packus_epi16(m128xmm1, _mm_setzero_si128());
-            pDst[i] = _mm_cvtsi128_si32(m128xmm1);
+            int iGray = _mm_cvtsi128_si32(m128xmm1);
+            memcpy(pDst + i * 4, &iGray, 4);
         }
-        for (int i = 0; i < iLast; i++) {
-            unsigned long dwRgb = pRGB8888[iLoop * 4 + i];
-            int r = (unsigned char)(dwRgb >> 16);
-            int g = (unsigned char)(dwRgb >> 8);
-            int b = (unsigned char)dwRgb;
-            pY[iLoop * 4 + i] = (r * 3736 + g * 19235 + b * 9798 + 16384) / 32768;
-        }
-#else
-        for (int i = 0; i < iLen; i++) {
-            int r = (unsigned char)(pRGB8888[i] >> 16);
-            int g = (unsigned char)(pRGB8888[i] >> 8);
-            int b = (unsigned char)pRGB8888[i];
-            pY[i] = (r * 3736 + g * 19235 + b * 9798 + 16384) / 32768;
-        }
-#endif
+        ToGray_Scalar(pSrc + iLoop * 4, pDst + iLoop * 4, nCount - iLoop * 4);
     }
-
-private:
-    void RGB24ToRGB32(void* pSrc, void* pDst, int nWidth, int nHeight)
-    {
-        int iSrcLnBytes = (nWidth * 3 + 3) / 4 * 4;
-        for (int i = 0; i < nHeight; i++) {
-            unsigned char* pLSrc = ((unsigned char*)pSrc) + i * iSrcLnBytes;
-            unsigned char* pLDst = ((unsigned char*)pDst) + i * nWidth * 4;
-#ifdef USING_SSE2
-            int iLoop = nWidth / 4; // = 0; = nWidth / 4;
-            int iRemain = iLoop * 4;
-            for (int j = 0; j < iLoop; j++) {
-                __m128i* pm128Src = (__m128i*)(pLSrc + j * 12);
-                __m128i* pm128Dst = (__m128i*)(pLDst + j * 16);
-                __m128i m128S = _mm_loadu_si128(pm128Src);
-                m128S = _mm_shuffle_epi8(m128S, _mm_set_epi8(11, 11, 10, 9, 8, 8, 7, 6, 5, 5, 4, 3, 2, 2, 1, 0));
-                m128S = _mm_and_si128(m128S, _mm_set_epi32(0x00ffffff, 0x00ffffff, 0x00ffffff, 0x00ffffff));
-                _mm_storeu_si128(pm128Dst, m128S);
-            }
-            for (int j = iRemain; j < nWidth; j++) {
-                unsigned char* pSrcPxl = pLSrc + j * 3;
-                unsigned char* pDstPxl = pLDst + j * 4;
-                pDstPxl[0] = pSrcPxl[0];
-                pDstPxl[1] = pSrcPxl[1];
-                pDstPxl[2] = pSrcPxl[2];
-                pDstPxl[3] = 0;
+    GBMP_TARGET("avx2")
+    static void ToGray_AVX2(const uint32_t* pSrc, unsigned char* pDst, size_t nCount)
+    {
+        const __m256i m256Lo = _mm256_set1_epi32(0x00FF00FF);
+        const __m256i m256CoBR = _mm256_set1_epi32((9798 << 16) | 3736);
+        const __m256i m256CoG = _mm256_set1_epi32(19235);
+        const __m256i m256Round = _mm256_set1_epi32(16384);
+        const __m256i m256Order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        size_t nHead = AlignHead(pSrc, 32, nCount);
+        ToGray_Scalar(pSrc, pDst, nHead);
+        pSrc += nHead, pDst += nHead, nCount -= nHead;
+        size_t iLoop = ((uintptr_t)pSrc & 31) ? 0 : nCount / 32;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m256i v[4];
+            for (int k = 0; k < 4; k++) {
+                __m256i m256Px = _mm256_load_si256((const __m256i*)(pSrc + i * 32 + k * 8));
+                __m256i m256BR = _mm256_madd_epi16(_mm256_and_si256(m256Px, m256Lo), m256CoBR);
+                __m256i m256G = _mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(m256Px, 8), m256Lo), m256CoG);
+                v[k] = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(m256BR, m256G), m256Round), 15);
             }
-#else
-            for (int j = 0; j < nWidth; j++) {
-                unsigned char* pSrcPxl = pLSrc + j * 3;
-                unsigned char* pDstPxl = pLDst + j * 4;
-                pDstPxl[0] = pSrcPxl[0];
-                pDstPxl[1] = pSrcPxl[1];
-                pDstPxl[2] = pSrcPxl[2];
-                pDstPxl[3] = 0;
+            __m256i m256Out = _mm256_packus_epi16(_mm256_packs_epi32(v[0], v[1]), _mm256_packs_epi32(v[2], v[3]));
+            m256Out = _mm256_permutevar8x32_epi32(m256Out, m256Order);
+            _mm256_storeu_si256((__m256i*)(pDst + i * 32), m256Out);
+        }
+        ToGray_SSE2(pSrc + iLoop * 32, pDst + iLoop * 32, nCount - iLoop * 32);
+    }
+    GBMP_TARGET("avx512f,avx512bw")
+    static void ToGray_AVX512BW(const uint32_t* pSrc, unsigned char* pDst, size_t nCount)
+    {
+        const __m512i m512Lo = _mm512_set1_epi32(0x00FF00FF);
+        const __m512i m512CoBR = _mm512_set1_epi32((9798 << 16) | 3736);
+        const __m512i m512CoG = _mm512_set1_epi32(19235);
+        const __m512i m512Round = _mm512_set1_epi32(16384);
+        const __m512i m512Order = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        size_t nHead = AlignHead(pSrc, 64, nCount);
+        ToGray_Scalar(pSrc, pDst, nHead);
+        pSrc += nHead, pDst += nHead, nCount -= nHead;
+        size_t iLoop = ((uintptr_t)pSrc & 63) ? 0 : nCount / 64;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m512i v[4];
+            for (int k = 0; k < 4; k++) {
+                __m512i m512Px = _mm512_load_si512((const void*)(pSrc + i * 64 + k * 16));
+                __m512i m512BR = _mm512_madd_epi16(_mm512_and_si512(m512Px, m512Lo), m512CoBR);
+                __m512i m512G = _mm512_madd_epi16(_mm512_and_si512(_mm512_srli_epi32(m512Px, 8), m512Lo), m512CoG);
+                v[k] = _mm512_srli_epi32(_mm512_add_epi32(_mm512_add_epi32(m512BR, m512G), m512Round), 15);
             }
-#endif
+            __m512i m512Out = _mm512_packus_epi16(_mm512_packs_epi32(v[0], v[1]), _mm512_packs_epi32(v[2], v[3]));
+            m512Out = _mm512_permutexvar_epi32(m512Order, m512Out);
+            _mm512_storeu_si512((void*)(pDst + i * 64), m512Out);
         }
+        ToGray_AVX2(pSrc + iLoop * 64, pDst + iLoop * 64, nCount - iLoop * 64);
     }
 
-    int m_iWidth;
-    int m_iHeight;
-    unsigned char* m_pImage;
-    bool m_bGray;
+    // The vector loops stop while a full-width load still fits in the row, the tail goes scalar.
+    GBMP_TARGET("sse2")
+    static void RGB24ToRGB32_SSE2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iAlpha)
+    {
+        const __m128i m128Mask = _mm_set1_epi32(0x00ffffff);
+        const __m128i m128Alpha = _mm_set1_epi32((int)((uint32_t)iAlpha << 24));
+        int j = 0;
+        for (; j * 3 + 16 <= nWidth * 3; j += 4) {
+            __m128i m128S = _mm_loadu_si128((const __m128i*)(pSrc + j * 3));
+            __m128i m128P01 = _mm_unpacklo_epi32(m128S, _mm_srli_si128(m128S, 3));
+            __m128i m128P23 = _mm_unpacklo_epi32(_mm_srli_si128(m128S, 6), _mm_srli_si128(m128S, 9));
+            m128S = _mm_and_si128(_mm_unpacklo_epi64(m128P01, m128P23), m128Mask);
+            _mm_storeu_si128((__m128i*)(pDst + j * 4), _mm_or_si128(m128S, m128Alpha));
+        }
+        RGB24ToRGB32_Scalar(pSrc + j * 3, pDst + j * 4, nWidth - j, iAlpha);
+    }
+    GBMP_TARGET("ssse3")
+    static void RGB24ToRGB32_SSSE3(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iAlpha)
+    {
+        const __m128i m128Alpha = _mm_set1_epi32((int)((uint32_t)iAlpha << 24));
+        int j = 0;
+        for (; j * 3 + 16 <= nWidth * 3; j += 4) {
+            __m128i m128S = _mm_loadu_si128((const __m128i*)(pSrc + j * 3));
+            m128S = _mm_shuffle_epi8(m128S, _mm_set_epi8(-1, 11, 10, 9, -1, 8, 7, 6, -1, 5, 4, 3, -1, 2, 1, 0));
+            _mm_storeu_si128((__m128i*)(pDst + j * 4), _mm_or_si128(m128S, m128Alpha));
+        }
+        RGB24ToRGB32_Scalar(pSrc + j * 3, pDst + j * 4, nWidth - j, iAlpha);
+    }
+    GBMP_TARGET("avx2")
+    static void RGB24ToRGB32_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iAlpha)
+    {
+        const __m256i m256Spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+        const __m256i m256Shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m256i m256Alpha = _mm256_set1_epi32((int)((uint32_t)iAlpha << 24));
+        int j = 0;
+        for (; j * 3 + 32 <= nWidth * 3; j += 8) {
+            __m256i m256S = _mm256_loadu_si256((const __m256i*)(pSrc + j * 3));
+            m256S = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(m256S, m256Spread), m256Shuffle);
+            _mm256_storeu_si256((__m256i*)(pDst + j * 4), _mm256_or_si256(m256S, m256Alpha));
+        }
+        RGB24ToRGB32_SSSE3(pSrc + j * 3, pDst + j * 4, nWidth - j, iAlpha);
+    }
+    GBMP_TARGET("avx512f,avx512bw")
+    static void RGB24ToRGB32_AVX512BW(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iAlpha)
+    {
+        const __m512i m512Spread = _mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0);
+        const __m512i m512Shuffle = _mm512_set4_epi32((int)0xFF0B0A09, (int)0xFF080706, (int)0xFF050403, (int)0xFF020100);
+        const __m512i m512Alpha = _mm512_set1_epi32((int)((uint32_t)iAlpha << 24));
+        int j = 0;
+        for (; j * 3 + 48 <= nWidth * 3; j += 16) {
+            __m512i m512S = _mm512_maskz_loadu_epi8(0xFFFFFFFFFFFFull, pSrc + j * 3);
+            m512S = _mm512_shuffle_epi8(_mm512_permutexvar_epi32(m512Spread, m512S), m512Shuffle);
+            _mm512_storeu_si512((void*)(pDst + j * 4), _mm512_or_si512(m512S, m512Alpha));
+        }
+        RGB24ToRGB32_AVX2(pSrc + j * 3, pDst + j * 4, nWidth - j, iAlpha);
+    }
+    // Four 32-bit pixels packed into the low 12 bytes, the high 4 zero.
+    GBMP_TARGET("ssse3")
+    static __m128i PackRGB24_SSSE3(const unsigned char* pSrc)
+    {
+        return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)pSrc), _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+    }
+    GBMP_TARGET("ssse3")
+    static void RGB32ToRGB24_SSSE3(const unsigned char* pSrc, unsigned char* pDst, int nWidth)
+    {
+        int j = 0;
+        for (; j + 16 <= nWidth; j += 16) {
+            __m128i m128P0 = PackRGB24_SSSE3(pSrc + j * 4);
+            __m128i m128P1 = PackRGB24_SSSE3(pSrc + j * 4 + 16);
+            __m128i m128P2 = PackRGB24_SSSE3(pSrc + j * 4 + 32);
+            __m128i m128P3 = PackRGB24_SSSE3(pSrc + j * 4 + 48);
+            __m128i* pm128Dst = (__m128i*)(pDst + j * 3);
+            _mm_storeu_si128(pm128Dst, _mm_or_si128(m128P0, _mm_slli_si128(m128P1, 12)));
+            _mm_storeu_si128(pm128Dst + 1, _mm_or_si128(_mm_srli_si128(m128P1, 4), _mm_slli_si128(m128P2, 8)));
+            _mm_storeu_si128(pm128Dst + 2, _mm_or_si128(_mm_srli_si128(m128P2, 8), _mm_slli_si128(m128P3, 4)));
+        }
+        RGB32ToRGB24_Scalar(pSrc + j * 4, pDst + j * 3, nWidth - j);
+    }
+    // 8 pixels become 24 bytes at the bottom of the vector; the 32-byte store runs 8 bytes past them,
+    // which the next step or the tail overwrites, so the loop stops while the store stays in the row.
+    GBMP_TARGET("avx2")
+    static void RGB32ToRGB24_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth)
+    {
+        const __m256i m256Shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        const __m256i m256Gather = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+        int j = 0;
+        for (; j * 3 + 32 <= nWidth * 3; j += 8) {
+            __m256i m256S = _mm256_loadu_si256((const __m256i*)(pSrc + j * 4));
+            m256S = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(m256S, m256Shuffle), m256Gather);
+            _mm256_storeu_si256((__m256i*)(pDst + j * 3), m256S);
+        }
+        RGB32ToRGB24_SSSE3(pSrc + j * 4, pDst + j * 3, nWidth - j);
+    }
+    GBMP_TARGET("avx512f,avx512bw")
+    static void RGB32ToRGB24_AVX512BW(const unsigned char* pSrc, unsigned char* pDst, int nWidth)
+    {
+        const __m512i m512Shuffle = _mm512_set4_epi32((int)0xFFFFFFFF, 0x0E0D0C0A, 0x09080605, 0x04020100);
+        const __m512i m512Gather = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 3, 7, 11, 15);
+        int j = 0;
+        for (; j + 16 <= nWidth; j += 16) {
+            __m512i m512S = _mm512_loadu_si512((const void*)(pSrc + j * 4));
+            m512S = _mm512_permutexvar_epi32(m512Gather, _mm512_shuffle_epi8(m512S, m512Shuffle));
+            _mm512_mask_storeu_epi8(pDst + j * 3, 0xFFFFFFFFFFFFull, m512S);
+        }
+        RGB32ToRGB24_AVX2(pSrc + j * 4, pDst + j * 3, nWidth - j);
+    }
+    // B and R sit in the low bytes of the two 16-bit halves of a pixel: swap the halves, keep their
+    // low bytes and the high bytes (G, A) of the original.
+    GBMP_TARGET("sse2")
+    static void SwapRB32_SSE2(const unsigned char* pSrc, unsigned char* pDst, size_t nCount)
+    {
+        const __m128i m128Lo = _mm_set1_epi16(0x00FF);
+        size_t i = 0;
+        for (; i + 4 <= nCount; i += 4) {
+            __m128i m128S = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+            __m128i m128W = _mm_shufflehi_epi16(_mm_shufflelo_epi16(m128S, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+            _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_or_si128(_mm_and_si128(m128W, m128Lo), _mm_andnot_si128(m128Lo, m128S)));
+        }
+        SwapRB32_Scalar(pSrc + i * 4, pDst + i * 4, nCount - i);
+    }
+    GBMP_TARGET("ssse3")
+    static void SwapRB32_SSSE3(const unsigned char* pSrc, unsigned char* pDst, size_t nCount)
+    {
+        const __m128i m128Shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        size_t i = 0;
+        for (; i + 4 <= nCount; i += 4) {
+            __m128i m128S = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+            _mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_shuffle_epi8(m128S, m128Shuffle));
+        }
+        SwapRB32_Scalar(pSrc + i * 4, pDst + i * 4, nCount - i);
+    }
+    GBMP_TARGET("avx2")
+    static void SwapRB32_AVX2(const unsigned char* pSrc, unsigned char* pDst, size_t nCount)
+    {
+        const __m256i m256Shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        size_t i = 0;
+        for (; i + 8 <= nCount; i += 8) {
+            __m256i m256S = _mm256_loadu_si256((const __m256i*)(pSrc + i * 4));
+            _mm256_storeu_si256((__m256i*)(pDst + i * 4), _mm256_shuffle_epi8(m256S, m256Shuffle));
+        }
+        SwapRB32_SSSE3(pSrc + i * 4, pDst + i * 4, nCount - i);
+    }
+    GBMP_TARGET("avx512f,avx512bw")
+    static void SwapRB32_AVX512BW(const unsigned char* pSrc, unsigned char* pDst, size_t nCount)
+    {
+        const __m512i m512Shuffle = _mm512_set4_epi32(0x0F0C0D0E, 0x0B08090A, 0x07040506, 0x03000102);
+        size_t i = 0;
+        for (; i + 16 <= nCount; i += 16) {
+            __m512i m512S = _mm512_loadu_si512((const void*)(pSrc + i * 4));
+            _mm512_storeu_si512((void*)(pDst + i * 4), _mm512_shuffle_epi8(m512S, m512Shuffle));
+        }
+        SwapRB32_AVX2(pSrc + i * 4, pDst + i * 4, nCount - i);
+    }
+    // Every step loads its 16 gray bytes before storing the 64 output bytes, which keeps the in-place
+    // expansion from the last quarter of the row correct.
+    GBMP_TARGET("sse2")
+    static void GrayToRGB32_SSE2(const unsigned char* pSrc, unsigned char* pDst, size_t nCount, unsigned char iAlpha)
+    {
+        const __m128i m128Alpha = _mm_set1_epi8((char)iAlpha);
+        size_t i = 0;
+        for (; i + 16 <= nCount; i += 16) {
+            __m128i m128G = _mm_loadu_si128((const __m128i*)(pSrc + i));
+            __m128i m128GGLo = _mm_unpacklo_epi8(m128G, m128G);
+            __m128i m128GGHi = _mm_unpackhi_epi8(m128G, m128G);
+            __m128i m128GALo = _mm_unpacklo_epi8(m128G, m128Alpha);
+            __m128i m128GAHi = _mm_unpackhi_epi8(m128G, m128Alpha);
+            __m128i* pm128Dst = (__m128i*)(pDst + i * 4);
+            _mm_storeu_si128(pm128Dst, _mm_unpacklo_epi16(m128GGLo, m128GALo));
+            _mm_storeu_si128(pm128Dst + 1, _mm_unpackhi_epi16(m128GGLo, m128GALo));
+            _mm_storeu_si128(pm128Dst + 2, _mm_unpacklo_epi16(m128GGHi, m128GAHi));
+            _mm_storeu_si128(pm128Dst + 3, _mm_unpackhi_epi16(m128GGHi, m128GAHi));
+        }
+        GrayToRGB32_Scalar(pSrc + i, pDst + i * 4, nCount - i, iAlpha);
+    }
+    GBMP_TARGET("avx2")
+    static void GrayToRGB32_AVX2(const unsigned char* pSrc, unsigned char* pDst, size_t nCount, unsigned char iAlpha)
+    {
+        const __m256i m256Lo = _mm256_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1,
+            4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1);
+        const __m256i m256Hi = _mm256_setr_epi8(8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1,
+            12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1);
+        const __m256i m256Alpha = _mm256_set1_epi32((int)((uint32_t)iAlpha << 24));
+        size_t i = 0;
+        for (; i + 16 <= nCount; i += 16) {
+            __m256i m256G = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(pSrc + i)));
+            __m256i* pm256Dst = (__m256i*)(pDst + i * 4);
+            _mm256_storeu_si256(pm256Dst, _mm256_or_si256(_mm256_shuffle_epi8(m256G, m256Lo), m256Alpha));
+            _mm256_storeu_si256(pm256Dst + 1, _mm256_or_si256(_mm256_shuffle_epi8(m256G, m256Hi), m256Alpha));
+        }
+        GrayToRGB32_SSE2(pSrc + i, pDst + i * 4, nCount - i, iAlpha);
+    }
+
+    // pLo[i] trades places with pHi[nCount - 1 - i], one vector from each side per step; the rest
+    // goes to the next narrower kernel. Reversing n items is pLo = p, pHi = p + n - n / 2, nCount = n / 2.
+    GBMP_TARGET("sse2")
+    static __m128i Reverse8x16_SSE2(__m128i v)
+    {
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+    GBMP_TARGET("sse2")
+    static void Reverse8_SSE2(unsigned char* pLo, unsigned char* pHi, size_t nCount)
+    {
+        size_t iLoop = nCount / 16;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m128i* pm128Top = (__m128i*)(pLo + i * 16);
+            __m128i* pm128Bot = (__m128i*)(pHi + nCount - i * 16 - 16);
+            __m128i m128Top = Reverse8x16_SSE2(_mm_loadu_si128(pm128Top));
+            __m128i m128Bot = Reverse8x16_SSE2(_mm_loadu_si128(pm128Bot));
+            _mm_storeu_si128(pm128Top, m128Bot);
+            _mm_storeu_si128(pm128Bot, m128Top);
+        }
+        Reverse8_Scalar(pLo + iLoop * 16, pHi, nCount - iLoop * 16);
+    }
+    GBMP_TARGET("ssse3")
+    static void Reverse8_SSSE3(unsigned char* pLo, unsigned char* pHi, size_t nCount)
+    {
+        const __m128i m128Rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        size_t iLoop = nCount / 16;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m128i* pm128Top = (__m128i*)(pLo + i * 16);
+            __m128i* pm128Bot = (__m128i*)(pHi + nCount - i * 16 - 16);
+            __m128i m128Top = _mm_shuffle_epi8(_mm_loadu_si128(pm128Top), m128Rev);
+            __m128i m128Bot = _mm_shuffle_epi8(_mm_loadu_si128(pm128Bot), m128Rev);
+            _mm_storeu_si128(pm128Top, m128Bot);
+            _mm_storeu_si128(pm128Bot, m128Top);
+        }
+        Reverse8_Scalar(pLo + iLoop * 16, pHi, nCount - iLoop * 16);
+    }
+    GBMP_TARGET("avx2")
+    static void Reverse8_AVX2(unsigned char* pLo, unsigned char* pHi, size_t nCount)
+    {
+        const __m256i m256Rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        size_t iLoop = nCount / 32;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m256i* pm256Top = (__m256i*)(pLo + i * 32);
+            __m256i* pm256Bot = (__m256i*)(pHi + nCount - i * 32 - 32);
+            __m256i m256Top = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(_mm256_loadu_si256(pm256Top), m256Rev), 0x4E);
+            __m256i m256Bot = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(_mm256_loadu_si256(pm256Bot), m256Rev), 0x4E);
+            _mm256_storeu_si256(pm256Top, m256Bot);
+            _mm256_storeu_si256(pm256Bot, m256Top);
+        }
+        Reverse8_SSSE3(pLo + iLoop * 32, pHi, nCount - iLoop * 32);
+    }
+    GBMP_TARGET("avx512f,avx512bw")
+    static void Reverse8_AVX512BW(unsigned char* pLo, unsigned char* pHi, size_t nCount)
+    {
+        const __m512i m512Rev = _mm512_set4_epi32(0x00010203, 0x04050607, 0x08090A0B, 0x0C0D0E0F);
+        size_t iLoop = nCount / 64;
+        for (size_t i = 0; i < iLoop; i++) {
+            unsigned char* pTop = pLo + i * 64;
+            unsigned char* pBot = pHi + nCount - i * 64 - 64;
+            __m512i m512Top = _mm512_shuffle_epi8(_mm512_loadu_si512((const void*)pTop), m512Rev);
+            __m512i m512Bot = _mm512_shuffle_epi8(_mm512_loadu_si512((const void*)pBot), m512Rev);
+            m512Top = _mm512_shuffle_i64x2(m512Top, m512Top, _MM_SHUFFLE(0, 1, 2, 3));
+            m512Bot = _mm512_shuffle_i64x2(m512Bot, m512Bot, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm512_storeu_si512((void*)pTop, m512Bot);
+            _mm512_storeu_si512((void*)pBot, m512Top);
+        }
+        Reverse8_AVX2(pLo + iLoop * 64, pHi, nCount - iLoop * 64);
+    }
+    GBMP_TARGET("sse2")
+    static void Reverse32_SSE2(uint32_t* pLo, uint32_t* pHi, size_t nCount)
+    {
+        size_t iLoop = nCount / 4;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m128i* pm128Top = (__m128i*)(pLo + i * 4);
+            __m128i* pm128Bot = (__m128i*)(pHi + nCount - i * 4 - 4);
+            __m128i m128Top = _mm_shuffle_epi32(_mm_loadu_si128(pm128Top), _MM_SHUFFLE(0, 1, 2, 3));
+            __m128i m128Bot = _mm_shuffle_epi32(_mm_loadu_si128(pm128Bot), _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128(pm128Top, m128Bot);
+            _mm_storeu_si128(pm128Bot, m128Top);
+        }
+        Reverse32_Scalar(pLo + iLoop * 4, pHi, nCount - iLoop * 4);
+    }
+    GBMP_TARGET("avx2")
+    static void Reverse32_AVX2(uint32_t* pLo, uint32_t* pHi, size_t nCount)
+    {
+        const __m256i m256Rev = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+        size_t iLoop = nCount / 8;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m256i* pm256Top = (__m256i*)(pLo + i * 8);
+            __m256i* pm256Bot = (__m256i*)(pHi + nCount - i * 8 - 8);
+            __m256i m256Top = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(pm256Top), m256Rev);
+            __m256i m256Bot = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(pm256Bot), m256Rev);
+            _mm256_storeu_si256(pm256Top, m256Bot);
+            _mm256_storeu_si256(pm256Bot, m256Top);
+        }
+        Reverse32_SSE2(pLo + iLoop * 8, pHi, nCount - iLoop * 8);
+    }
+    GBMP_TARGET("avx512f,avx512bw")
+    static void Reverse32_AVX512BW(uint32_t* pLo, uint32_t* pHi, size_t nCount)
+    {
+        const __m512i m512Rev = _mm512_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        size_t iLoop = nCount / 16;
+        for (size_t i = 0; i < iLoop; i++) {
+            uint32_t* pTop = pLo + i * 16;
+            uint32_t* pBot = pHi + nCount - i * 16 - 16;
+            __m512i m512Top = _mm512_permutexvar_epi32(m512Rev, _mm512_loadu_si512((const void*)pTop));
+            __m512i m512Bot = _mm512_permutexvar_epi32(m512Rev, _mm512_loadu_si512((const void*)pBot));
+            _mm512_storeu_si512((void*)pTop, m512Bot);
+            _mm512_storeu_si512((void*)pBot, m512Top);
+        }
+        Reverse32_AVX2(pLo + iLoop * 16, pHi, nCount - iLoop * 16);
+    }
+
+    GBMP_TARGET("sse2")
+    static void Bit1ToGray8_SSE2(const unsigned char* pSrc, unsigned char* pDst, int nWidth)
+    {
+        // each of 2 bytes spreads over 8 lanes, a lane keeps the bit it stands for.
+        const __m128i m128Bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        int iLoop = nWidth / 16;
+        for (int i = 0; i < iLoop; i++) {
+            __m128i v = _mm_cvtsi32_si128(pSrc[i * 2] | (pSrc[i * 2 + 1] << 8));
+            v = _mm_unpacklo_epi8(v, v);
+            v = _mm_unpacklo_epi16(v, v);
+            v = _mm_unpacklo_epi32(v, v);
+            v = _mm_cmpeq_epi8(_mm_and_si128(v, m128Bits), m128Bits);
+            _mm_storeu_si128((__m128i*)(pDst + i * 16), v);
+        }
+        Bit1ToGray8_Scalar(pSrc + iLoop * 2, pDst + iLoop * 16, nWidth - iLoop * 16);
+    }
+    GBMP_TARGET("sse2")
+    static void GrayToBit1_SSE2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iThreshold)
+    {
+        const unsigned char* pReverse = BitReverseTable();
+        const __m128i m128Thr = _mm_set1_epi8((char)iThreshold);
+        int iLoop = nWidth / 16;
+        for (int i = 0; i < iLoop; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 16));
+            int iMask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, m128Thr), v));
+            pDst[i * 2] = pReverse[iMask & 0xFF];
+            pDst[i * 2 + 1] = pReverse[iMask >> 8];
+        }
+        GrayToBit1_Scalar(pSrc + iLoop * 16, pDst + iLoop * 2, nWidth - iLoop * 16, iThreshold);
+    }
+    GBMP_TARGET("ssse3")
+    static void GrayToBit1_SSSE3(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iThreshold)
+    {
+        // pixels reversed within each group of 8 make movemask come out leftmost-pixel-high.
+        const __m128i m128Order = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+        const __m128i m128Thr = _mm_set1_epi8((char)iThreshold);
+        int iLoop = nWidth / 16;
+        for (int i = 0; i < iLoop; i++) {
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pSrc + i * 16)), m128Order);
+            uint16_t iMask = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, m128Thr), v));
+            memcpy(pDst + i * 2, &iMask, 2);
+        }
+        GrayToBit1_Scalar(pSrc + iLoop * 16, pDst + iLoop * 2, nWidth - iLoop * 16, iThreshold);
+    }
+    GBMP_TARGET("avx2")
+    static void Bit1ToGray8_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth)
+    {
+        const __m256i m256Spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+        const __m256i m256Bits = _mm256_set1_epi64x((long long)0x0102040810204080ULL);
+        int iLoop = nWidth / 32;
+        for (int i = 0; i < iLoop; i++) {
+            int iBytes;
+            memcpy(&iBytes, pSrc + i * 4, 4);
+            __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(iBytes), m256Spread);
+            v = _mm256_cmpeq_epi8(_mm256_and_si256(v, m256Bits), m256Bits);
+            _mm256_storeu_si256((__m256i*)(pDst + i * 32), v);
+        }
+        Bit1ToGray8_SSE2(pSrc + iLoop * 4, pDst + iLoop * 32, nWidth - iLoop * 32);
+    }
+    GBMP_TARGET("avx2")
+    static void GrayToBit1_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iThreshold)
+    {
+        const __m256i m256Order = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+            8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i m256Thr = _mm256_set1_epi8((char)iThreshold);
+        int iLoop = nWidth / 32;
+        for (int i = 0; i < iLoop; i++) {
+            __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(pSrc + i * 32)), m256Order);
+            uint32_t iMask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, m256Thr), v));
+            memcpy(pDst + i * 4, &iMask, 4);
+        }
+        GrayToBit1_SSSE3(pSrc + iLoop * 32, pDst + iLoop * 4, nWidth - iLoop * 32, iThreshold);
+    }
+    GBMP_TARGET("avx512f,avx512bw")
+    static void GrayToBit1_AVX512BW(const unsigned char* pSrc, unsigned char* pDst, int nWidth, unsigned char iThreshold)
+    {
+        const long long iLo = 0x0001020304050607LL, iHi = 0x08090A0B0C0D0E0FLL;
+        const __m512i m512Order = _mm512_set_epi64(iHi, iLo, iHi, iLo, iHi, iLo, iHi, iLo);
+        const __m512i m512Thr = _mm512_set1_epi8((char)iThreshold);
+        int iLoop = nWidth / 64;
+        for (int i = 0; i < iLoop; i++) {
+            __m512i v = _mm512_shuffle_epi8(_mm512_loadu_si512((const void*)(pSrc + i * 64)), m512Order);
+            uint64_t iMask = _mm512_cmpge_epu8_mask(v, m512Thr);
+            memcpy(pDst + i * 8, &iMask, 8);
+        }
+        GrayToBit1_AVX2(pSrc + iLoop * 64, pDst + iLoop * 8, nWidth - iLoop * 64, iThreshold);
+    }
+
+    GBMP_TARGET("sse2")
+    static void Halve8_SSE2(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst)
+    {
+        const __m128i m128Lo = _mm_set1_epi16(0x00FF);
+        const __m128i m128Two = _mm_set1_epi16(2);
+        size_t iLoop = nDst / 16;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m128i s[2];
+            for (int h = 0; h < 2; h++) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(pLn0 + i * 32 + h * 16));
+                __m128i b = _mm_loadu_si128((const __m128i*)(pLn1 + i * 32 + h * 16));
+                __m128i v = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, m128Lo), _mm_srli_epi16(a, 8)),
+                    _mm_add_epi16(_mm_and_si128(b, m128Lo), _mm_srli_epi16(b, 8)));
+                s[h] = _mm_srli_epi16(_mm_add_epi16(v, m128Two), 2);
+            }
+            _mm_storeu_si128((__m128i*)(pDst + i * 16), _mm_packus_epi16(s[0], s[1]));
+        }
+        Halve8_Scalar(pLn0 + iLoop * 32, pLn1 + iLoop * 32, pDst + iLoop * 16, nDst - iLoop * 16);
+    }
+    // Channels of pixel pairs side by side in 16-bit lanes, the two 64-bit halves summed crosswise.
+    GBMP_TARGET("sse2")
+    static void Halve32_SSE2(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst)
+    {
+        const __m128i m128Zero = _mm_setzero_si128();
+        const __m128i m128Two = _mm_set1_epi16(2);
+        size_t iLoop = nDst / 4;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m128i s[2];
+            for (int h = 0; h < 2; h++) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(pLn0 + i * 32 + h * 16));
+                __m128i b = _mm_loadu_si128((const __m128i*)(pLn1 + i * 32 + h * 16));
+                __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, m128Zero), _mm_unpacklo_epi8(b, m128Zero));
+                __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, m128Zero), _mm_unpackhi_epi8(b, m128Zero));
+                __m128i v = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+                s[h] = _mm_srli_epi16(_mm_add_epi16(v, m128Two), 2);
+            }
+            _mm_storeu_si128((__m128i*)(pDst + i * 16), _mm_packus_epi16(s[0], s[1]));
+        }
+        Halve32_Scalar(pLn0 + iLoop * 32, pLn1 + iLoop * 32, pDst + iLoop * 16, nDst - iLoop * 4);
+    }
+    // Even and odd bytes split into 16-bit lanes, whose squares still fit 16 bits unsigned; the 32-bit halves
+    // of those lanes then hold offsets 0, 2 and 1, 3. 32-bit lane sums are flushed every 4096 vectors.
+    GBMP_TARGET("sse2")
+    static void ByteSums_SSE2(const unsigned char* pSrc, size_t nBytes, GByteSums& sums)
+    {
+        const __m128i m128Lo16 = _mm_set1_epi16(0x00FF);
+        const __m128i m128Lo32 = _mm_set1_epi32(0xFFFF);
+        const int iOffset[4] = { 0, 2, 1, 3 };
+        __m128i vMin = _mm_set1_epi8(-1), vMax = _mm_setzero_si128();
+        size_t iLoop = nBytes / 16;
+        for (size_t i = 0; i < iLoop;) {
+            size_t iEnd = (std::min)(iLoop, i + 4096);
+            __m128i sum[4], sq[4];
+            for (int k = 0; k < 4; k++) {
+                sum[k] = sq[k] = _mm_setzero_si128();
+            }
+            for (; i < iEnd; i++) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 16));
+                vMin = _mm_min_epu8(vMin, v);
+                vMax = _mm_max_epu8(vMax, v);
+                __m128i even = _mm_and_si128(v, m128Lo16), odd = _mm_srli_epi16(v, 8);
+                __m128i evenSq = _mm_mullo_epi16(even, even), oddSq = _mm_mullo_epi16(odd, odd);
+                sum[0] = _mm_add_epi32(sum[0], _mm_and_si128(even, m128Lo32));
+                sum[1] = _mm_add_epi32(sum[1], _mm_srli_epi32(even, 16));
+                sum[2] = _mm_add_epi32(sum[2], _mm_and_si128(odd, m128Lo32));
+                sum[3] = _mm_add_epi32(sum[3], _mm_srli_epi32(odd, 16));
+                sq[0] = _mm_add_epi32(sq[0], _mm_and_si128(evenSq, m128Lo32));
+                sq[1] = _mm_add_epi32(sq[1], _mm_srli_epi32(evenSq, 16));
+                sq[2] = _mm_add_epi32(sq[2], _mm_and_si128(oddSq, m128Lo32));
+                sq[3] = _mm_add_epi32(sq[3], _mm_srli_epi32(oddSq, 16));
+            }
+            for (int k = 0; k < 4; k++) {
+                uint32_t lanes[8];
+                _mm_storeu_si128((__m128i*)lanes, sum[k]);
+                _mm_storeu_si128((__m128i*)(lanes + 4), sq[k]);
+                sums.nSum[iOffset[k]] += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+                sums.nSumSq[iOffset[k]] += (uint64_t)lanes[4] + lanes[5] + lanes[6] + lanes[7];
+            }
+        }
+        unsigned char mins[16], maxs[16];
+        _mm_storeu_si128((__m128i*)mins, vMin);
+        _mm_storeu_si128((__m128i*)maxs, vMax);
+        for (int j = 0; j < 16; j++) {
+            sums.iMin[j & 3] = (std::min)(sums.iMin[j & 3], mins[j]);
+            sums.iMax[j & 3] = (std::max)(sums.iMax[j & 3], maxs[j]);
+        }
+        ByteSums_Scalar(pSrc + iLoop * 16, nBytes - iLoop * 16, sums);
+    }
+    // Two-tap rows, 8 output pixels at a time: the 16 taps lie within the 16 source bytes that end on the
+    // last one, and their offsets from the start become a pshufb control that lines the bytes up with their
+    // weights for madd. Groups spread wider, or ending before byte 15, take the scalar loop, as does any other
+    // tap count. Nothing past the last tap is read.
+    GBMP_TARGET("ssse3")
+    static void ResizeH8_SSSE3(const unsigned char* pSrc, int16_t* pDst, const int* pIndex, const int16_t* pWeights, int nTaps, int nWidth)
+    {
+        if (nTaps != 2) {
+            ResizeH_Scalar<1>(pSrc, pDst, pIndex, pWeights, nTaps, nWidth);
+            return;
+        }
+        const __m128i m128Far = _mm_set1_epi32(~15);
+        const __m128i m128Zero = _mm_setzero_si128();
+        int iLoop = nWidth / 8;
+        for (int i = 0; i < iLoop; i++) {
+            const int* pIdx = pIndex + i * 16;
+            int iBase = pIdx[15] - 15;
+            __m128i m128Base = _mm_set1_epi32(iBase);
+            __m128i d[4];
+            __m128i any = m128Zero;
+            for (int k = 0; k < 4; k++) {
+                d[k] = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(pIdx + k * 4)), m128Base);
+                any = _mm_or_si128(any, d[k]);
+            }
+            if (iBase < 0 || _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, m128Far), m128Zero)) != 0xFFFF) {
+                ResizeH_Scalar<1>(pSrc, pDst + i * 8, pIdx, pWeights + i * 16, 2, 8);
+                continue;
+            }
+            __m128i ctrl = _mm_packus_epi16(_mm_packs_epi32(d[0], d[1]), _mm_packs_epi32(d[2], d[3]));
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pSrc + iBase)), ctrl);
+            __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(v, m128Zero), _mm_loadu_si128((const __m128i*)(pWeights + i * 16)));
+            __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(v, m128Zero), _mm_loadu_si128((const __m128i*)(pWeights + i * 16 + 8)));
+            _mm_storeu_si128((__m128i*)(pDst + i * 8), _mm_packs_epi32(lo, hi));
+        }
+        ResizeH_Scalar<1>(pSrc, pDst + iLoop * 8, pIndex + iLoop * 16, pWeights + iLoop * 16, 2, nWidth - iLoop * 8);
+    }
+    // Two source pixels interleave channel by channel so one madd applies a pair of taps to all four channels.
+    GBMP_TARGET("sse2")
+    static void ResizeH32_SSE2(const unsigned char* pSrc, int16_t* pDst, const int* pIndex, const int16_t* pWeights, int nTaps, int nWidth)
+    {
+        const __m128i m128Zero = _mm_setzero_si128();
+        for (int x = 0; x < nWidth; x++, pIndex += nTaps, pWeights += nTaps) {
+            __m128i sum = m128Zero;
+            for (int t = 0; t < nTaps; t += 2) {
+                bool bPair = t + 1 < nTaps;
+                int iPxl0, iPxl1 = 0;
+                memcpy(&iPxl0, pSrc + pIndex[t] * 4, 4);
+                if (bPair) {
+                    memcpy(&iPxl1, pSrc + pIndex[t + 1] * 4, 4);
+                }
+                __m128i v = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(iPxl0), _mm_cvtsi32_si128(iPxl1)), m128Zero);
+                __m128i w = _mm_set1_epi32((int)(uint16_t)pWeights[t] | ((bPair ? pWeights[t + 1] : 0) << 16));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(v, w));
+            }
+            _mm_storel_epi64((__m128i*)(pDst + x * 4), _mm_packs_epi32(sum, sum));
+        }
+    }
+    // Taps go in pairs through madd, an odd last tap pairs with a zero weight.
+    GBMP_TARGET("sse2")
+    static void ResizeV_SSE2(const int16_t* const* ppRows, const int16_t* pWeights, int nTaps, unsigned char* pDst, size_t nCount)
+    {
+        const __m128i m128Round = _mm_set1_epi32(1 << 20);
+        size_t iLoop = nCount / 8;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m128i lo = m128Round, hi = m128Round;
+            for (int t = 0; t < nTaps; t += 2) {
+                bool bPair = t + 1 < nTaps;
+                __m128i r0 = _mm_loadu_si128((const __m128i*)(ppRows[t] + i * 8));
+                __m128i r1 = bPair ? _mm_loadu_si128((const __m128i*)(ppRows[t + 1] + i * 8)) : _mm_setzero_si128();
+                __m128i w = _mm_set1_epi32((int)(uint16_t)pWeights[t] | ((bPair ? pWeights[t + 1] : 0) << 16));
+                lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(r0, r1), w));
+                hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(r0, r1), w));
+            }
+            __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, 21), _mm_srai_epi32(hi, 21));
+            _mm_storel_epi64((__m128i*)(pDst + i * 8), _mm_packus_epi16(v, v));
+        }
+        for (size_t i = iLoop * 8; i < nCount; i++) {
+            int iSum = 1 << 20;
+            for (int t = 0; t < nTaps; t++) {
+                iSum += ppRows[t][i] * pWeights[t];
+            }
+            pDst[i] = (unsigned char)(std::min)(iSum >> 21, 255);
+        }
+    }
+    // 32-bit products of 16-bit values are the interleaved low and high halves from mullo and mulhi.
+    GBMP_TARGET("sse2")
+    static void AreaSum_SSE2(const unsigned char* pSrc, uint32_t w, uint32_t* pSum, size_t nCount)
+    {
+        if (w > 0xFFFF) {
+            AreaSum_Scalar(pSrc, w, pSum, nCount);
+            return;
+        }
+        const __m128i m128W = _mm_set1_epi16((short)w);
+        const __m128i m128Zero = _mm_setzero_si128();
+        size_t iLoop = nCount / 16;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 16));
+            __m128i* pOut = (__m128i*)(pSum + i * 16);
+            for (int h = 0; h < 2; h++) {
+                __m128i x = h == 0 ? _mm_unpacklo_epi8(v, m128Zero) : _mm_unpackhi_epi8(v, m128Zero);
+                __m128i lo = _mm_mullo_epi16(x, m128W);
+                __m128i hi = _mm_mulhi_epu16(x, m128W);
+                _mm_storeu_si128(pOut + h * 2, _mm_add_epi32(_mm_loadu_si128(pOut + h * 2), _mm_unpacklo_epi16(lo, hi)));
+                _mm_storeu_si128(pOut + h * 2 + 1, _mm_add_epi32(_mm_loadu_si128(pOut + h * 2 + 1), _mm_unpackhi_epi16(lo, hi)));
+            }
+        }
+        AreaSum_Scalar(pSrc + iLoop * 16, w, pSum + iLoop * 16, nCount - iLoop * 16);
+    }
+    // packus interleaves the 128-bit lanes of its two sources, permute4x64 puts the qwords back in order.
+    GBMP_TARGET("avx2")
+    static void Halve8_AVX2(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst)
+    {
+        const __m256i m256Lo = _mm256_set1_epi16(0x00FF);
+        const __m256i m256Two = _mm256_set1_epi16(2);
+        size_t iLoop = nDst / 32;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m256i s[2];
+            for (int h = 0; h < 2; h++) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(pLn0 + i * 64 + h * 32));
+                __m256i b = _mm256_loadu_si256((const __m256i*)(pLn1 + i * 64 + h * 32));
+                __m256i v = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a, m256Lo), _mm256_srli_epi16(a, 8)),
+                    _mm256_add_epi16(_mm256_and_si256(b, m256Lo), _mm256_srli_epi16(b, 8)));
+                s[h] = _mm256_srli_epi16(_mm256_add_epi16(v, m256Two), 2);
+            }
+            __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(s[0], s[1]), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i*)(pDst + i * 32), v);
+        }
+        Halve8_SSE2(pLn0 + iLoop * 64, pLn1 + iLoop * 64, pDst + iLoop * 32, nDst - iLoop * 32);
+    }
+    GBMP_TARGET("avx2")
+    static void Halve32_AVX2(const unsigned char* pLn0, const unsigned char* pLn1, unsigned char* pDst, size_t nDst)
+    {
+        const __m256i m256Zero = _mm256_setzero_si256();
+        const __m256i m256Two = _mm256_set1_epi16(2);
+        size_t iLoop = nDst / 8;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m256i s[2];
+            for (int h = 0; h < 2; h++) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(pLn0 + i * 64 + h * 32));
+                __m256i b = _mm256_loadu_si256((const __m256i*)(pLn1 + i * 64 + h * 32));
+                __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, m256Zero), _mm256_unpacklo_epi8(b, m256Zero));
+                __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, m256Zero), _mm256_unpackhi_epi8(b, m256Zero));
+                __m256i v = _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_unpackhi_epi64(lo, hi));
+                s[h] = _mm256_srli_epi16(_mm256_add_epi16(v, m256Two), 2);
+            }
+            __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(s[0], s[1]), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i*)(pDst + i * 32), v);
+        }
+        Halve32_SSE2(pLn0 + iLoop * 64, pLn1 + iLoop * 64, pDst + iLoop * 32, nDst - iLoop * 8);
+    }
+    GBMP_TARGET("avx2")
+    static void ByteSums_AVX2(const unsigned char* pSrc, size_t nBytes, GByteSums& sums)
+    {
+        const __m256i m256Lo16 = _mm256_set1_epi16(0x00FF);
+        const __m256i m256Lo32 = _mm256_set1_epi32(0xFFFF);
+        const int iOffset[4] = { 0, 2, 1, 3 };
+        __m256i vMin = _mm256_set1_epi8(-1), vMax = _mm256_setzero_si256();
+        size_t iLoop = nBytes / 32;
+        for (size_t i = 0; i < iLoop;) {
+            size_t iEnd = (std::min)(iLoop, i + 4096);
+            __m256i sum[4], sq[4];
+            for (int k = 0; k < 4; k++) {
+                sum[k] = sq[k] = _mm256_setzero_si256();
+            }
+            for (; i < iEnd; i++) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(pSrc + i * 32));
+                vMin = _mm256_min_epu8(vMin, v);
+                vMax = _mm256_max_epu8(vMax, v);
+                __m256i even = _mm256_and_si256(v, m256Lo16), odd = _mm256_srli_epi16(v, 8);
+                __m256i evenSq = _mm256_mullo_epi16(even, even), oddSq = _mm256_mullo_epi16(odd, odd);
+                sum[0] = _mm256_add_epi32(sum[0], _mm256_and_si256(even, m256Lo32));
+                sum[1] = _mm256_add_epi32(sum[1], _mm256_srli_epi32(even, 16));
+                sum[2] = _mm256_add_epi32(sum[2], _mm256_and_si256(odd, m256Lo32));
+                sum[3] = _mm256_add_epi32(sum[3], _mm256_srli_epi32(odd, 16));
+                sq[0] = _mm256_add_epi32(sq[0], _mm256_and_si256(evenSq, m256Lo32));
+                sq[1] = _mm256_add_epi32(sq[1], _mm256_srli_epi32(evenSq, 16));
+                sq[2] = _mm256_add_epi32(sq[2], _mm256_and_si256(oddSq, m256Lo32));
+                sq[3] = _mm256_add_epi32(sq[3], _mm256_srli_epi32(oddSq, 16));
+            }
+            for (int k = 0; k < 4; k++) {
+                uint32_t lanes[16];
+                _mm256_storeu_si256((__m256i*)lanes, sum[k]);
+                _mm256_storeu_si256((__m256i*)(lanes + 8), sq[k]);
+                for (int j = 0; j < 8; j++) {
+                    sums.nSum[iOffset[k]] += lanes[j];
+                    sums.nSumSq[iOffset[k]] += lanes[8 + j];
+                }
+            }
+        }
+        unsigned char mins[32], maxs[32];
+        _mm256_storeu_si256((__m256i*)mins, vMin);
+        _mm256_storeu_si256((__m256i*)maxs, vMax);
+        for (int j = 0; j < 32; j++) {
+            sums.iMin[j & 3] = (std::min)(sums.iMin[j & 3], mins[j]);
+            sums.iMax[j & 3] = (std::max)(sums.iMax[j & 3], maxs[j]);
+        }
+        ByteSums_SSE2(pSrc + iLoop * 32, nBytes - iLoop * 32, sums);
+    }
+    GBMP_TARGET("avx2")
+    static void ResizeV_AVX2(const int16_t* const* ppRows, const int16_t* pWeights, int nTaps, unsigned char* pDst, size_t nCount)
+    {
+        const __m256i m256Round = _mm256_set1_epi32(1 << 20);
+        size_t iLoop = nCount / 16;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m256i lo = m256Round, hi = m256Round;
+            for (int t = 0; t < nTaps; t += 2) {
+                bool bPair = t + 1 < nTaps;
+                __m256i r0 = _mm256_loadu_si256((const __m256i*)(ppRows[t] + i * 16));
+                __m256i r1 = bPair ? _mm256_loadu_si256((const __m256i*)(ppRows[t + 1] + i * 16)) : _mm256_setzero_si256();
+                __m256i w = _mm256_set1_epi32((int)(uint16_t)pWeights[t] | ((bPair ? pWeights[t + 1] : 0) << 16));
+                lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(r0, r1), w));
+                hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(r0, r1), w));
+            }
+            __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(lo, 21), _mm256_srai_epi32(hi, 21));
+            v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i*)(pDst + i * 16), _mm256_castsi256_si128(v));
+        }
+        for (size_t i = iLoop * 16; i < nCount; i++) {
+            int iSum = 1 << 20;
+            for (int t = 0; t < nTaps; t++) {
+                iSum += ppRows[t][i] * pWeights[t];
+            }
+            pDst[i] = (unsigned char)(std::min)(iSum >> 21, 255);
+        }
+    }
+    // As ResizeH8_SSSE3, the offsets packed with lane-crossing fixups and the 16 taps multiplied in one register.
+    GBMP_TARGET("avx2")
+    static void ResizeH8_AVX2(const unsigned char* pSrc, int16_t* pDst, const int* pIndex, const int16_t* pWeights, int nTaps, int nWidth)
+    {
+        if (nTaps != 2) {
+            ResizeH_Scalar<1>(pSrc, pDst, pIndex, pWeights, nTaps, nWidth);
+            return;
+        }
+        const __m256i m256Far = _mm256_set1_epi32(~15);
+        int iLoop = nWidth / 8;
+        for (int i = 0; i < iLoop; i++) {
+            const int* pIdx = pIndex + i * 16;
+            int iBase = pIdx[15] - 15;
+            __m256i m256Base = _mm256_set1_epi32(iBase);
+            __m256i d0 = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)pIdx), m256Base);
+            __m256i d1 = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(pIdx + 8)), m256Base);
+            if (iBase < 0 || !_mm256_testz_si256(_mm256_or_si256(d0, d1), m256Far)) {
+                ResizeH_Scalar<1>(pSrc, pDst + i * 8, pIdx, pWeights + i * 16, 2, 8);
+                continue;
+            }
+            __m256i d = _mm256_permute4x64_epi64(_mm256_packs_epi32(d0, d1), _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i ctrl = _mm_packus_epi16(_mm256_castsi256_si128(d), _mm256_extracti128_si256(d, 1));
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pSrc + iBase)), ctrl);
+            __m256i sum = _mm256_madd_epi16(_mm256_cvtepu8_epi16(v), _mm256_loadu_si256((const __m256i*)(pWeights + i * 16)));
+            sum = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, sum), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i*)(pDst + i * 8), _mm256_castsi256_si128(sum));
+        }
+        ResizeH_Scalar<1>(pSrc, pDst + iLoop * 8, pIndex + iLoop * 16, pWeights + iLoop * 16, 2, nWidth - iLoop * 8);
+    }
+    // the in-lane unpacks leave products 0-3, 8-11 and 4-7, 12-15, permute2x128 puts them in order.
+    GBMP_TARGET("avx2")
+    static void AreaSum_AVX2(const unsigned char* pSrc, uint32_t w, uint32_t* pSum, size_t nCount)
+    {
+        if (w > 0xFFFF) {
+            AreaSum_Scalar(pSrc, w, pSum, nCount);
+            return;
+        }
+        const __m256i m256W = _mm256_set1_epi16((short)w);
+        size_t iLoop = nCount / 16;
+        for (size_t i = 0; i < iLoop; i++) {
+            __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pSrc + i * 16)));
+            __m256i lo = _mm256_mullo_epi16(x, m256W);
+            __m256i hi = _mm256_mulhi_epu16(x, m256W);
+            __m256i a = _mm256_unpacklo_epi16(lo, hi);
+            __m256i b = _mm256_unpackhi_epi16(lo, hi);
+            __m256i* pOut = (__m256i*)(pSum + i * 16);
+            _mm256_storeu_si256(pOut, _mm256_add_epi32(_mm256_loadu_si256(pOut), _mm256_permute2x128_si256(a, b, 0x20)));
+            _mm256_storeu_si256(pOut + 1, _mm256_add_epi32(_mm256_loadu_si256(pOut + 1), _mm256_permute2x128_si256(a, b, 0x31)));
+        }
+        AreaSum_Scalar(pSrc + iLoop * 16, w, pSum + iLoop * 16, nCount - iLoop * 16);
+    }
+
+    GBMP_TARGET("sse2")
+    static void TransposeTile8u8x8_SSE2(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch)
+    {
+        __m128i r[8];
+        for (int i = 0; i < 8; i++) {
+            r[i] = _mm_loadl_epi64((const __m128i*)(pSrc + i * iSrcPitch));
+        }
+        __m128i a0 = _mm_unpacklo_epi8(r[0], r[1]);
+        __m128i a1 = _mm_unpacklo_epi8(r[2], r[3]);
+        __m128i a2 = _mm_unpacklo_epi8(r[4], r[5]);
+        __m128i a3 = _mm_unpacklo_epi8(r[6], r[7]);
+        __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+        __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+        __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+        __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+        __m128i c[4] = { _mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2),
+            _mm_unpacklo_epi32(b1, b3), _mm_unpackhi_epi32(b1, b3) };
+        for (int i = 0; i < 4; i++) {
+            _mm_storel_epi64((__m128i*)(pDst + (2 * i) * iDstPitch), c[i]);
+            _mm_storel_epi64((__m128i*)(pDst + (2 * i + 1) * iDstPitch), _mm_unpackhi_epi64(c[i], c[i]));
+        }
+    }
+    GBMP_TARGET("sse2")
+    static void TransposeTile8u16x16_SSE2(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch)
+    {
+        __m128i a[16], b[16];
+        for (int i = 0; i < 16; i++) {
+            a[i] = _mm_loadu_si128((const __m128i*)(pSrc + i * iSrcPitch));
+        }
+        // b[i]: row pair i, columns 0..7; b[8 + i]: row pair i, columns 8..15.
+        for (int i = 0; i < 8; i++) {
+            b[i] = _mm_unpacklo_epi8(a[2 * i], a[2 * i + 1]);
+            b[i + 8] = _mm_unpackhi_epi8(a[2 * i], a[2 * i + 1]);
+        }
+        // a[g * 8 + j]: row quad j, 4 columns from g * 8; a[g * 8 + 4 + j]: the next 4 columns.
+        for (int g = 0; g < 2; g++) {
+            for (int j = 0; j < 4; j++) {
+                a[g * 8 + j] = _mm_unpacklo_epi16(b[g * 8 + 2 * j], b[g * 8 + 2 * j + 1]);
+                a[g * 8 + 4 + j] = _mm_unpackhi_epi16(b[g * 8 + 2 * j], b[g * 8 + 2 * j + 1]);
+            }
+        }
+        // b[h * 4 + k]: row octet k, 2 columns from h * 4; b[h * 4 + 2 + k]: the next 2 columns.
+        for (int h = 0; h < 4; h++) {
+            for (int k = 0; k < 2; k++) {
+                b[h * 4 + k] = _mm_unpacklo_epi32(a[h * 4 + 2 * k], a[h * 4 + 2 * k + 1]);
+                b[h * 4 + 2 + k] = _mm_unpackhi_epi32(a[h * 4 + 2 * k], a[h * 4 + 2 * k + 1]);
+            }
+        }
+        for (int m = 0; m < 8; m++) {
+            _mm_storeu_si128((__m128i*)(pDst + (2 * m) * iDstPitch), _mm_unpacklo_epi64(b[2 * m], b[2 * m + 1]));
+            _mm_storeu_si128((__m128i*)(pDst + (2 * m + 1) * iDstPitch), _mm_unpackhi_epi64(b[2 * m], b[2 * m + 1]));
+        }
+    }
+    GBMP_TARGET("sse2")
+    static void TransposeTile32u4x4_SSE2(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch)
+    {
+        __m128i r0 = _mm_loadu_si128((const __m128i*)(pSrc));
+        __m128i r1 = _mm_loadu_si128((const __m128i*)(pSrc + iSrcPitch));
+        __m128i r2 = _mm_loadu_si128((const __m128i*)(pSrc + 2 * iSrcPitch));
+        __m128i r3 = _mm_loadu_si128((const __m128i*)(pSrc + 3 * iSrcPitch));
+        __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+        __m128i t1 = _mm_unpackhi_epi32(r0, r1);
+        __m128i t2 = _mm_unpacklo_epi32(r2, r3);
+        __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+        _mm_storeu_si128((__m128i*)(pDst), _mm_unpacklo_epi64(t0, t2));
+        _mm_storeu_si128((__m128i*)(pDst + iDstPitch), _mm_unpackhi_epi64(t0, t2));
+        _mm_storeu_si128((__m128i*)(pDst + 2 * iDstPitch), _mm_unpacklo_epi64(t1, t3));
+        _mm_storeu_si128((__m128i*)(pDst + 3 * iDstPitch), _mm_unpackhi_epi64(t1, t3));
+    }
+    GBMP_TARGET("avx2")
+    static void TransposeTile32u8x8_AVX2(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch)
+    {
+        __m256i r[8], t[8], u[8];
+        for (int i = 0; i < 8; i++) {
+            r[i] = _mm256_loadu_si256((const __m256i*)(pSrc + i * iSrcPitch));
+        }
+        for (int i = 0; i < 4; i++) {
+            t[2 * i] = _mm256_unpacklo_epi32(r[2 * i], r[2 * i + 1]);
+            t[2 * i + 1] = _mm256_unpackhi_epi32(r[2 * i], r[2 * i + 1]);
+        }
+        // per 128-bit lane, u[4 * h + c] holds column c (lane 0) or c + 4 (lane 1) of rows 4h..4h+3.
+        for (int h = 0; h < 2; h++) {
+            u[4 * h + 0] = _mm256_unpacklo_epi64(t[4 * h], t[4 * h + 2]);
+            u[4 * h + 1] = _mm256_unpackhi_epi64(t[4 * h], t[4 * h + 2]);
+            u[4 * h + 2] = _mm256_unpacklo_epi64(t[4 * h + 1], t[4 * h + 3]);
+            u[4 * h + 3] = _mm256_unpackhi_epi64(t[4 * h + 1], t[4 * h + 3]);
+        }
+        for (int c = 0; c < 4; c++) {
+            _mm256_storeu_si256((__m256i*)(pDst + c * iDstPitch), _mm256_permute2x128_si256(u[c], u[c + 4], 0x20));
+            _mm256_storeu_si256((__m256i*)(pDst + (c + 4) * iDstPitch), _mm256_permute2x128_si256(u[c], u[c + 4], 0x31));
+        }
+    }
+
+    // 16 bytes of 4-bit indices become 32 index bytes, high nibble first, ready for a pshufb lookup.
+    GBMP_TARGET("ssse3")
+    static void SplitNibbles_SSSE3(__m128i v, __m128i& m128Lo, __m128i& m128Hi)
+    {
+        const __m128i m128Nibble = _mm_set1_epi8(0x0F);
+        __m128i m128First = _mm_and_si128(_mm_srli_epi16(v, 4), m128Nibble);
+        __m128i m128Second = _mm_and_si128(v, m128Nibble);
+        m128Lo = _mm_unpacklo_epi8(m128First, m128Second);
+        m128Hi = _mm_unpackhi_epi8(m128First, m128Second);
+    }
+    GBMP_TARGET("ssse3")
+    static void Index4ToGray8_SSSE3(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut)
+    {
+        const __m128i m128Lut = _mm_loadu_si128((const __m128i*)pLut);
+        int iLoop = nWidth / 32;
+        for (int i = 0; i < iLoop; i++) {
+            __m128i m128Lo, m128Hi;
+            SplitNibbles_SSSE3(_mm_loadu_si128((const __m128i*)(pSrc + i * 16)), m128Lo, m128Hi);
+            _mm_storeu_si128((__m128i*)(pDst + i * 32), _mm_shuffle_epi8(m128Lut, m128Lo));
+            _mm_storeu_si128((__m128i*)(pDst + i * 32 + 16), _mm_shuffle_epi8(m128Lut, m128Hi));
+        }
+        Index4ToGray8_Scalar(pSrc + iLoop * 16, pDst + iLoop * 32, nWidth - iLoop * 32, pLut);
+    }
+    // The 16 palette entries are split into B, G, R and 4th byte tables of one pshufb each, whose
+    // results interleave back into pixels.
+    GBMP_TARGET("ssse3")
+    static void Index4ToRGB32_SSSE3(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const uint32_t* pPalette)
+    {
+        int iLoop = nWidth / 32;
+        if (iLoop == 0) {
+            Index4ToRGB32_Scalar(pSrc, pDst, nWidth, pPalette);
+            return;
+        }
+        const __m128i m128Planar = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        __m128i q[4];
+        for (int k = 0; k < 4; k++) {
+            q[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pPalette + k * 4)), m128Planar);
+        }
+        __m128i m128BG01 = _mm_unpacklo_epi32(q[0], q[1]);
+        __m128i m128BG23 = _mm_unpacklo_epi32(q[2], q[3]);
+        __m128i m128RA01 = _mm_unpackhi_epi32(q[0], q[1]);
+        __m128i m128RA23 = _mm_unpackhi_epi32(q[2], q[3]);
+        const __m128i lut[4] = { _mm_unpacklo_epi64(m128BG01, m128BG23), _mm_unpackhi_epi64(m128BG01, m128BG23),
+            _mm_unpacklo_epi64(m128RA01, m128RA23), _mm_unpackhi_epi64(m128RA01, m128RA23) };
+        for (int i = 0; i < iLoop; i++) {
+            __m128i idx[2];
+            SplitNibbles_SSSE3(_mm_loadu_si128((const __m128i*)(pSrc + i * 16)), idx[0], idx[1]);
+            __m128i* pm128Dst = (__m128i*)(pDst + i * 128);
+            for (int h = 0; h < 2; h++) {
+                __m128i b = _mm_shuffle_epi8(lut[0], idx[h]);
+                __m128i g = _mm_shuffle_epi8(lut[1], idx[h]);
+                __m128i r = _mm_shuffle_epi8(lut[2], idx[h]);
+                __m128i a = _mm_shuffle_epi8(lut[3], idx[h]);
+                __m128i m128BGLo = _mm_unpacklo_epi8(b, g);
+                __m128i m128BGHi = _mm_unpackhi_epi8(b, g);
+                __m128i m128RALo = _mm_unpacklo_epi8(r, a);
+                __m128i m128RAHi = _mm_unpackhi_epi8(r, a);
+                _mm_storeu_si128(pm128Dst + h * 4, _mm_unpacklo_epi16(m128BGLo, m128RALo));
+                _mm_storeu_si128(pm128Dst + h * 4 + 1, _mm_unpackhi_epi16(m128BGLo, m128RALo));
+                _mm_storeu_si128(pm128Dst + h * 4 + 2, _mm_unpacklo_epi16(m128BGHi, m128RAHi));
+                _mm_storeu_si128(pm128Dst + h * 4 + 3, _mm_unpackhi_epi16(m128BGHi, m128RAHi));
+            }
+        }
+        Index4ToRGB32_Scalar(pSrc + iLoop * 16, pDst + iLoop * 128, nWidth - iLoop * 32, pPalette);
+    }
+    GBMP_TARGET("avx2")
+    static void Index4ToGray8_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut)
+    {
+        const __m256i m256Lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)pLut));
+        const __m256i m256Nibble = _mm256_set1_epi8(0x0F);
+        int iLoop = nWidth / 64;
+        for (int i = 0; i < iLoop; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(pSrc + i * 32));
+            __m256i m256First = _mm256_and_si256(_mm256_srli_epi16(v, 4), m256Nibble);
+            __m256i m256Second = _mm256_and_si256(v, m256Nibble);
+            // per lane: lo holds pixels 0-15 and 32-47, hi 16-31 and 48-63.
+            __m256i m256Lo = _mm256_shuffle_epi8(m256Lut, _mm256_unpacklo_epi8(m256First, m256Second));
+            __m256i m256Hi = _mm256_shuffle_epi8(m256Lut, _mm256_unpackhi_epi8(m256First, m256Second));
+            _mm256_storeu_si256((__m256i*)(pDst + i * 64), _mm256_permute2x128_si256(m256Lo, m256Hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(pDst + i * 64 + 32), _mm256_permute2x128_si256(m256Lo, m256Hi, 0x31));
+        }
+        Index4ToGray8_SSSE3(pSrc + iLoop * 32, pDst + iLoop * 64, nWidth - iLoop * 64, pLut);
+    }
+    // A 256 entry byte table is 16 pshufb tables of 16, one per high nibble, in two halves of 8. Within a
+    // half, step k looks up idx - 16 * k in table k xor table k - 1: pshufb gives 0 once that is negative,
+    // so a lane with high nibble g collects steps 0..g, which xor to table g. The sign of idx picks the half.
+    GBMP_TARGET("avx2")
+    static void Index8ToGray8_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut)
+    {
+        __m256i diff[16];
+        for (int k = 0; k < 16; k++) {
+            __m128i m128Table = _mm_loadu_si128((const __m128i*)(pLut + k * 16));
+            if (k % 8 != 0) {
+                m128Table = _mm_xor_si128(m128Table, _mm_loadu_si128((const __m128i*)(pLut + k * 16 - 16)));
+            }
+            diff[k] = _mm256_broadcastsi128_si256(m128Table);
+        }
+        const __m256i m256Step = _mm256_set1_epi8(16);
+        const __m256i m256Sign = _mm256_set1_epi8((char)0x80);
+        int iLoop = nWidth / 32;
+        for (int i = 0; i < iLoop; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(pSrc + i * 32));
+            __m256i m256IdxLo = v;
+            __m256i m256IdxHi = _mm256_xor_si256(v, m256Sign);
+            __m256i m256Lo = _mm256_setzero_si256();
+            __m256i m256Hi = _mm256_setzero_si256();
+            for (int k = 0; k < 8; k++) {
+                m256Lo = _mm256_xor_si256(m256Lo, _mm256_shuffle_epi8(diff[k], m256IdxLo));
+                m256Hi = _mm256_xor_si256(m256Hi, _mm256_shuffle_epi8(diff[k + 8], m256IdxHi));
+                m256IdxLo = _mm256_sub_epi8(m256IdxLo, m256Step);
+                m256IdxHi = _mm256_sub_epi8(m256IdxHi, m256Step);
+            }
+            _mm256_storeu_si256((__m256i*)(pDst + i * 32), _mm256_blendv_epi8(m256Lo, m256Hi, v));
+        }
+        Index8ToGray8_Scalar(pSrc + iLoop * 32, pDst + iLoop * 32, nWidth - iLoop * 32, pLut);
+    }
+    GBMP_TARGET("avx2")
+    static void Index8ToRGB32_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const uint32_t* pPalette)
+    {
+        int iLoop = nWidth / 8;
+        for (int i = 0; i < iLoop; i++) {
+            __m256i m256Idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pSrc + i * 8)));
+            _mm256_storeu_si256((__m256i*)(pDst + i * 32), _mm256_i32gather_epi32((const int*)pPalette, m256Idx, 4));
+        }
+        Index8ToRGB32_Scalar(pSrc + iLoop * 8, pDst + iLoop * 32, nWidth - iLoop * 8, pPalette);
+    }
+    // Channels sit in 16-bit lanes while they widen, then B | G << 8 and R | 0 << 8 interleave into pixels.
+    GBMP_TARGET("sse2")
+    static void RGB16ToRGB32_SSE2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, bool b565)
+    {
+        const __m128i m128Five = _mm_set1_epi16(0x1F);
+        const __m128i m128Green = _mm_set1_epi16(b565 ? 0x3F : 0x1F);
+        const __m128i m128RShift = _mm_cvtsi32_si128(b565 ? 11 : 10);
+        const __m128i m128GUp = _mm_cvtsi32_si128(b565 ? 2 : 3);
+        const __m128i m128GDown = _mm_cvtsi32_si128(b565 ? 4 : 2);
+        int iLoop = nWidth / 8;
+        for (int i = 0; i < iLoop; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i * 16));
+            __m128i b = _mm_and_si128(v, m128Five);
+            __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), m128Green);
+            __m128i r = _mm_and_si128(_mm_srl_epi16(v, m128RShift), m128Five);
+            b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+            g = _mm_or_si128(_mm_sll_epi16(g, m128GUp), _mm_srl_epi16(g, m128GDown));
+            r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+            __m128i m128BG = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+            _mm_storeu_si128((__m128i*)(pDst + i * 32), _mm_unpacklo_epi16(m128BG, r));
+            _mm_storeu_si128((__m128i*)(pDst + i * 32 + 16), _mm_unpackhi_epi16(m128BG, r));
+        }
+        RGB16ToRGB32_Scalar(pSrc + iLoop * 16, pDst + iLoop * 32, nWidth - iLoop * 8, b565);
+    }
+    GBMP_TARGET("avx2")
+    static void RGB16ToRGB32_AVX2(const unsigned char* pSrc, unsigned char* pDst, int nWidth, bool b565)
+    {
+        const __m256i m256Five = _mm256_set1_epi16(0x1F);
+        const __m256i m256Green = _mm256_set1_epi16(b565 ? 0x3F : 0x1F);
+        const __m128i m128RShift = _mm_cvtsi32_si128(b565 ? 11 : 10);
+        const __m128i m128GUp = _mm_cvtsi32_si128(b565 ? 2 : 3);
+        const __m128i m128GDown = _mm_cvtsi32_si128(b565 ? 4 : 2);
+        int iLoop = nWidth / 16;
+        for (int i = 0; i < iLoop; i++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(pSrc + i * 32));
+            __m256i b = _mm256_and_si256(v, m256Five);
+            __m256i g = _mm256_and_si256(_mm256_srli_epi16(v, 5), m256Green);
+            __m256i r = _mm256_and_si256(_mm256_srl_epi16(v, m128RShift), m256Five);
+            b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+            g = _mm256_or_si256(_mm256_sll_epi16(g, m128GUp), _mm256_srl_epi16(g, m128GDown));
+            r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+            __m256i m256BG = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+            __m256i m256Lo = _mm256_unpacklo_epi16(m256BG, r); // pixels 0-3 and 8-11.
+            __m256i m256Hi = _mm256_unpackhi_epi16(m256BG, r);
+            _mm256_storeu_si256((__m256i*)(pDst + i * 64), _mm256_permute2x128_si256(m256Lo, m256Hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(pDst + i * 64 + 32), _mm256_permute2x128_si256(m256Lo, m256Hi, 0x31));
+        }
+        RGB16ToRGB32_SSE2(pSrc + iLoop * 32, pDst + iLoop * 64, nWidth - iLoop * 16, b565);
+    }
+#endif
+};
+
+class GThreadPool // workers shared by every GBmp operation, started on first use.
+{
+public:
+    static GThreadPool& Instance()
+    {
+        static GThreadPool s_pool;
+        return s_pool;
+    }
+    GThreadPool(const GThreadPool&) = delete;
+    GThreadPool& operator=(const GThreadPool&) = delete;
+    ~GThreadPool(void) { StopWorkers(); }
+
+    // 0 uses every hardware thread, 1 keeps all work on the calling thread.
+    void SetThreadCount(int nThreads)
+    {
+        std::lock_guard<std::mutex> lockRun(m_mtxRun);
+        StopWorkers();
+        m_nThreads = nThreads > 0 ? nThreads : (std::max)(1, (int)std::thread::hardware_concurrency());
+    }
+    int GetThreadCount() const { return m_nThreads; }
+    // Operations touching fewer bytes than this run serially.
+    void SetGrain(size_t nBytes) { m_nGrain = nBytes; }
+    size_t GetGrain() const { return m_nGrain; }
+    // Whether an operation over nBytes would be split across threads when called from here.
+    bool IsParallel(size_t nBytes) const { return m_nThreads > 1 && nBytes >= m_nGrain && !InWorker(); }
+    // Threads that bring their own parallelism, like GBmpBatchLoader's, keep their operations serial.
+    static void SetSerialThread(bool bSerial) { InWorker() = bSerial; }
+
+    // Calls fn(begin, end) over contiguous chunks of [0, nCount); nItemBytes is the memory one item
+    // touches and only decides whether and how finely to split. Chunks write disjoint outputs, so the
+    // result is the same as fn(0, nCount) whatever thread runs which chunk.
+    template <class Fn>
+    void ParallelFor(size_t nCount, size_t nItemBytes, const Fn& fn)
+    {
+        size_t nBytes = nCount * nItemBytes;
+        int nThreads = m_nThreads;
+        if (nCount < 2 || nThreads <= 1 || nBytes < m_nGrain || InWorker()) {
+            fn((size_t)0, nCount);
+            return;
+        }
+        size_t nChunks = (std::min)((std::min)(nCount, (size_t)nThreads * 4), nBytes / (std::max)(m_nGrain / 4, (size_t)1));
+        if (nChunks < 2) {
+            fn((size_t)0, nCount);
+            return;
+        }
+        std::unique_lock<std::mutex> lockRun(m_mtxRun, std::try_to_lock);
+        if (!lockRun.owns_lock()) { // another thread's operation owns the workers.
+            fn((size_t)0, nCount);
+            return;
+        }
+        Run(nChunks, [&](size_t iChunk) { fn(nCount * iChunk / nChunks, nCount * (iChunk + 1) / nChunks); });
+    }
+
+private:
+    GThreadPool(void)
+        : m_nThreads((std::max)(1, (int)std::thread::hardware_concurrency()))
+        , m_nGrain(256 * 1024)
+        , m_bStop(false)
+        , m_iGeneration(0)
+        , m_pJob(0)
+        , m_nChunks(0)
+        , m_nNextChunk(0)
+        , m_nPending(0)
+        , m_nActive(0)
+    {
+    }
+
+    static bool& InWorker()
+    {
+        static thread_local bool t_bInWorker = false;
+        return t_bInWorker;
+    }
+
+    void Run(size_t nChunks, const std::function<void(size_t)>& job)
+    {
+        if ((int)m_workers.size() != m_nThreads - 1) {
+            StopWorkers();
+            uint64_t iGeneration = m_iGeneration;
+            for (int i = 0; i < m_nThreads - 1; i++) {
+                m_workers.emplace_back([this, iGeneration] { WorkerLoop(iGeneration); });
+            }
+        }
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_cvDone.wait(lock, [this] { return m_nActive == 0; });
+            m_pJob = &job;
+            m_nChunks = nChunks;
+            m_nNextChunk = 0;
+            m_nPending = nChunks;
+            m_error = nullptr;
+            m_iGeneration++;
+        }
+        m_cvWork.notify_all();
+        InWorker() = true;
+        RunChunks();
+        InWorker() = false;
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvDone.wait(lock, [this] { return m_nPending == 0 && m_nActive == 0; });
+        m_pJob = 0;
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+    void RunChunks()
+    {
+        for (;;) {
+            size_t iChunk = m_nNextChunk.fetch_add(1);
+            if (iChunk >= m_nChunks) {
+                return;
+            }
+            try {
+                (*m_pJob)(iChunk);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (!m_error) {
+                    m_error = std::current_exception();
+                }
+            }
+            std::lock_guard<std::mutex> lock(m_mtx);
+            if (--m_nPending == 0) {
+                m_cvDone.notify_all();
+            }
+        }
+    }
+    // A worker counts as active from taking a generation until it is out of RunChunks; Run neither
+    // returns nor resets the job while a late worker may still be reading it.
+    void WorkerLoop(uint64_t iSeen)
+    {
+        InWorker() = true;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mtx);
+                m_cvWork.wait(lock, [&] { return m_bStop || m_iGeneration != iSeen; });
+                if (m_bStop) {
+                    return;
+                }
+                iSeen = m_iGeneration;
+                m_nActive++;
+            }
+            RunChunks();
+            std::lock_guard<std::mutex> lock(m_mtx);
+            if (--m_nActive == 0 && m_nPending == 0) {
+                m_cvDone.notify_all();
+            }
+        }
+    }
+    void StopWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_bStop = true;
+        }
+        m_cvWork.notify_all();
+        for (std::thread& worker : m_workers) {
+            worker.join();
+        }
+        m_workers.clear();
+        m_bStop = false;
+    }
+
+    std::atomic<int> m_nThreads;
+    std::atomic<size_t> m_nGrain;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mtxRun; // one parallel operation at a time, others run serially.
+    std::mutex m_mtx;
+    std::condition_variable m_cvWork;
+    std::condition_variable m_cvDone;
+    bool m_bStop;
+    uint64_t m_iGeneration;
+    const std::function<void(size_t)>* m_pJob;
+    size_t m_nChunks;
+    std::atomic<size_t> m_nNextChunk;
+    size_t m_nPending;
+    int m_nActive;
+    std::exception_ptr m_error;
+};
+
+enum GPixelFormat {
+    GPF_GRAY8,
+    GPF_BGRA32,
+};
+
+// Orientation applied while decoding, as if the image were loaded and then flipped or rotated.
+enum GOrientation {
+    GORIENT_NONE,
+    GORIENT_FLIP, // MirrorV
+    GORIENT_MIRROR, // MirrorH
+    GORIENT_ROTATE180,
+    GORIENT_TRANSPOSE,
+};
+
+enum GResizeMode {
+    GRESIZE_NEAREST,
+    GRESIZE_BILINEAR, // pixel centers aligned, edges clamped.
+    GRESIZE_AREA, // each output pixel averages the source area it covers.
+};
+
+struct GImageView // non-owning window on pixels, rows are iPitch bytes apart and the pitch may be negative.
+{
+    unsigned char* pData;
+    int iWidth;
+    int iHeight;
+    ptrdiff_t iPitch;
+    GPixelFormat format;
+    bool bReadOnly; // the pixels may only be read, e.g. a file mapped read-only; operations writing a view assert on it.
+
+    GImageView(void)
+        : pData(0)
+        , iWidth(0)
+        , iHeight(0)
+        , iPitch(0)
+        , format(GPF_GRAY8)
+        , bReadOnly(false)
+    {
+    }
+    GImageView(void* pPixels, int iWid, int iHei, ptrdiff_t iLnPitch, GPixelFormat fmt)
+        : pData(static_cast<unsigned char*>(pPixels))
+        , iWidth(iWid)
+        , iHeight(iHei)
+        , iPitch(iLnPitch)
+        , format(fmt)
+        , bReadOnly(false)
+    {
+    }
+    // The pixels of a const buffer, flagged read-only.
+    GImageView(const void* pPixels, int iWid, int iHei, ptrdiff_t iLnPitch, GPixelFormat fmt)
+        : GImageView(const_cast<void*>(pPixels), iWid, iHei, iLnPitch, fmt)
+    {
+        bReadOnly = true;
+    }
+
+    inline bool IsGray() const { return format == GPF_GRAY8; }
+    inline int PixelBytes() const { return format == GPF_GRAY8 ? 1 : 4; }
+    inline size_t LineBytes() const { return (size_t)iWidth * PixelBytes(); }
+    inline bool IsContiguous() const { return iPitch == (ptrdiff_t)LineBytes(); }
+    inline unsigned char* Line(int y) const { return pData + y * iPitch; }
+
+    // Same clamping as GBmp::CropImage, the result shares the pixels.
+    GImageView Crop(int left, int top, int right, int bottom) const
+    {
+        left = (std::max)(left, 0);
+        top = (std::max)(top, 0);
+        right = (std::max)((std::min)(right, iWidth), left);
+        bottom = (std::max)((std::min)(bottom, iHeight), top);
+        GImageView crop(pData + top * iPitch + (ptrdiff_t)left * PixelBytes(), right - left, bottom - top, iPitch, format);
+        crop.bReadOnly = bReadOnly;
+        return crop;
+    }
+};
+
+struct GHistogram { // 256 bins per channel: one for gray, B, G, R, A for 32-bit.
+    int nChannels;
+    uint64_t bins[4][256];
+};
+
+struct GImageStats { // per channel, in GHistogram's order.
+    int nChannels;
+    uint64_t nCount; // pixels.
+    int iMin[4];
+    int iMax[4];
+    uint64_t nSum[4];
+    uint64_t nSumSq[4];
+
+    double Mean(int iChannel = 0) const { return nCount ? (double)nSum[iChannel] / nCount : 0; }
+    double Variance(int iChannel = 0) const
+    {
+        double dMean = Mean(iChannel);
+        return nCount ? (std::max)(0.0, (double)nSumSq[iChannel] / nCount - dMean * dMean) : 0;
+    }
+};
+
+inline int GBmpSeek(FILE* pFile, int64_t iOffset, int iOrigin)
+{
+#ifdef _WIN32
+    return _fseeki64(pFile, iOffset, iOrigin);
+#else
+    return fseeko(pFile, (off_t)iOffset, iOrigin);
+#endif
+}
+inline int64_t GBmpTell(FILE* pFile)
+{
+#ifdef _WIN32
+    return _ftelli64(pFile);
+#else
+    return (int64_t)ftello(pFile);
+#endif
+}
+
+// Operations GBmpStats keeps counters for.
+enum GStatOp {
+    GSTAT_LOADBMP,
+    GSTAT_DECODEBUFFER,
+    GSTAT_SAVEBMP,
+    GSTAT_ENCODEBUFFER,
+    GSTAT_RGB24TORGB32, // one call per decoded row.
+    GSTAT_MIRRORV,
+    GSTAT_MIRRORH,
+    GSTAT_REVERSE,
+    GSTAT_ROTATE90,
+    GSTAT_ROTATE270,
+    GSTAT_ROTATE180,
+    GSTAT_TRANSPOSE,
+    GSTAT_COPY,
+    GSTAT_TOGRAY,
+    GSTAT_PIPELINE,
+    GSTAT_RESIZE,
+    GSTAT_PYRAMID, // BuildPyramid and Downsample2x.
+    GSTAT_HISTOGRAM,
+    GSTAT_STATISTICS,
+    GSTAT_CONVERT, // SwapRB and ToBGRA.
+    GSTAT_ALLOC, // pixel buffers handed out by the GBmp allocator, pooled or not.
+    GSTAT_SYSALLOC, // buffers taken from the system, i.e. pool misses.
+    GSTAT_OPCOUNT,
+};
+
+// Instrumentation is compiled in with -DGBMP_STATS. Without it the hooks below expand to nothing,
+// no clock is read and GBmpStats::Snapshot() stays zero.
+#ifdef GBMP_STATS
+#define GBMP_STAT_SCOPE(op, nBytes) GBmpStats::Scope gbmpStatScope(op, nBytes)
+#define GBMP_STAT_BYTES(nBytes) gbmpStatScope.SetBytes(nBytes)
+#define GBMP_STAT_COUNT(op, nBytes) GBmpStats::Instance().Record(op, 0, nBytes)
+#else
+#define GBMP_STAT_SCOPE(op, nBytes) ((void)0)
+#define GBMP_STAT_BYTES(nBytes) ((void)0)
+#define GBMP_STAT_COUNT(op, nBytes) ((void)0)
+#endif
+
+struct GStatCounter {
+    enum { Buckets = 40 };
+    uint64_t nCalls;
+    uint64_t nBytes;
+    uint64_t nNanos; // summed latency.
+    uint64_t nMaxNanos;
+    uint64_t latency[Buckets]; // calls by latency, bucket i counts [2^i, 2^(i+1)) ns, bucket 0 below 2 ns.
+};
+
+struct GStatSnapshot {
+    GStatCounter ops[GSTAT_OPCOUNT];
+};
+
+// Process-wide counters, latency histograms and an optional per-call callback for every GStatOp.
+// Counters are relaxed atomics, so a snapshot taken while operations run may mix calls in flight.
+class GBmpStats
+{
+public:
+    typedef void (*Callback)(void* pUser, GStatOp op, uint64_t nNanos, uint64_t nBytes);
+
+    static GBmpStats& Instance()
+    {
+        static GBmpStats s_stats;
+        return s_stats;
+    }
+    GBmpStats(const GBmpStats&) = delete;
+    GBmpStats& operator=(const GBmpStats&) = delete;
+
+#ifdef GBMP_STATS
+    static constexpr bool Enabled = true;
+#else
+    static constexpr bool Enabled = false;
+#endif
+
+    static const char* Name(GStatOp op)
+    {
+        static const char* const s_names[GSTAT_OPCOUNT] = { "LoadBmp", "DecodeFromBuffer", "SaveBmp", "EncodeToBuffer",
+            "RGB24ToRGB32", "MirrorV", "MirrorH", "ReverseImage", "Rotate90", "Rotate270", "Rotate180", "Transpose",
+            "CopyImage", "ToGray", "Pipeline", "Resize", "BuildPyramid", "Histogram", "Statistics", "Convert", "Alloc", "SystemAlloc" };
+        return op >= 0 && op < GSTAT_OPCOUNT ? s_names[op] : "?";
+    }
+
+    void Record(GStatOp op, uint64_t nNanos, uint64_t nBytes)
+    {
+        Counter& counter = m_ops[op];
+        counter.nCalls.fetch_add(1, std::memory_order_relaxed);
+        counter.nBytes.fetch_add(nBytes, std::memory_order_relaxed);
+        counter.nNanos.fetch_add(nNanos, std::memory_order_relaxed);
+        uint64_t nMax = counter.nMaxNanos.load(std::memory_order_relaxed);
+        while (nNanos > nMax && !counter.nMaxNanos.compare_exchange_weak(nMax, nNanos, std::memory_order_relaxed)) {
+        }
+        int iBucket = 0;
+        while (iBucket < GStatCounter::Buckets - 1 && (nNanos >> (iBucket + 1)) != 0) {
+            iBucket++;
+        }
+        counter.latency[iBucket].fetch_add(1, std::memory_order_relaxed);
+        if (m_bCallback.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(m_mtxCallback);
+            if (m_pfnCallback) {
+                m_pfnCallback(m_pUser, op, nNanos, nBytes);
+            }
+        }
+    }
+
+    GStatSnapshot Snapshot() const
+    {
+        GStatSnapshot snap;
+        for (int i = 0; i < GSTAT_OPCOUNT; i++) {
+            const Counter& counter = m_ops[i];
+            GStatCounter& out = snap.ops[i];
+            out.nCalls = counter.nCalls.load(std::memory_order_relaxed);
+            out.nBytes = counter.nBytes.load(std::memory_order_relaxed);
+            out.nNanos = counter.nNanos.load(std::memory_order_relaxed);
+            out.nMaxNanos = counter.nMaxNanos.load(std::memory_order_relaxed);
+            for (int j = 0; j < GStatCounter::Buckets; j++) {
+                out.latency[j] = counter.latency[j].load(std::memory_order_relaxed);
+            }
+        }
+        return snap;
+    }
+    void Reset()
+    {
+        for (Counter& counter : m_ops) {
+            counter.nCalls = 0;
+            counter.nBytes = 0;
+            counter.nNanos = 0;
+            counter.nMaxNanos = 0;
+            for (std::atomic<uint64_t>& n : counter.latency) {
+                n = 0;
+            }
+        }
+    }
+    // Called after every recorded operation, on the thread that ran it and one call at a time;
+    // 0 removes the callback.
+    void SetCallback(Callback pfnCallback, void* pUser)
+    {
+        std::lock_guard<std::mutex> lock(m_mtxCallback);
+        m_pfnCallback = pfnCallback;
+        m_pUser = pUser;
+        m_bCallback.store(pfnCallback != 0, std::memory_order_release);
+    }
+
+    // Times its lifetime and records it as one call of op.
+    class Scope
+    {
+    public:
+        Scope(GStatOp op, uint64_t nBytes)
+            : m_op(op)
+            , m_nBytes(nBytes)
+            , m_t0(std::chrono::steady_clock::now())
+        {
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope()
+        {
+            uint64_t nNanos = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_t0).count();
+            GBmpStats::Instance().Record(m_op, nNanos, m_nBytes);
+        }
+        void SetBytes(uint64_t nBytes) { m_nBytes = nBytes; }
+
+    private:
+        GStatOp m_op;
+        uint64_t m_nBytes;
+        std::chrono::steady_clock::time_point m_t0;
+    };
+
+private:
+    GBmpStats(void)
+        : m_bCallback(false)
+        , m_pfnCallback(0)
+        , m_pUser(0)
+    {
+        Reset();
+    }
+
+    struct Counter {
+        std::atomic<uint64_t> nCalls;
+        std::atomic<uint64_t> nBytes;
+        std::atomic<uint64_t> nNanos;
+        std::atomic<uint64_t> nMaxNanos;
+        std::atomic<uint64_t> latency[GStatCounter::Buckets];
+    };
+    Counter m_ops[GSTAT_OPCOUNT];
+    std::atomic<bool> m_bCallback;
+    std::mutex m_mtxCallback;
+    Callback m_pfnCallback;
+    void* m_pUser;
+};
+
+enum GHugePages {
+    GHUGEPAGES_NONE, // plain pages.
+    GHUGEPAGES_TRANSPARENT, // madvise(MADV_HUGEPAGE), the kernel backs the mapping with 2 MB pages as it can.
+    GHUGEPAGES_EXPLICIT, // MAP_HUGETLB from the reserved pool first, transparent when the pool is empty.
+};
+
+class GBmpAllocator // source of GBmp pixel buffers, which are GBMP_ALIGNMENT aligned.
+{
+public:
+    virtual ~GBmpAllocator(void) { }
+    // Throws std::bad_alloc like new[]. Free gets the same nBytes the buffer was allocated with.
+    virtual void* Allocate(size_t nBytes) = 0;
+    virtual void Free(void* pBuffer, size_t nBytes) = 0;
+
+    // How buffers of GBMP_HUGEPAGE_MIN bytes and more are backed; transparent by default. Huge pages
+    // cut the TLB misses of the column-order passes (Rotate90/270, Transpose) over big images.
+    static void SetHugePages(GHugePages mode) { HugePagesSlot().store(mode, std::memory_order_relaxed); }
+    static GHugePages GetHugePages() { return (GHugePages)HugePagesSlot().load(std::memory_order_relaxed); }
+
+    static void* AlignedAlloc(size_t nBytes)
+    {
+        void* pBuffer = 0;
+#ifdef _WIN32
+        pBuffer = _aligned_malloc(nBytes ? nBytes : 1, GBMP_ALIGNMENT);
+#elif defined(__linux__)
+        if (nBytes >= GBMP_HUGEPAGE_MIN) {
+            pBuffer = MapHuge(nBytes);
+        } else if (posix_memalign(&pBuffer, GBMP_ALIGNMENT, nBytes ? nBytes : 1) != 0) {
+            pBuffer = 0;
+        }
+#else
+        if (posix_memalign(&pBuffer, GBMP_ALIGNMENT, nBytes ? nBytes : 1) != 0) {
+            pBuffer = 0;
+        }
+#endif
+        if (pBuffer == 0) {
+            throw std::bad_alloc();
+        }
+        GBMP_STAT_COUNT(GSTAT_SYSALLOC, nBytes);
+        return pBuffer;
+    }
+    // nBytes is what AlignedAlloc was given, it tells mapped buffers from heap ones.
+    static void AlignedFree(void* pBuffer, size_t nBytes)
+    {
+#ifdef _WIN32
+        (void)nBytes;
+        _aligned_free(pBuffer);
+#elif defined(__linux__)
+        if (nBytes >= GBMP_HUGEPAGE_MIN) {
+            munmap(pBuffer, HugeLength(nBytes));
+        } else {
+            free(pBuffer);
+        }
+#else
+        (void)nBytes;
+        free(pBuffer);
+#endif
+    }
+
+private:
+    static std::atomic<int>& HugePagesSlot()
+    {
+        static std::atomic<int> s_iMode(GHUGEPAGES_TRANSPARENT);
+        return s_iMode;
+    }
+#if defined(__linux__)
+    static constexpr size_t HugePageBytes = (size_t)2 << 20;
+    static size_t HugeLength(size_t nBytes) { return (nBytes + HugePageBytes - 1) / HugePageBytes * HugePageBytes; }
+    // Maps a 2 MB aligned run of whole huge pages; the extra page mapped for alignment is trimmed off.
+    static void* MapHuge(size_t nBytes)
+    {
+        size_t nLen = HugeLength(nBytes);
+        GHugePages mode = GetHugePages();
+#ifdef MAP_HUGETLB
+        if (mode == GHUGEPAGES_EXPLICIT) {
+            void* p = mmap(0, nLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                return p;
+            }
+        }
+#endif
+        void* p = mmap(0, nLen + HugePageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return 0;
+        }
+        uintptr_t iBase = (uintptr_t)p;
+        uintptr_t iAligned = (iBase + HugePageBytes - 1) & ~(uintptr_t)(HugePageBytes - 1);
+        if (iAligned > iBase) {
+            munmap(p, iAligned - iBase);
+        }
+        if (iBase + HugePageBytes > iAligned) {
+            munmap((void*)(iAligned + nLen), iBase + HugePageBytes - iAligned);
+        }
+#ifdef MADV_HUGEPAGE
+        if (mode != GHUGEPAGES_NONE) {
+            madvise((void*)iAligned, nLen, MADV_HUGEPAGE);
+        }
+#endif
+        return (void*)iAligned;
+    }
+#endif
+};
+
+class GAlignedAllocator : public GBmpAllocator // every request goes to the system allocator.
+{
+public:
+    static GAlignedAllocator& Instance()
+    {
+        static GAlignedAllocator s_allocator;
+        return s_allocator;
+    }
+    void* Allocate(size_t nBytes) override { return AlignedAlloc(nBytes); }
+    void Free(void* pBuffer, size_t nBytes) override { AlignedFree(pBuffer, nBytes); }
+};
+
+// Keeps freed buffers in size classes, four per power of two, and hands them out again, so a
+// steady stream of same-sized frames stops reaching the system allocator after the first few.
+// Each class has its own lock; at most GetLimit() bytes are kept idle.
+class GBufferPool : public GBmpAllocator
+{
+public:
+    // Never destroyed, so GBmp objects with static storage can still return buffers at exit.
+    static GBufferPool& Instance()
+    {
+        static GBufferPool* s_pPool = new GBufferPool;
+        return *s_pPool;
+    }
+    GBufferPool(void)
+        : m_nLimit((size_t)256 << 20)
+        , m_nCached(0)
+    {
+    }
+    ~GBufferPool(void) { Trim(); }
+
+    void* Allocate(size_t nBytes) override
+    {
+        size_t nRounded;
+        Bucket& bucket = m_buckets[SizeClass(nBytes, nRounded)];
+        {
+            std::lock_guard<std::mutex> lock(bucket.mtx);
+            if (!bucket.buffers.empty()) {
+                void* pBuffer = bucket.buffers.back();
+                bucket.buffers.pop_back();
+                m_nCached -= nRounded;
+                return pBuffer;
+            }
+        }
+        return AlignedAlloc(nRounded);
+    }
+    void Free(void* pBuffer, size_t nBytes) override
+    {
+        size_t nRounded;
+        Bucket& bucket = m_buckets[SizeClass(nBytes, nRounded)];
+        if (m_nCached.fetch_add(nRounded) + nRounded <= m_nLimit) {
+            std::lock_guard<std::mutex> lock(bucket.mtx);
+            try {
+                bucket.buffers.push_back(pBuffer);
+                bucket.nBytes = nRounded;
+                return;
+            } catch (...) {
+            }
+        }
+        m_nCached -= nRounded;
+        AlignedFree(pBuffer, nRounded);
+    }
+
+    void SetLimit(size_t nBytes)
+    {
+        m_nLimit = nBytes;
+        if (m_nCached > nBytes) {
+            Trim();
+        }
+    }
+    size_t GetLimit() const { return m_nLimit; }
+    size_t GetCachedBytes() const { return m_nCached; }
+    // Returns every idle buffer to the system.
+    void Trim()
+    {
+        for (Bucket& bucket : m_buckets) {
+            std::lock_guard<std::mutex> lock(bucket.mtx);
+            for (void* pBuffer : bucket.buffers) {
+                AlignedFree(pBuffer, bucket.nBytes);
+            }
+            bucket.buffers.clear();
+        }
+        m_nCached = 0;
+    }
+
+private:
+    struct Bucket {
+        std::mutex mtx;
+        std::vector<void*> buffers;
+        size_t nBytes = 0; // the class's rounded size, which every buffer in it was allocated with.
+    };
+    // Sizes up to 64 share class 0, above that each octave (2^e, 2^(e+1)] has 4 steps of 2^(e-2).
+    static size_t SizeClass(size_t nBytes, size_t& nRounded)
+    {
+        if (nBytes <= 64) {
+            nRounded = 64;
+            return 0;
+        }
+        int e = 0;
+        while (((nBytes - 1) >> (e + 1)) != 0) {
+            e++;
+        }
+        size_t nStep = (size_t)1 << (e - 2);
+        size_t nUnits = (nBytes - 1) / nStep + 1;
+        nRounded = nUnits * nStep;
+        return 1 + (e - 6) * 4 + (nUnits - 5);
+    }
+
+    std::atomic<size_t> m_nLimit;
+    std::atomic<size_t> m_nCached;
+    Bucket m_buckets[1 + (sizeof(size_t) * 8 - 6) * 4];
+};
+
+template <class Format>
+class GBmpT;
+
+class GBmp // line buffer is not align to 4.
+{
+    template <class Format>
+    friend class GBmpT;
+    friend class GBmpPipeline;
+
+#pragma pack(push, 2)
+    struct GBITMAPFILEHEADER {
+        uint16_t bfType;
+        uint32_t bfSize;
+        uint16_t bfReserved1;
+        uint16_t bfReserved2;
+        uint32_t bfOffBits;
+    };
+    struct GBITMAPINFOHEADER {
+        uint32_t biSize;
+        int32_t biWidth;
+        int32_t biHeight;
+        uint16_t biPlanes;
+        uint16_t biBitCount;
+        uint32_t biCompression;
+        uint32_t biSizeImage;
+        int32_t biXPelsPerMeter;
+        int32_t biYPelsPerMeter;
+        uint32_t biClrUsed;
+        uint32_t biClrImportant;
+    };
+#pragma pack(pop)
+public:
+    GBmp(void)
+        : m_iWidth(0)
+        , m_iHeight(0)
+        , m_pImage(0)
+        , m_bGray(0)
+        , m_nCapacity(0)
+        , m_pAllocator(0)
+        , m_pRefs(nullptr) {};
+    GBmp(const void* pBuffer, int iWid, int iHei, bool bGray)
+        : m_iWidth(iWid)
+        , m_iHeight(iHei)
+        , m_pImage(0)
+        , m_bGray(bGray)
+        , m_nCapacity(0)
+        , m_pAllocator(0)
+        , m_pRefs(nullptr)
+    {
+        int iPxlBytes = bGray ? 1 : 4;
+        Reserve((size_t)iWid * iHei * iPxlBytes);
+        memcpy(m_pImage, pBuffer, (size_t)iWid * iHei * iPxlBytes);
+    }
+    // Copies share the pixel buffer until one of them writes: View(), Data(), the unsigned char*
+    // conversion and the in-place operations first give a shared image a buffer of its own. Any number of threads may copy the same image,
+    // as long as none of them writes to that GBmp object meanwhile.
+    GBmp(const GBmp& o)
+        : m_iWidth(o.m_iWidth)
+        , m_iHeight(o.m_iHeight)
+        , m_pImage(o.m_pImage)
+        , m_bGray(o.m_bGray)
+        , m_nCapacity(o.m_nCapacity)
+        , m_pAllocator(o.m_pAllocator)
+        , m_pRefs(o.m_pImage ? o.AddRef() : nullptr)
+    {
+    }
+    GBmp& operator=(const GBmp& o)
+    {
+        if (this != &o) {
+            GBmp bmpCopy(o);
+            Release();
+            Swap(bmpCopy);
+        }
+        return *this;
+    }
+    GBmp(GBmp&& o) noexcept
+        : m_iWidth(0)
+        , m_iHeight(0)
+        , m_pImage(0)
+        , m_bGray(0)
+        , m_nCapacity(0)
+        , m_pAllocator(0)
+        , m_pRefs(nullptr)
+    {
+        Swap(o);
+    }
+    GBmp& operator=(GBmp&& o) noexcept
+    {
+        if (this != &o) {
+            Release();
+            Swap(o);
+        }
+        return *this;
+    }
+    void Swap(GBmp& o) noexcept
+    {
+        std::swap(m_iWidth, o.m_iWidth);
+        std::swap(m_iHeight, o.m_iHeight);
+        std::swap(m_pImage, o.m_pImage);
+        std::swap(m_bGray, o.m_bGray);
+        std::swap(m_nCapacity, o.m_nCapacity);
+        std::swap(m_pAllocator, o.m_pAllocator);
+        m_pRefs.store(o.m_pRefs.exchange(m_pRefs.load(std::memory_order_relaxed), std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    // True while a copy still shares the pixel buffer.
+    bool IsShared() const
+    {
+        std::atomic<int>* pRefs = m_pRefs.load(std::memory_order_acquire);
+        return pRefs && pRefs->load(std::memory_order_acquire) > 1;
+    }
+    // Gives this image a buffer of its own, copying the pixels out of a shared one.
+    void MakeUnique()
+    {
+        if (IsShared()) {
+            GBmp bmpOwn;
+            bmpOwn.CopyImage(ConstView());
+            *this = std::move(bmpOwn);
+        }
+    }
+
+    // Allocator for the pixel buffers of every GBmp, GBufferPool::Instance() unless replaced.
+    // A buffer goes back to the allocator it came from, so switching is safe at any time.
+    static void SetAllocator(GBmpAllocator* pAllocator) { AllocatorSlot() = pAllocator ? pAllocator : &GBufferPool::Instance(); }
+    static GBmpAllocator* GetAllocator() { return AllocatorSlot(); }
+    // RLE files declaring more pixels than this are refused before anything is allocated, since a few
+    // bytes of stream can claim any size and leave the rest to be zero-filled; 64 MP by default.
+    static void SetRleMaxPixels(uint64_t nPixels) { RleMaxPixelsSlot().store(nPixels, std::memory_order_relaxed); }
+    static uint64_t GetRleMaxPixels() { return RleMaxPixelsSlot().load(std::memory_order_relaxed); }
+    ~GBmp(void) { Release(); }
+
+    // Rows are decoded a band at a time straight into their final place, orient included, so
+    // bottom-up files and load-then-rotate sequences take a single pass over the image.
+    bool LoadBmp(const char* strFileName, GOrientation orient = GORIENT_NONE)
+    {
+        GBMP_STAT_SCOPE(GSTAT_LOADBMP, 0);
+        FILE* inputFile = fopen(strFileName, "rb");
+        if (inputFile == 0) {
+            return false;
+        }
+
+        bool bRet = false;
+        try {
+            bRet = ReadBmp(inputFile, orient);
+        } catch (...) {
+            bRet = false;
+        }
+        if (!bRet) {
+            Release();
+        }
+        GBMP_STAT_BYTES((uint64_t)(std::max)(GBmpTell(inputFile), (int64_t)0));
+        fclose(inputFile);
+
+        return bRet;
+    }
+    // Writes the headers and the pixel array with a single writev. Rows that already are a multiple
+    // of 4 bytes go out straight from the image, others, and 24-bit rows, are encoded into one scratch
+    // buffer first. iBitCount 0 writes the image as it is (8-bit gray or 32-bit), color images also go
+    // out as 24-bit; SaveBmp fails on any other depth.
+    bool SaveBmp(const char* strFileName, int iBitCount = 0)
+    {
+        iBitCount = FileBitCount(iBitCount);
+        if (iBitCount == 0) {
+            return false;
+        }
+        unsigned char header[HeaderBytesMax];
+        size_t nHeader = WriteHeader(header, m_iWidth, m_iHeight, iBitCount);
+        size_t nLnLen = (size_t)m_iWidth * (m_bGray ? 1 : 4);
+        size_t nLnBytes = ((size_t)m_iWidth * iBitCount + 31) / 32 * 4;
+        const unsigned char* pPixels = m_pImage;
+        GBmp bmpPadded;
+        if (nLnBytes != nLnLen || iBitCount == 24) {
+            try {
+                bmpPadded.Reserve(nLnBytes * m_iHeight);
+            } catch (...) {
+                return false;
+            }
+            EncodePixels(bmpPadded.m_pImage, iBitCount);
+            pPixels = bmpPadded.m_pImage;
+        }
+        size_t nPixels = nLnBytes * m_iHeight;
+        GBMP_STAT_SCOPE(GSTAT_SAVEBMP, nHeader + nPixels);
+
+#ifdef _WIN32
+        FILE* outputFile = fopen(strFileName, "wb");
+        if (outputFile == 0) {
+            return false;
+        }
+        bool bRet = fwrite(header, 1, nHeader, outputFile) == nHeader;
+        bRet = bRet && fwrite(pPixels, 1, nPixels, outputFile) == nPixels;
+        return (fclose(outputFile) == 0) && bRet;
+#else
+        int fd = open(strFileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            return false;
+        }
+        struct iovec iov[2] = { { header, nHeader }, { const_cast<unsigned char*>(pPixels), nPixels } };
+        bool bRet = WriteFully(fd, iov, 2);
+        return (close(fd) == 0) && bRet;
+#endif
+    }
+
+    // Size of the bmp file SaveBmp and EncodeToBuffer produce for iBitCount, 0 for a depth they refuse.
+    size_t EncodedSize(int iBitCount = 0) const
+    {
+        iBitCount = FileBitCount(iBitCount);
+        if (iBitCount == 0) {
+            return 0;
+        }
+        size_t nLnBytes = ((size_t)m_iWidth * iBitCount + 31) / 32 * 4;
+        return HeaderBytes(iBitCount) + nLnBytes * m_iHeight;
+    }
+    // Writes the whole bmp file into caller memory, returns its size or 0 if nDstLen is below EncodedSize().
+    size_t EncodeToBuffer(void* pDst, size_t nDstLen, int iBitCount = 0)
+    {
+        size_t nSize = EncodedSize(iBitCount);
+        if (nSize == 0 || nDstLen < nSize) {
+            return 0;
+        }
+        iBitCount = FileBitCount(iBitCount);
+        GBMP_STAT_SCOPE(GSTAT_ENCODEBUFFER, nSize);
+        unsigned char* pBytes = static_cast<unsigned char*>(pDst);
+        EncodePixels(pBytes + WriteHeader(pBytes, m_iWidth, m_iHeight, iBitCount), iBitCount);
+        return nSize;
+    }
+    void EncodeToBuffer(std::vector<unsigned char>& file, int iBitCount = 0)
+    {
+        file.resize(EncodedSize(iBitCount));
+        EncodeToBuffer(file.data(), file.size(), iBitCount);
+    }
+
+    // Room for the headers of any file ParseHeader reads, a V5 info header and a full palette, which
+    // also holds what SaveBmp writes.
+    static constexpr size_t InfoHeaderBytesMax = 124;
+    static constexpr size_t HeaderBytesMax = sizeof(GBITMAPFILEHEADER) + InfoHeaderBytesMax + 256 * 4;
+    // Fills in the headers (and gray palette) SaveBmp puts in front of the pixel array, returns their size.
+    static size_t HeaderBytes(int iBitCount) { return sizeof(GBITMAPFILEHEADER) + sizeof(GBITMAPINFOHEADER) + (iBitCount == 1 ? 2 * 4 : iBitCount == 8 ? 256 * 4 : 0); }
+    static size_t WriteHeader(void* pDst, int iWidth, int iHeight, bool bGray) { return WriteHeader(pDst, iWidth, iHeight, bGray ? 8 : 32); }
+    // iBitCount is 1 (black and white palette), 8 (gray palette), 24 or 32.
+    static size_t WriteHeader(void* pDst, int iWidth, int iHeight, int iBitCount)
+    {
+        bool bGray = iBitCount == 8;
+        uint64_t nLnBytes = ((uint64_t)iWidth * iBitCount + 31) / 32 * 4;
+        uint32_t iPalette = iBitCount == 1 ? 2 * 4 : bGray * 256 * 4;
+        uint32_t iOffset = sizeof(GBITMAPFILEHEADER) + sizeof(GBITMAPINFOHEADER) + iPalette;
+        // the size fields are 32-bit; past 4 GB they are left 0, which readers of uncompressed files accept.
+        uint64_t nImage = nLnBytes * iHeight;
+        bool bFits = iOffset + nImage <= UINT32_MAX;
+        GBITMAPFILEHEADER bf { 0x4D42, bFits ? uint32_t(iOffset + nImage) : 0, 0, 0, iOffset };
+        GBITMAPINFOHEADER bi { sizeof(bi), iWidth, -iHeight, 1, uint16_t(iBitCount), 0, bFits ? uint32_t(nImage) : 0 };
+        unsigned char* pBytes = static_cast<unsigned char*>(pDst);
+        memcpy(pBytes, &bf, sizeof(bf));
+        memcpy(pBytes + sizeof(bf), &bi, sizeof(bi));
+        if (bGray) {
+            constexpr auto MyDwordArray = generatePalette(std::make_integer_sequence<uint32_t, 256>());
+            memcpy(pBytes + sizeof(bf) + sizeof(bi), MyDwordArray.data, sizeof(MyDwordArray.data));
+        }
+        if (iBitCount == 1) {
+            const uint32_t bw[2] = { 0, 0xFFFFFF };
+            memcpy(pBytes + sizeof(bf) + sizeof(bi), bw, sizeof(bw));
+        }
+        return iOffset;
+    }
+    // Validates the headers of a bmp file and fills in the pixel array layout: 1/4/8/24-bit rows,
+    // RLE8 and RLE4 streams, 16-bit 5-5-5 rows and 16/32-bit rows with any bit fields. pFile has to
+    // hold at least the headers (HeaderBytesMax bytes, or the whole file if it is shorter), nFileLen
+    // is the length of the whole file.
+    static bool ParseHeader(const void* pFile, size_t nFileLen, GBmpLayout& layout)
+    {
+        const unsigned char* pBytes = static_cast<const unsigned char*>(pFile);
+        if (nFileLen < sizeof(GBITMAPFILEHEADER) + sizeof(GBITMAPINFOHEADER)) {
+            return false;
+        }
+        GBITMAPFILEHEADER bf;
+        GBITMAPINFOHEADER bi;
+        memcpy(&bf, pBytes, sizeof(bf));
+        memcpy(&bi, pBytes + sizeof(bf), sizeof(bi));
+        if (bf.bfType != 0x4D42 || bi.biWidth <= 0 || bi.biHeight == 0 || bi.biHeight == INT32_MIN
+            || bi.biSize < sizeof(bi) || bi.biSize > InfoHeaderBytesMax || sizeof(bf) + bi.biSize > nFileLen
+            || bf.bfOffBits > nFileLen) {
+            return false;
+        }
+        bool bMasks = bi.biCompression == GBI_BITFIELDS || bi.biCompression == GBI_ALPHABITFIELDS;
+        switch (bi.biBitCount) {
+        case 1:
+        case 24:
+            if (bi.biCompression != GBI_RGB) {
+                return false;
+            }
+            break;
+        case 4:
+        case 8:
+            if (bi.biCompression != GBI_RGB && bi.biCompression != (bi.biBitCount == 8 ? GBI_RLE8 : GBI_RLE4)) {
+                return false;
+            }
+            break;
+        case 16:
+        case 32:
+            if (bi.biCompression != GBI_RGB && !bMasks) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+        layout.iWidth = bi.biWidth;
+        layout.bTopDown = bi.biHeight < 0;
+        layout.iHeight = layout.bTopDown ? -bi.biHeight : bi.biHeight;
+        layout.iBitCount = bi.biBitCount;
+        layout.nOffBits = bf.bfOffBits;
+        layout.iCompression = (int)bi.biCompression;
+        layout.bGray = bi.biBitCount <= 8;
+        layout.iCodec = bi.biBitCount == 1 ? GROW_BIT1 : bi.biBitCount == 24 ? GROW_BGR24 : GROW_COPY;
+        size_t nInfoEnd = sizeof(bf) + bi.biSize;
+        if (bi.biBitCount <= 8) {
+            ParsePalette(pBytes + nInfoEnd, layout.nOffBits > nInfoEnd ? (layout.nOffBits - nInfoEnd) / 4 : 0, bi.biClrUsed, layout);
+        }
+        if ((bi.biBitCount == 16 || bi.biBitCount == 32) && !ParseMasks(pBytes, bi, bMasks, layout)) {
+            return false;
+        }
+        size_t nAvail = nFileLen - layout.nOffBits;
+        if (layout.IsRle()) {
+            // top-down RLE does not exist; the stream is biSizeImage long when that is given.
+            layout.nSrcLnBytes = 0;
+            layout.nSrcLen = bi.biSizeImage != 0 && bi.biSizeImage <= nAvail ? bi.biSizeImage : nAvail;
+            return !layout.bTopDown && (uint64_t)layout.iWidth * layout.iHeight <= GetRleMaxPixels();
+        }
+        layout.nSrcLnBytes = ((size_t)layout.iWidth * bi.biBitCount + 31) / 32 * 4;
+        layout.nSrcLen = layout.nSrcLnBytes * layout.iHeight;
+        return (size_t)layout.iHeight <= nAvail / layout.nSrcLnBytes;
+    }
+    // Decodes a whole bmp file held in memory, the same formats and orientations LoadBmp handles.
+    bool DecodeFromBuffer(const void* pFile, size_t nFileLen, GOrientation orient = GORIENT_NONE)
+    {
+        GBMP_STAT_SCOPE(GSTAT_DECODEBUFFER, nFileLen);
+        GBmpLayout layout;
+        if (!ParseHeader(pFile, nFileLen, layout)) {
+            return false;
+        }
+        try {
+            const unsigned char* pTopLn = static_cast<const unsigned char*>(pFile) + layout.nOffBits;
+            if (layout.IsRle()) {
+                DecodeRleImage(pTopLn, layout.nSrcLen, layout, orient);
+                return true;
+            }
+            SetDecodeSize(layout, orient);
+            ptrdiff_t iSrcPitch = (ptrdiff_t)layout.nSrcLnBytes;
+            if (!layout.bTopDown) {
+                pTopLn += (layout.iHeight - 1) * iSrcPitch;
+                iSrcPitch = -iSrcPitch;
+            }
+            DecodeRows(pTopLn, iSrcPitch, 0, layout.iHeight, layout, orient);
+        } catch (...) {
+            Release();
+            return false;
+        }
+        return true;
+    }
+    // Decodes one file row of a 1/8/24/32-bit file with no palette or bit fields to take into account:
+    // 1/8-bit to gray, 24/32-bit to 32-bit.
+    static void DecodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth, int iBitCount)
+    {
+        switch (iBitCount) {
+        case 1:
+            Bit1ToGray8(pSrc, pDst, iWidth);
+            break;
+        case 8:
+            memcpy(pDst, pSrc, iWidth);
+            break;
+        case 24:
+            RGB24ToRGB32((void*)pSrc, pDst, iWidth, 1);
+            break;
+        case 32:
+            memcpy(pDst, pSrc, (size_t)iWidth * 4);
+            break;
+        }
+    }
+    // Decodes one file row into the in-memory layout, gray when layout.bGray and 32-bit otherwise.
+    static void DecodeLine(const unsigned char* pSrc, unsigned char* pDst, const GBmpLayout& layout)
+    {
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        int iWidth = layout.iWidth;
+        switch (layout.iCodec) {
+        case GROW_INDEX1:
+            if (layout.bGray) {
+                Index1ToGray8(pSrc, pDst, iWidth, layout.gray);
+            } else {
+                Index1ToRGB32(pSrc, pDst, iWidth, layout.palette);
+            }
+            break;
+        case GROW_INDEX4:
+            if (layout.bGray) {
+                kernels.pfnIndex4ToGray8(pSrc, pDst, iWidth, layout.gray);
+            } else {
+                kernels.pfnIndex4ToRGB32(pSrc, pDst, iWidth, layout.palette);
+            }
+            break;
+        case GROW_INDEX8:
+            if (layout.bGray) {
+                kernels.pfnIndex8ToGray8(pSrc, pDst, iWidth, layout.gray);
+            } else {
+                kernels.pfnIndex8ToRGB32(pSrc, pDst, iWidth, layout.palette);
+            }
+            break;
+        case GROW_RGB555:
+        case GROW_RGB565:
+            kernels.pfnRGB16ToRGB32(pSrc, pDst, iWidth, layout.iCodec == GROW_RGB565);
+            break;
+        case GROW_SWAPRB32:
+            kernels.pfnSwapRB32(pSrc, pDst, iWidth);
+            break;
+        case GROW_MASKS:
+            FieldsToRGB32(pSrc, pDst, layout);
+            break;
+        default:
+            DecodeLine(pSrc, pDst, iWidth, layout.iBitCount);
+            break;
+        }
+    }
+
+    static void Bit1ToGray8(const unsigned char* pSrcLn, unsigned char* pDstLn, int nWidth)
+    {
+        GBmpKernels::Get().pfnBit1ToGray8(pSrcLn, pDstLn, nWidth);
+    }
+    // Row conversions between the 32-bit layout (B, G, R, 4th byte) and others. Sources without a 4th
+    // byte get iAlpha there, 32-bit sources keep theirs; SwapRB turns BGRA into RGBA and back in place too.
+    static void BGR24ToBGRA32(const unsigned char* pSrcLn, unsigned char* pDstLn, int nWidth, unsigned char iAlpha = 0)
+    {
+        GBmpKernels::Get().pfnRGB24ToRGB32(pSrcLn, pDstLn, nWidth, iAlpha);
+    }
+    static void BGRA32ToBGR24(const unsigned char* pSrcLn, unsigned char* pDstLn, int nWidth)
+    {
+        GBmpKernels::Get().pfnRGB32ToRGB24(pSrcLn, pDstLn, nWidth);
+    }
+    static void SwapRB(const unsigned char* pSrcLn, unsigned char* pDstLn, int nWidth)
+    {
+        GBmpKernels::Get().pfnSwapRB32(pSrcLn, pDstLn, nWidth);
+    }
+    static void GrayToBGRA32(const unsigned char* pSrcLn, unsigned char* pDstLn, int nWidth, unsigned char iAlpha = 0)
+    {
+        GBmpKernels::Get().pfnGrayToRGB32(pSrcLn, pDstLn, nWidth, iAlpha);
+    }
+
+    inline bool IsGray() const { return m_bGray; }
+    // Writable pixels, unshared first; the const overload reads the shared buffer.
+    inline void* Data()
+    {
+        MakeUnique();
+        return m_pImage;
+    }
+    inline const void* Data() const { return m_pImage; }
+    inline int GetWidth() const { return m_iWidth; }
+    inline int GetHeight() const { return m_iHeight; }
+
+    // Keeps the pixels when the size is unchanged; a buffer copies share is replaced, never written to.
+    void SetImageSize(int iWid, int iHei, bool bGray)
+    {
+        if (iWid == m_iWidth && iHei == m_iHeight && bGray == m_bGray && m_pImage && !IsShared()) {
+            return;
+        } else {
+            Reserve((size_t)iWid * iHei * (bGray ? 1 : 4));
+            m_iWidth = iWid;
+            m_iHeight = iHei;
+            m_bGray = bGray;
+        }
+    }
+
+    void SetImage(const void* pImage, int iWid, int iHei, bool bGray)
+    {
+        SetImageSize(iWid, iHei, bGray);
+        memcpy(m_pImage, pImage, (size_t)iWid * iHei * (bGray ? 1 : 4));
+    }
+
+    void Release()
+    {
+        FreeBuffer();
+        m_iWidth = m_iHeight = 0;
+    }
+
+    // Takes ownership of a buffer allocated with new[].
+    void AttachData(void* pNewImage, int iWid, int iHei, bool bGray)
+    {
+        FreeBuffer();
+        m_iWidth = iWid;
+        m_iHeight = iHei;
+        m_bGray = bGray;
+        m_pImage = static_cast<unsigned char*>(pNewImage);
+        m_nCapacity = (size_t)iWid * iHei * (bGray ? 1 : 4);
+    }
+    // Hands the pixels to the caller, who releases them with delete[]. Buffers that came from the
+    // allocator, or that copies share, are copied into a new[] buffer first; prefer Swap or a move
+    // to keep them pooled.
+    void* DetachData()
+    {
+        unsigned char* pImage = m_pImage;
+        if ((m_pAllocator || IsShared()) && m_pImage) {
+            size_t nBytes = (size_t)m_iWidth * m_iHeight * (m_bGray ? 1 : 4);
+            pImage = new unsigned char[nBytes];
+            memcpy(pImage, m_pImage, nBytes);
+            FreeBuffer();
+        }
+        m_pImage = 0;
+        m_nCapacity = 0;
+        m_iWidth = m_iHeight = 0;
+        return pImage;
+    }
+
+    // Writable view, unshared first.
+    GImageView View()
+    {
+        MakeUnique();
+        return ConstView();
+    }
+    // View for reading only, it may point into a buffer copies share.
+    GImageView ConstView() const
+    {
+        return GImageView(m_pImage, m_iWidth, m_iHeight, (ptrdiff_t)m_iWidth * (m_bGray ? 1 : 4), m_bGray ? GPF_GRAY8 : GPF_BGRA32);
+    }
+
+    void MirrorV() { MirrorV(View()); }
+    static void MirrorV(const GImageView& view)
+    {
+        assert(!view.bReadOnly);
+        if (view.bReadOnly) {
+            return;
+        }
+        size_t nLnBytes = view.LineBytes();
+        GBMP_STAT_SCOPE(GSTAT_MIRRORV, (uint64_t)nLnBytes * view.iHeight * 2);
+        GThreadPool::Instance().ParallelFor(view.iHeight / 2, nLnBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            unsigned char pLn[1024];
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pUpLn = view.Line((int)i);
+                unsigned char* pDnLn = view.Line(view.iHeight - 1 - (int)i);
+                for (size_t j = 0; j < nLnBytes; j += sizeof(pLn)) {
+                    size_t nLen = (std::min)(sizeof(pLn), nLnBytes - j);
+                    memcpy(pLn, pUpLn + j, nLen);
+                    memcpy(pUpLn + j, pDnLn + j, nLen);
+                    memcpy(pDnLn + j, pLn, nLen);
+                }
+            }
+        });
+    }
+    void MirrorH() { MirrorH(View()); }
+    static void MirrorH(const GImageView& view)
+    {
+        assert(!view.bReadOnly);
+        if (view.bReadOnly) {
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_MIRRORH, (uint64_t)view.LineBytes() * view.iHeight * 2);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        bool bGray = view.IsGray();
+        // the left half of a row trades places with the reversed right half, an odd middle pixel stays.
+        size_t nHalf = view.iWidth / 2;
+        size_t nHiOffset = view.iWidth - nHalf;
+        GThreadPool::Instance().ParallelFor(view.iHeight, view.LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pLn = view.Line((int)i);
+                if (!bGray) {
+                    kernels.pfnReverse32((uint32_t*)pLn, (uint32_t*)pLn + nHiOffset, nHalf);
+                } else {
+                    kernels.pfnReverse8(pLn, pLn + nHiOffset, nHalf);
+                }
+            }
+        });
+    }
+    void ReverseImage() { ReverseImage(View()); }
+    // Rotates the view by 180 degrees in place.
+    static void ReverseImage(const GImageView& view)
+    {
+        assert(!view.bReadOnly);
+        if (view.bReadOnly) {
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_REVERSE, (uint64_t)view.LineBytes() * view.iHeight * 2);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        bool bGray = view.IsGray();
+        if (view.IsContiguous()) {
+            size_t nCount = (size_t)view.iWidth * view.iHeight;
+            GThreadPool::Instance().ParallelFor(nCount / 2, bGray ? 2 : 8, [&](size_t iBegin, size_t iEnd) {
+                if (!bGray) {
+                    uint32_t* pTarget = (uint32_t*)view.pData;
+                    kernels.pfnReverse32(pTarget + iBegin, pTarget + nCount - iEnd, iEnd - iBegin);
+                } else {
+                    kernels.pfnReverse8(view.pData + iBegin, view.pData + nCount - iEnd, iEnd - iBegin);
+                }
+            });
+            return;
+        }
+        // row i trades places with the mirrored row iHeight - 1 - i, the middle row with itself.
+        size_t nWidth = view.iWidth;
+        GThreadPool::Instance().ParallelFor((view.iHeight + 1) / 2, view.LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pUpLn = view.Line((int)i);
+                unsigned char* pDnLn = view.Line(view.iHeight - 1 - (int)i);
+                size_t nCount = pUpLn == pDnLn ? nWidth / 2 : nWidth;
+                size_t nHiOffset = pUpLn == pDnLn ? nWidth - nWidth / 2 : 0;
+                if (!bGray) {
+                    kernels.pfnReverse32((uint32_t*)pUpLn, (uint32_t*)pDnLn + nHiOffset, nCount);
+                } else {
+                    kernels.pfnReverse8(pUpLn, pDnLn + nHiOffset, nCount);
+                }
+            }
+        });
+    }
+
+    // Like Data(): the writable conversion unshares the buffer first.
+    operator unsigned char*()
+    {
+        MakeUnique();
+        return m_pImage;
+    }
+    operator const unsigned char*() const { return m_pImage; }
+    GBmp Rotate270() const { return Rotate270(ConstView()); }
+    static GBmp Rotate270(const GImageView& view)
+    {
+        GBMP_STAT_SCOPE(GSTAT_ROTATE270, (uint64_t)view.LineBytes() * view.iHeight * 2);
+        GBmp bmpRot;
+        bmpRot.SetImageSize(view.iHeight, view.iWidth, view.IsGray());
+        int iPxlBytes = view.PixelBytes();
+        TransposePixels(view.Line(view.iHeight - 1), -view.iPitch,
+            bmpRot.m_pImage, (ptrdiff_t)view.iHeight * iPxlBytes, view.iWidth, view.iHeight, iPxlBytes);
+        return bmpRot;
+    }
+    GBmp Rotate90() const { return Rotate90(ConstView()); }
+    static GBmp Rotate90(const GImageView& view)
+    {
+        GBMP_STAT_SCOPE(GSTAT_ROTATE90, (uint64_t)view.LineBytes() * view.iHeight * 2);
+        GBmp bmpRot;
+        bmpRot.SetImageSize(view.iHeight, view.iWidth, view.IsGray());
+        int iPxlBytes = view.PixelBytes();
+        ptrdiff_t iDstPitch = (ptrdiff_t)view.iHeight * iPxlBytes;
+        TransposePixels(view.pData, view.iPitch,
+            bmpRot.m_pImage + (view.iWidth - 1) * iDstPitch, -iDstPitch, view.iWidth, view.iHeight, iPxlBytes);
+        return bmpRot;
+    }
+    GBmp Transpose() const { return Transpose(ConstView()); }
+    static GBmp Transpose(const GImageView& view)
+    {
+        GBMP_STAT_SCOPE(GSTAT_TRANSPOSE, (uint64_t)view.LineBytes() * view.iHeight * 2);
+        GBmp bmpRot;
+        bmpRot.SetImageSize(view.iHeight, view.iWidth, view.IsGray());
+        int iPxlBytes = view.PixelBytes();
+        TransposePixels(view.pData, view.iPitch,
+            bmpRot.m_pImage, (ptrdiff_t)view.iHeight * iPxlBytes, view.iWidth, view.iHeight, iPxlBytes);
+        return bmpRot;
+    }
+#if defined(USING_IPP) || defined(USEING_IPP)
+    GBmp Transpose_ipp()
+    {
+        GBmp bmpRot;
+        bmpRot.SetImageSize(m_iHeight, m_iWidth, m_bGray);
+        IppStatus status = ippiTranspose_8u_C1R(m_pImage, m_iWidth, bmpRot, m_iHeight, { m_iWidth, m_iHeight });
+        return bmpRot;
+    }
+#endif
+    GBmp Rotate180() const { return Rotate180(ConstView()); }
+    static GBmp Rotate180(const GImageView& view)
+    {
+        GBMP_STAT_SCOPE(GSTAT_ROTATE180, (uint64_t)view.LineBytes() * view.iHeight * 2);
+        GBmp bmpRot;
+        bmpRot.SetImageSize(view.iWidth, view.iHeight, view.IsGray());
+        size_t nWidth = view.iWidth;
+        size_t nLnBytes = view.LineBytes();
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        // each row is copied and then reversed in place while it is still in L1.
+        GThreadPool::Instance().ParallelFor(view.iHeight, nLnBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pLnDst = bmpRot.m_pImage + i * nLnBytes;
+                memcpy(pLnDst, view.Line(view.iHeight - 1 - (int)i), nLnBytes);
+                if (view.IsGray()) {
+                    kernels.pfnReverse8(pLnDst, pLnDst + nWidth - nWidth / 2, nWidth / 2);
+                } else {
+                    kernels.pfnReverse32((uint32_t*)pLnDst, (uint32_t*)pLnDst + nWidth - nWidth / 2, nWidth / 2);
+                }
+            }
+        });
+        return bmpRot;
+    }
+
+    // The rotations and transpose above without a second image, so peak memory stays at one frame.
+    // Square images move tiles in 4-way swaps (2-way for the transpose) in a single pass; others
+    // are transposed in place, see TransposeInPlaceT, and flipped with MirrorV. A buffer copies
+    // share is rotated into a new one instead.
+    void Rotate90InPlace()
+    {
+        if (IsShared()) {
+            *this = Rotate90();
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_ROTATE90, (uint64_t)m_iWidth * m_iHeight * (m_bGray ? 1 : 4) * 2);
+        if (m_iWidth == m_iHeight) {
+            RotateSquareInPlace(true);
+        } else {
+            TransposeBufferInPlace();
+            MirrorV(View());
+        }
+    }
+    void Rotate270InPlace()
+    {
+        if (IsShared()) {
+            *this = Rotate270();
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_ROTATE270, (uint64_t)m_iWidth * m_iHeight * (m_bGray ? 1 : 4) * 2);
+        if (m_iWidth == m_iHeight) {
+            RotateSquareInPlace(false);
+        } else {
+            MirrorV(View());
+            TransposeBufferInPlace();
+        }
+    }
+    void Rotate180InPlace()
+    {
+        if (IsShared()) {
+            *this = Rotate180();
+            return;
+        }
+        ReverseImage();
+    }
+    void TransposeInPlace()
+    {
+        if (IsShared()) {
+            *this = Transpose();
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_TRANSPOSE, (uint64_t)m_iWidth * m_iHeight * (m_bGray ? 1 : 4) * 2);
+        TransposeBufferInPlace();
+    }
+
+    void CropImage(GBmp& imgSrc, int left, int top, int right, int bottom)
+    {
+        CopyImage(imgSrc.CropImage(left, top, right, bottom));
+    }
+    // The region as a view on this image's pixels, nothing is copied.
+    GImageView CropImage(int left, int top, int right, int bottom) { return View().Crop(left, top, right, bottom); }
+
+    // Shares imgSrc's pixels, see the copy constructor.
+    void CopyImage(const GBmp& imgSrc) { *this = imgSrc; }
+    // Packs the view's rows into this image; the view may point into this image.
+    void CopyImage(const GImageView& view)
+    {
+        size_t nLnBytes = view.LineBytes();
+        const unsigned char* pBegin = m_pImage;
+        const unsigned char* pEnd = m_pImage + (size_t)m_iWidth * m_iHeight * (m_bGray ? 1 : 4);
+        if (view.pData >= pBegin && view.pData < pEnd) {
+            GBmp bmpCopy;
+            bmpCopy.CopyImage(view);
+            std::swap(*this, bmpCopy);
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_COPY, (uint64_t)nLnBytes * view.iHeight * 2);
+        SetImageSize(view.iWidth, view.iHeight, view.IsGray());
+        GThreadPool::Instance().ParallelFor(view.iHeight, nLnBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                memcpy(m_pImage + i * nLnBytes, view.Line((int)i), nLnBytes);
+            }
+        });
+    }
+
+    void ToGray()
+    {
+        if (IsGray()) {
+            return;
+        }
+        size_t nCount = (size_t)m_iWidth * m_iHeight;
+        GBMP_STAT_SCOPE(GSTAT_TOGRAY, (uint64_t)nCount * 5);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool& pool = GThreadPool::Instance();
+        if (!pool.IsParallel(nCount * 5) && !IsShared()) {
+            m_bGray = true;
+            kernels.pfnToGray((const uint32_t*)m_pImage, m_pImage, nCount);
+            return;
+        }
+        // in place, a band would overwrite pixels the band before it has yet to read; a shared
+        // buffer is only read.
+        GBmp bmpGray;
+        bmpGray.SetImageSize(m_iWidth, m_iHeight, true);
+        pool.ParallelFor(nCount, 5, [&](size_t iBegin, size_t iEnd) {
+            kernels.pfnToGray((const uint32_t*)m_pImage + iBegin, bmpGray.m_pImage + iBegin, iEnd - iBegin);
+        });
+        *this = std::move(bmpGray);
+    }
+    // Writes the gray of a 32-bit view into a gray view of the same size, e.g. between two ROIs.
+    static void ToGray(const GImageView& src, const GImageView& dst)
+    {
+        assert(!dst.bReadOnly);
+        if (src.IsGray() || !dst.IsGray() || dst.bReadOnly || src.iWidth != dst.iWidth || src.iHeight != dst.iHeight) {
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_TOGRAY, (uint64_t)src.iWidth * src.iHeight * 5);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(src.iHeight, (size_t)src.iWidth * 5, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                kernels.pfnToGray((const uint32_t*)src.Line((int)i), dst.Line((int)i), src.iWidth);
+            }
+        });
+    }
+
+    // ToGray that also counts the gray values, each block of pixels while it is still in cache.
+    void ToGray(GHistogram& hist)
+    {
+        if (IsGray()) {
+            hist = Histogram();
+            return;
+        }
+        size_t nCount = (size_t)m_iWidth * m_iHeight;
+        GBMP_STAT_SCOPE(GSTAT_TOGRAY, (uint64_t)nCount * 5);
+        GBmp bmpGray;
+        unsigned char* pDst = m_pImage;
+        if (GThreadPool::Instance().IsParallel(nCount * 5) || IsShared()) {
+            bmpGray.SetImageSize(m_iWidth, m_iHeight, true);
+            pDst = bmpGray.m_pImage;
+        }
+        // in place, gray pixel i never lands past 32-bit pixel i, so blocks taken in order are safe.
+        HistogramAcc acc(1);
+        GThreadPool::Instance().ParallelFor(nCount, 5, [&](size_t iBegin, size_t iEnd) {
+            const GBmpKernels& kernels = GBmpKernels::Get();
+            HistogramAcc::Local local;
+            for (size_t i = iBegin; i < iEnd; i += 4096) {
+                size_t n = (std::min)((size_t)4096, iEnd - i);
+                kernels.pfnToGray((const uint32_t*)m_pImage + i, pDst + i, n);
+                local.Add(pDst + i, n);
+            }
+            acc.Merge(local);
+        });
+        if (pDst == m_pImage) {
+            m_bGray = true;
+        } else {
+            *this = std::move(bmpGray);
+        }
+        acc.Get(hist);
+    }
+    static void ToGray(const GImageView& src, const GImageView& dst, GHistogram& hist)
+    {
+        assert(!dst.bReadOnly);
+        if (src.IsGray() || !dst.IsGray() || dst.bReadOnly || src.iWidth != dst.iWidth || src.iHeight != dst.iHeight) {
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_TOGRAY, (uint64_t)src.iWidth * src.iHeight * 5);
+        HistogramAcc acc(1);
+        GThreadPool::Instance().ParallelFor(src.iHeight, (size_t)src.iWidth * 5, [&](size_t iBegin, size_t iEnd) {
+            const GBmpKernels& kernels = GBmpKernels::Get();
+            HistogramAcc::Local local;
+            for (size_t i = iBegin; i < iEnd; i++) {
+                kernels.pfnToGray((const uint32_t*)src.Line((int)i), dst.Line((int)i), src.iWidth);
+                local.Add(dst.Line((int)i), src.iWidth);
+            }
+            acc.Merge(local);
+        });
+        acc.Get(hist);
+    }
+
+    // Swaps B and R of every pixel, BGRA <-> RGBA, the 4th byte stays; gray images are left alone.
+    void SwapRB() { SwapRB(View(), View()); }
+    // Between two 32-bit views of the same size, which may be the same view.
+    static void SwapRB(const GImageView& src, const GImageView& dst)
+    {
+        assert(!dst.bReadOnly);
+        if (src.IsGray() || dst.IsGray() || dst.bReadOnly || src.iWidth != dst.iWidth || src.iHeight != dst.iHeight) {
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_CONVERT, (uint64_t)src.LineBytes() * src.iHeight * 2);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(src.iHeight, src.LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                kernels.pfnSwapRB32(src.Line((int)i), dst.Line((int)i), src.iWidth);
+            }
+        });
+    }
+
+    // Turns a gray image into 32-bit with the gray in B, G and R and iAlpha in the 4th byte, the
+    // layout LoadBmp gives color files (iAlpha 0).
+    void ToBGRA(unsigned char iAlpha = 0)
+    {
+        if (!IsGray()) {
+            return;
+        }
+        GBmp bmpColor;
+        bmpColor.SetImageSize(m_iWidth, m_iHeight, false);
+        ToBGRA(ConstView(), bmpColor.View(), iAlpha);
+        *this = std::move(bmpColor);
+    }
+    // Writes a gray view into a 32-bit view of the same size.
+    static void ToBGRA(const GImageView& src, const GImageView& dst, unsigned char iAlpha = 0)
+    {
+        assert(!dst.bReadOnly);
+        if (!src.IsGray() || dst.IsGray() || dst.bReadOnly || src.iWidth != dst.iWidth || src.iHeight != dst.iHeight) {
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_CONVERT, (uint64_t)src.iWidth * src.iHeight * 5);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(src.iHeight, (size_t)src.iWidth * 5, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                kernels.pfnGrayToRGB32(src.Line((int)i), dst.Line((int)i), src.iWidth, iAlpha);
+            }
+        });
+    }
+
+    GHistogram Histogram() const { return Histogram(ConstView()); }
+    // Counts go to 4 sub-histograms in turn so back-to-back equal bytes do not wait on each other's
+    // increment; for 32-bit rows the 4 are the channels themselves.
+    static GHistogram Histogram(const GImageView& view)
+    {
+        GBMP_STAT_SCOPE(GSTAT_HISTOGRAM, (uint64_t)view.LineBytes() * view.iHeight);
+        HistogramAcc acc(view.PixelBytes());
+        GThreadPool::Instance().ParallelFor(view.iHeight, view.LineBytes(), [&](size_t iBegin, size_t iEnd) {
+            HistogramAcc::Local local;
+            for (size_t i = iBegin; i < iEnd; i++) {
+                local.Add(view.Line((int)i), view.LineBytes());
+            }
+            acc.Merge(local);
+        });
+        GHistogram hist;
+        acc.Get(hist);
+        return hist;
+    }
+
+    GImageStats Statistics() const { return Statistics(ConstView()); }
+    // Min, max, sum and sum of squares per channel in one vectorized pass.
+    static GImageStats Statistics(const GImageView& view)
+    {
+        GBMP_STAT_SCOPE(GSTAT_STATISTICS, (uint64_t)view.LineBytes() * view.iHeight);
+        GByteSums total;
+        InitByteSums(total);
+        std::mutex mtx;
+        GThreadPool::Instance().ParallelFor(view.iHeight, view.LineBytes(), [&](size_t iBegin, size_t iEnd) {
+            const GBmpKernels& kernels = GBmpKernels::Get();
+            GByteSums sums;
+            InitByteSums(sums);
+            if (view.IsContiguous()) {
+                kernels.pfnByteSums(view.Line((int)iBegin), (iEnd - iBegin) * view.LineBytes(), sums);
+            } else {
+                for (size_t i = iBegin; i < iEnd; i++) {
+                    kernels.pfnByteSums(view.Line((int)i), view.LineBytes(), sums);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            for (int k = 0; k < 4; k++) {
+                total.iMin[k] = (std::min)(total.iMin[k], sums.iMin[k]);
+                total.iMax[k] = (std::max)(total.iMax[k], sums.iMax[k]);
+                total.nSum[k] += sums.nSum[k];
+                total.nSumSq[k] += sums.nSumSq[k];
+            }
+        });
+        GImageStats stats;
+        memset(&stats, 0, sizeof(stats));
+        stats.nChannels = view.IsGray() ? 1 : 4;
+        stats.nCount = (uint64_t)(std::max)(view.iWidth, 0) * (std::max)(view.iHeight, 0);
+        if (stats.nCount == 0) {
+            return stats;
+        }
+        for (int k = 0; k < 4; k++) {
+            int c = view.IsGray() ? 0 : k;
+            stats.iMin[c] = k == c ? total.iMin[k] : (std::min)(stats.iMin[c], (int)total.iMin[k]);
+            stats.iMax[c] = (std::max)(stats.iMax[c], (int)total.iMax[k]);
+            stats.nSum[c] += total.nSum[k];
+            stats.nSumSq[c] += total.nSumSq[k];
+        }
+        return stats;
+    }
+
+    // Otsu's threshold of one channel: the level t that best splits the values into < t and >= t, ready
+    // for GBmpBitonal::Binarize. A histogram with a single value returns that value.
+    static int OtsuThreshold(const GHistogram& hist, int iChannel = 0)
+    {
+        const uint64_t* pBins = hist.bins[iChannel];
+        double dTotal = 0, dSumAll = 0;
+        for (int v = 0; v < 256; v++) {
+            dTotal += (double)pBins[v];
+            dSumAll += (double)v * pBins[v];
+        }
+        double dBest = -1, dCount0 = 0, dSum0 = 0;
+        int iThreshold = dTotal > 0 ? (int)(dSumAll / dTotal) : 0;
+        for (int v = 0; v < 255; v++) {
+            dCount0 += (double)pBins[v];
+            dSum0 += (double)v * pBins[v];
+            double dCount1 = dTotal - dCount0;
+            if (dCount0 == 0 || dCount1 == 0) {
+                continue;
+            }
+            double dDiff = dSum0 / dCount0 - (dSumAll - dSum0) / dCount1;
+            double dBetween = dCount0 * dCount1 * dDiff * dDiff;
+            if (dBetween > dBest) {
+                dBest = dBetween;
+                iThreshold = v + 1;
+            }
+        }
+        return iThreshold;
+    }
+
+    GBmp Resize(int iWidth, int iHeight, GResizeMode mode = GRESIZE_BILINEAR) const { return Resize(ConstView(), iWidth, iHeight, mode); }
+    // Scales the view to iWidth x iHeight. Weights are fixed point, 7 fraction bits along a row and 14 down
+    // a column; each source row is resampled once and kept while the output rows of a band still need it.
+    // Area reductions along either axis take the exact box sum instead, see ResizeArea.
+    static GBmp Resize(const GImageView& view, int iWidth, int iHeight, GResizeMode mode = GRESIZE_BILINEAR)
+    {
+        GBMP_STAT_SCOPE(GSTAT_RESIZE, (uint64_t)view.LineBytes() * view.iHeight + (uint64_t)(std::max)(iWidth, 0) * (std::max)(iHeight, 0) * view.PixelBytes());
+        GBmp bmpOut;
+        bmpOut.SetImageSize(iWidth, iHeight, view.IsGray());
+        if (iWidth <= 0 || iHeight <= 0 || view.iWidth <= 0 || view.iHeight <= 0) {
+            return bmpOut;
+        }
+        int iPxlBytes = view.PixelBytes();
+        size_t nDstLnBytes = (size_t)iWidth * iPxlBytes;
+        if (mode == GRESIZE_AREA && (view.iWidth > iWidth || view.iHeight > iHeight)) {
+            ResizeArea(view, bmpOut);
+            return bmpOut;
+        }
+        ResizeTaps tapsX = BuildResizeTaps(view.iWidth, iWidth, mode, 1 << 7);
+        ResizeTaps tapsY = BuildResizeTaps(view.iHeight, iHeight, mode, 1 << 14);
+        GThreadPool& pool = GThreadPool::Instance();
+        if (mode == GRESIZE_NEAREST) {
+            pool.ParallelFor(iHeight, nDstLnBytes * 2, [&](size_t iBegin, size_t iEnd) {
+                for (size_t y = iBegin; y < iEnd; y++) {
+                    unsigned char* pLnDst = bmpOut.m_pImage + y * nDstLnBytes;
+                    if (y > iBegin && tapsY.index[y] == tapsY.index[y - 1]) { // upscaled rows repeat.
+                        memcpy(pLnDst, pLnDst - nDstLnBytes, nDstLnBytes);
+                        continue;
+                    }
+                    const unsigned char* pLnSrc = view.Line(tapsY.index[y]);
+                    const int* pIndex = tapsX.index.data();
+                    if (iPxlBytes == 1) {
+                        for (int x = 0; x < iWidth; x++) {
+                            pLnDst[x] = pLnSrc[pIndex[x]];
+                        }
+                    } else {
+                        for (int x = 0; x < iWidth; x++) {
+                            memcpy(pLnDst + (size_t)x * 4, pLnSrc + (size_t)pIndex[x] * 4, 4);
+                        }
+                    }
+                }
+            });
+            return bmpOut;
+        }
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        auto pfnResizeH = iPxlBytes == 1 ? kernels.pfnResizeH8 : kernels.pfnResizeH32;
+        int nTaps = tapsY.nTaps;
+        size_t nItemBytes = nDstLnBytes + view.LineBytes() * ((view.iHeight + iHeight - 1) / iHeight);
+        pool.ParallelFor(iHeight, nItemBytes, [&](size_t iBegin, size_t iEnd) {
+            // a source row sy lives in slot sy % nTaps; the rows of one output row are nTaps consecutive ones at most.
+            std::vector<int16_t> cache(nDstLnBytes * nTaps);
+            std::vector<int> slotRow(nTaps, -1);
+            std::vector<const int16_t*> rows(nTaps);
+            for (size_t y = iBegin; y < iEnd; y++) {
+                for (int t = 0; t < nTaps; t++) {
+                    int sy = tapsY.index[y * nTaps + t];
+                    int iSlot = sy % nTaps;
+                    int16_t* pRow = cache.data() + iSlot * nDstLnBytes;
+                    if (slotRow[iSlot] != sy) {
+                        pfnResizeH(view.Line(sy), pRow, tapsX.index.data(), tapsX.weights.data(), tapsX.nTaps, iWidth);
+                        slotRow[iSlot] = sy;
+                    }
+                    rows[t] = pRow;
+                }
+                kernels.pfnResizeV(rows.data(), &tapsY.weights[y * nTaps], nTaps, bmpOut.m_pImage + y * nDstLnBytes, nDstLnBytes);
+            }
+        });
+        return bmpOut;
+    }
+
+    GBmp Downsample2x() const { return Downsample2x(ConstView()); }
+    // Exact 2x2 box average, (iWidth / 2) x (iHeight / 2); an odd last row or column is dropped.
+    static GBmp Downsample2x(const GImageView& view)
+    {
+        std::vector<GBmp> levels;
+        BuildPyramid(view, levels, 1);
+        return levels.empty() ? GBmp() : std::move(levels[0]);
+    }
+    void BuildPyramid(std::vector<GBmp>& levels, int nLevels = 0) const { BuildPyramid(ConstView(), levels, nLevels); }
+    // levels[k] is the view after k + 1 Downsample2x steps; nLevels of them, or with 0 until a side would be 0.
+    // Bands of source rows run down through the first five levels while they are in cache, so the source is
+    // read once; deeper levels, 1/1024 of the source and less, are halved from the fifth.
+    static void BuildPyramid(const GImageView& view, std::vector<GBmp>& levels, int nLevels = 0)
+    {
+        levels.clear();
+        int iWidth = view.iWidth;
+        int iHeight = view.iHeight;
+        while ((nLevels <= 0 || (int)levels.size() < nLevels) && iWidth >= 2 && iHeight >= 2) {
+            iWidth /= 2;
+            iHeight /= 2;
+            levels.emplace_back();
+            levels.back().SetImageSize(iWidth, iHeight, view.IsGray());
+        }
+        if (levels.empty()) {
+            return;
+        }
+        GBMP_STAT_SCOPE(GSTAT_PYRAMID, (uint64_t)view.LineBytes() * view.iHeight * 4 / 3);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        auto pfnHalve = view.IsGray() ? kernels.pfnHalve8 : kernels.pfnHalve32;
+        int iPxlBytes = view.PixelBytes();
+        int nStream = (std::min)((int)levels.size(), 5);
+        // band b holds rows [b << (nStream - 1 - k), (b + 1) << (nStream - 1 - k)) of level k, which read
+        // rows of level k - 1 from the same band only.
+        size_t nBands = ((size_t)levels[0].m_iHeight + ((size_t)1 << (nStream - 1)) - 1) >> (nStream - 1);
+        GThreadPool::Instance().ParallelFor(nBands, view.LineBytes() << nStream, [&](size_t iBegin, size_t iEnd) {
+            for (size_t b = iBegin; b < iEnd; b++) {
+                for (int k = 0; k < nStream; k++) {
+                    GBmp& bmpDst = levels[k];
+                    int iShift = nStream - 1 - k;
+                    size_t nDstLnBytes = (size_t)bmpDst.m_iWidth * iPxlBytes;
+                    size_t nSrcLnBytes = k == 0 ? 0 : (size_t)levels[k - 1].m_iWidth * iPxlBytes;
+                    int y1 = (int)(std::min)((b + 1) << iShift, (size_t)bmpDst.m_iHeight);
+                    for (int y = (int)(b << iShift); y < y1; y++) {
+                        const unsigned char* pLn0 = k == 0 ? view.Line(2 * y) : levels[k - 1].m_pImage + 2 * y * nSrcLnBytes;
+                        const unsigned char* pLn1 = k == 0 ? view.Line(2 * y + 1) : pLn0 + nSrcLnBytes;
+                        pfnHalve(pLn0, pLn1, bmpDst.m_pImage + y * nDstLnBytes, bmpDst.m_iWidth);
+                    }
+                }
+            }
+        });
+        for (size_t k = nStream; k < levels.size(); k++) {
+            GBmp& bmpSrc = levels[k - 1];
+            size_t nSrcLnBytes = (size_t)bmpSrc.m_iWidth * iPxlBytes;
+            size_t nDstLnBytes = (size_t)levels[k].m_iWidth * iPxlBytes;
+            for (int y = 0; y < levels[k].m_iHeight; y++) {
+                const unsigned char* pLn0 = bmpSrc.m_pImage + 2 * y * nSrcLnBytes;
+                pfnHalve(pLn0, pLn0 + nSrcLnBytes, levels[k].m_pImage + y * nDstLnBytes, levels[k].m_iWidth);
+            }
+        }
+    }
+
+private:
+    // Histogram counts of one ParallelFor chunk go to Local and are summed into the shared bins once per chunk.
+    class HistogramAcc
+    {
+    public:
+        struct Local {
+            uint32_t sub[4][256];
+            uint64_t bins[4][256];
+            size_t nPending;
+
+            Local(void)
+                : nPending(0)
+            {
+                memset(sub, 0, sizeof(sub));
+                memset(bins, 0, sizeof(bins));
+            }
+            // byte i of the run goes to sub-histogram i % 4; runs start on pixel boundaries.
+            void Add(const unsigned char* p, size_t n)
+            {
+                if (nPending + n >= ((size_t)1 << 31)) {
+                    Flush();
+                }
+                nPending += n;
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    uint64_t q;
+                    memcpy(&q, p + i, 8);
+                    sub[0][q & 0xFF]++;
+                    sub[1][(q >> 8) & 0xFF]++;
+                    sub[2][(q >> 16) & 0xFF]++;
+                    sub[3][(q >> 24) & 0xFF]++;
+                    sub[0][(q >> 32) & 0xFF]++;
+                    sub[1][(q >> 40) & 0xFF]++;
+                    sub[2][(q >> 48) & 0xFF]++;
+                    sub[3][q >> 56]++;
+                }
+                for (; i < n; i++) {
+                    sub[i & 3][p[i]]++;
+                }
+            }
+            void Flush()
+            {
+                for (int k = 0; k < 4; k++) {
+                    for (int v = 0; v < 256; v++) {
+                        bins[k][v] += sub[k][v];
+                    }
+                }
+                memset(sub, 0, sizeof(sub));
+                nPending = 0;
+            }
+        };
+
+        explicit HistogramAcc(int iPxlBytes)
+            : m_iPxlBytes(iPxlBytes)
+        {
+            memset(m_bins, 0, sizeof(m_bins));
+        }
+        void Merge(Local& local)
+        {
+            local.Flush();
+            std::lock_guard<std::mutex> lock(m_mtx);
+            for (int k = 0; k < 4; k++) {
+                for (int v = 0; v < 256; v++) {
+                    m_bins[k][v] += local.bins[k][v];
+                }
+            }
+        }
+        // 4 sub-histograms are one gray histogram or the 4 channels of 32-bit pixels.
+        void Get(GHistogram& hist) const
+        {
+            memset(&hist, 0, sizeof(hist));
+            hist.nChannels = m_iPxlBytes == 1 ? 1 : 4;
+            for (int k = 0; k < 4; k++) {
+                for (int v = 0; v < 256; v++) {
+                    hist.bins[m_iPxlBytes == 1 ? 0 : k][v] += m_bins[k][v];
+                }
+            }
+        }
+
+    private:
+        int m_iPxlBytes;
+        std::mutex m_mtx;
+        uint64_t m_bins[4][256];
+    };
+    static void InitByteSums(GByteSums& sums)
+    {
+        memset(&sums, 0, sizeof(sums));
+        memset(sums.iMin, 0xFF, sizeof(sums.iMin));
+    }
+
+    struct ResizeTaps { // per output pixel (or row), nTaps source indices and weights summing to iOne.
+        int nTaps;
+        std::vector<int> index;
+        std::vector<int16_t> weights;
+    };
+    static ResizeTaps BuildResizeTaps(int nSrc, int nDst, GResizeMode mode, int iOne)
+    {
+        double dScale = (double)nSrc / nDst;
+        ResizeTaps taps;
+        taps.nTaps = mode == GRESIZE_NEAREST ? 1 : mode == GRESIZE_BILINEAR ? 2 : (int)std::ceil(dScale) + 1;
+        taps.index.resize((size_t)nDst * taps.nTaps);
+        taps.weights.resize((size_t)nDst * taps.nTaps);
+        std::vector<double> w(taps.nTaps, 0.0);
+        for (int i = 0; i < nDst; i++) {
+            int iStart;
+            if (mode == GRESIZE_NEAREST) {
+                iStart = (int)((i + 0.5) * dScale);
+                w[0] = 1;
+            } else if (mode == GRESIZE_BILINEAR) {
+                double dPos = (i + 0.5) * dScale - 0.5;
+                iStart = (int)std::floor(dPos);
+                w[1] = dPos - iStart;
+                w[0] = 1 - w[1];
+            } else {
+                double d0 = i * dScale;
+                double d1 = (i + 1) * dScale;
+                iStart = (int)std::floor(d0);
+                for (int t = 0; t < taps.nTaps; t++) {
+                    w[t] = (std::max)(0.0, (std::min)(d1, (double)(iStart + t + 1)) - (std::max)(d0, (double)(iStart + t))) / dScale;
+                }
+            }
+            // rounded weights add up to iOne exactly, the largest one takes the difference.
+            int16_t* pWeight = &taps.weights[(size_t)i * taps.nTaps];
+            int iSum = 0;
+            int iMax = 0;
+            for (int t = 0; t < taps.nTaps; t++) {
+                pWeight[t] = (int16_t)std::lround(w[t] * iOne);
+                iSum += pWeight[t];
+                iMax = w[t] > w[iMax] ? t : iMax;
+                taps.index[(size_t)i * taps.nTaps + t] = (std::min)((std::max)(iStart + t, 0), nSrc - 1);
+            }
+            pWeight[iMax] = (int16_t)(pWeight[iMax] + iOne - iSum);
+        }
+        return taps;
+    }
+    struct AreaSpans { // output i sums sources first[i] + k, k < offset[i + 1] - offset[i], times weights[offset[i] + k].
+        uint32_t nTotal; // the weights of every output add up to this.
+        std::vector<int> first;
+        std::vector<size_t> offset;
+        std::vector<uint32_t> weights;
+    };
+    // With a / b = nSrc / nDst in lowest terms, source s covers [s * b, (s + 1) * b) and output i covers
+    // [i * a, (i + 1) * a), so every overlap is a whole number and nothing rounds away.
+    static AreaSpans BuildAreaSpans(int nSrc, int nDst)
+    {
+        int64_t g = nSrc;
+        for (int64_t t = nDst; t != 0;) {
+            int64_t u = g % t;
+            g = t;
+            t = u;
+        }
+        int64_t a = nSrc / g;
+        int64_t b = nDst / g;
+        AreaSpans spans;
+        spans.nTotal = (uint32_t)a;
+        spans.first.resize(nDst);
+        spans.offset.resize((size_t)nDst + 1);
+        spans.weights.reserve((size_t)nSrc + nDst);
+        for (int i = 0; i < nDst; i++) {
+            int64_t d0 = i * a;
+            int64_t d1 = d0 + a;
+            int64_t s = d0 / b;
+            spans.first[i] = (int)s;
+            spans.offset[i] = spans.weights.size();
+            for (; s * b < d1; s++) {
+                spans.weights.push_back((uint32_t)((std::min)(d1, (s + 1) * b) - (std::max)(d0, s * b)));
+            }
+        }
+        spans.offset[nDst] = spans.weights.size();
+        return spans;
+    }
+    // GRESIZE_AREA when an axis shrinks: the source rows of an output row are summed down the columns with
+    // their integer weights, then the column sums across each output pixel, and the total divided once,
+    // rounded. The sums stay in 32 bits while 255 times the total fits, which takes a shrink past 65535
+    // times along both axes to break.
+    static void ResizeArea(const GImageView& view, GBmp& bmpOut)
+    {
+        AreaSpans spansX = BuildAreaSpans(view.iWidth, bmpOut.m_iWidth);
+        AreaSpans spansY = BuildAreaSpans(view.iHeight, bmpOut.m_iHeight);
+        bool bNarrow = (uint64_t)spansX.nTotal * spansY.nTotal * 255 <= UINT32_MAX;
+        if (view.IsGray() && bNarrow) {
+            ResizeAreaT<uint32_t, 1>(view, spansX, spansY, bmpOut);
+        } else if (view.IsGray()) {
+            ResizeAreaT<uint64_t, 1>(view, spansX, spansY, bmpOut);
+        } else if (bNarrow) {
+            ResizeAreaT<uint32_t, 4>(view, spansX, spansY, bmpOut);
+        } else {
+            ResizeAreaT<uint64_t, 4>(view, spansX, spansY, bmpOut);
+        }
+    }
+    static void AreaSum(const unsigned char* pSrc, uint32_t w, uint32_t* pSum, size_t nCount)
+    {
+        GBmpKernels::Get().pfnAreaSum(pSrc, w, pSum, nCount);
+    }
+    static void AreaSum(const unsigned char* pSrc, uint32_t w, uint64_t* pSum, size_t nCount)
+    {
+        for (size_t i = 0; i < nCount; i++) {
+            pSum[i] += (uint64_t)pSrc[i] * w;
+        }
+    }
+    template <class TSum, int iPxlBytes>
+    static void ResizeAreaT(const GImageView& view, const AreaSpans& spansX, const AreaSpans& spansY, GBmp& bmpOut)
+    {
+        size_t nSrcLnBytes = view.LineBytes();
+        size_t nDstLnBytes = (size_t)bmpOut.m_iWidth * iPxlBytes;
+        uint64_t nTotal = (uint64_t)spansX.nTotal * spansY.nTotal;
+        double dInvTotal = 1.0 / (double)nTotal;
+        size_t nItemBytes = nDstLnBytes + nSrcLnBytes * ((view.iHeight + bmpOut.m_iHeight - 1) / bmpOut.m_iHeight + 1);
+        GThreadPool::Instance().ParallelFor(bmpOut.m_iHeight, nItemBytes, [&](size_t iBegin, size_t iEnd) {
+            std::vector<TSum> sums(nSrcLnBytes);
+            TSum* pSum = sums.data();
+            for (size_t y = iBegin; y < iEnd; y++) {
+                memset(pSum, 0, nSrcLnBytes * sizeof(TSum));
+                for (size_t k = spansY.offset[y]; k < spansY.offset[y + 1]; k++) {
+                    AreaSum(view.Line(spansY.first[y] + (int)(k - spansY.offset[y])), spansY.weights[k], pSum, nSrcLnBytes);
+                }
+                unsigned char* pLnDst = bmpOut.m_pImage + y * nDstLnBytes;
+                for (int x = 0; x < bmpOut.m_iWidth; x++) {
+                    const TSum* pCol = pSum + (size_t)spansX.first[x] * iPxlBytes;
+                    const uint32_t* pWeight = &spansX.weights[spansX.offset[x]];
+                    size_t nCols = spansX.offset[x + 1] - spansX.offset[x];
+                    TSum sum[iPxlBytes] = {};
+                    for (size_t t = 0; t < nCols; t++) {
+                        for (int c = 0; c < iPxlBytes; c++) {
+                            sum[c] += pWeight[t] * pCol[t * iPxlBytes + c];
+                        }
+                    }
+                    // the quotient from the reciprocal is off by one at most, near a rounding boundary.
+                    for (int c = 0; c < iPxlBytes; c++) {
+                        uint64_t n = sum[c] + nTotal / 2;
+                        uint64_t q = (uint64_t)((double)n * dInvTotal);
+                        q -= q * nTotal > n;
+                        q += (q + 1) * nTotal <= n;
+                        pLnDst[(size_t)x * iPxlBytes + c] = (unsigned char)q;
+                    }
+                }
+            }
+        });
+    }
+    // Writes dst row x, column y = src row y, column x for an iWidth x iHeight source.
+    // Pitches are in bytes and may be negative, which is how the rotations fold in their flip.
+    // The work is cut into cache-sized blocks and each block into register-sized tiles.
+    static void TransposePixels(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch,
+        int iWidth, int iHeight, int iPxlBytes)
+    {
+        const int iBlock = iPxlBytes == 1 ? 64 : 32;
+        size_t nBlockRows = (iHeight + iBlock - 1) / iBlock;
+        GThreadPool::Instance().ParallelFor(nBlockRows, (size_t)iBlock * iWidth * iPxlBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            for (int by = (int)iBegin * iBlock; by < (int)iEnd * iBlock && by < iHeight; by += iBlock) {
+                int iBlockH = (std::min)(iBlock, iHeight - by);
+                for (int bx = 0; bx < iWidth; bx += iBlock) {
+                    int iBlockW = (std::min)(iBlock, iWidth - bx);
+                    TransposeRect(pSrc, iSrcPitch, pDst, iDstPitch, bx, bx + iBlockW, by, by + iBlockH, iPxlBytes, 0);
+                }
+            }
+        });
+    }
+    static void TransposeRect(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch,
+        int x0, int x1, int y0, int y1, int iPxlBytes, int iLevel)
+    {
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GTransposeTileFn pfnTile = iLevel > 1 ? 0 : iPxlBytes == 1 ? kernels.pfnTranspose8[iLevel] : kernels.pfnTranspose32[iLevel];
+        int iTile = iLevel > 1 ? 0 : iPxlBytes == 1 ? kernels.iTranspose8Tile[iLevel] : kernels.iTranspose32Tile[iLevel];
+        if (pfnTile == 0) {
+            TransposeScalar(pSrc, iSrcPitch, pDst, iDstPitch, x0, x1, y0, y1, iPxlBytes);
+            return;
+        }
+        int xe = x0 + (x1 - x0) / iTile * iTile;
+        int ye = y0 + (y1 - y0) / iTile * iTile;
+        for (int y = y0; y < ye; y += iTile) {
+            for (int x = x0; x < xe; x += iTile) {
+                pfnTile(pSrc + y * iSrcPitch + (ptrdiff_t)x * iPxlBytes, iSrcPitch,
+                    pDst + x * iDstPitch + (ptrdiff_t)y * iPxlBytes, iDstPitch);
+            }
+        }
+        // ragged right and bottom strips go to the next narrower kernel.
+        if (xe < x1 && y0 < ye) {
+            TransposeRect(pSrc, iSrcPitch, pDst, iDstPitch, xe, x1, y0, ye, iPxlBytes, iLevel + 1);
+        }
+        if (ye < y1) {
+            TransposeRect(pSrc, iSrcPitch, pDst, iDstPitch, x0, x1, ye, y1, iPxlBytes, iLevel + 1);
+        }
+    }
+    static void TransposeScalar(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch,
+        int x0, int x1, int y0, int y1, int iPxlBytes)
+    {
+        if (iPxlBytes == 1) {
+            for (int x = x0; x < x1; x++) {
+                unsigned char* pLnDst = pDst + x * iDstPitch;
+                for (int y = y0; y < y1; y++) {
+                    pLnDst[y] = pSrc[y * iSrcPitch + x];
+                }
+            }
+        } else {
+            // mapped files put 32-bit rows at any byte offset, so pixels move through memcpy.
+            for (int x = x0; x < x1; x++) {
+                unsigned char* pLnDst = pDst + x * iDstPitch;
+                for (int y = y0; y < y1; y++) {
+                    memcpy(pLnDst + (ptrdiff_t)y * 4, pSrc + y * iSrcPitch + (ptrdiff_t)x * 4, 4);
+                }
+            }
+        }
+    }
+    // Square images, n x n. The rotation takes rows [0, n / 2) x columns [0, (n + 1) / 2) onto the three
+    // other quarters (the middle pixel of odd n stays), so every tile of that domain and its three
+    // images form a 4-cycle disjoint from the others: one tile is saved, the other three move along
+    // the cycle through TransposeRect, whose negative pitches fold in the flip, and the saved one
+    // lands last.
+    void RotateSquareInPlace(bool bCounterClockwise)
+    {
+        int n = m_iWidth;
+        int iPxlBytes = m_bGray ? 1 : 4;
+        ptrdiff_t iPitch = (ptrdiff_t)n * iPxlBytes;
+        unsigned char* pImage = m_pImage;
+        const int iBlock = iPxlBytes == 1 ? 64 : 32;
+        int nDomH = n / 2;
+        int nDomW = (n + 1) / 2;
+        // copies the h x w block at src onto the w x h block at dst, turned the way of the rotation.
+        auto rotateBlock = [&](const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, int h, int w) {
+            if (bCounterClockwise) {
+                TransposeRect(pSrc, iSrcPitch, pDst + (w - 1) * iPitch, -iPitch, 0, w, 0, h, iPxlBytes, 0);
+            } else {
+                TransposeRect(pSrc + (h - 1) * iSrcPitch, -iSrcPitch, pDst, iPitch, 0, w, 0, h, iPxlBytes, 0);
+            }
+        };
+        auto at = [&](int r, int c) { return pImage + r * iPitch + (ptrdiff_t)c * iPxlBytes; };
+        size_t nBlockRows = (nDomH + iBlock - 1) / iBlock;
+        GThreadPool::Instance().ParallelFor(nBlockRows, (size_t)iBlock * nDomW * iPxlBytes * 8, [&](size_t iBegin, size_t iEnd) {
+            std::vector<unsigned char> tile((size_t)iBlock * iBlock * iPxlBytes);
+            for (int r = (int)iBegin * iBlock; r < (int)iEnd * iBlock && r < nDomH; r += iBlock) {
+                int h = (std::min)(iBlock, nDomH - r);
+                for (int c = 0; c < nDomW; c += iBlock) {
+                    int w = (std::min)(iBlock, nDomW - c);
+                    // the tile and its images under the counterclockwise turn, h x w and w x h in turn.
+                    unsigned char* pA = at(r, c);
+                    unsigned char* pB = at(n - c - w, r);
+                    unsigned char* pC = at(n - r - h, n - c - w);
+                    unsigned char* pD = at(c, n - r - h);
+                    ptrdiff_t iTilePitch = (ptrdiff_t)w * iPxlBytes;
+                    for (int y = 0; y < h; y++) {
+                        memcpy(&tile[y * iTilePitch], pA + y * iPitch, iTilePitch);
+                    }
+                    if (bCounterClockwise) {
+                        rotateBlock(pD, iPitch, pA, w, h);
+                        rotateBlock(pC, iPitch, pD, h, w);
+                        rotateBlock(pB, iPitch, pC, w, h);
+                        rotateBlock(tile.data(), iTilePitch, pB, h, w);
+                    } else {
+                        rotateBlock(pB, iPitch, pA, w, h);
+                        rotateBlock(pC, iPitch, pB, h, w);
+                        rotateBlock(pD, iPitch, pC, w, h);
+                        rotateBlock(tile.data(), iTilePitch, pD, h, w);
+                    }
+                }
+            }
+        });
+    }
+    // Transposes the pixel buffer and swaps the image sides.
+    void TransposeBufferInPlace()
+    {
+        if (m_iWidth == m_iHeight) {
+            TransposeSquareInPlace();
+        } else if (m_bGray) {
+            TransposeInPlaceT((uint8_t*)m_pImage, m_iHeight, m_iWidth);
+        } else {
+            TransposeInPlaceT((uint32_t*)m_pImage, m_iHeight, m_iWidth);
+        }
+        std::swap(m_iWidth, m_iHeight);
+    }
+    // Tile (i, j) trades places with tile (j, i), one of them through a scratch tile.
+    void TransposeSquareInPlace()
+    {
+        int n = m_iWidth;
+        int iPxlBytes = m_bGray ? 1 : 4;
+        ptrdiff_t iPitch = (ptrdiff_t)n * iPxlBytes;
+        unsigned char* pImage = m_pImage;
+        const int iBlock = iPxlBytes == 1 ? 64 : 32;
+        size_t nBlockRows = (n + iBlock - 1) / iBlock;
+        GThreadPool::Instance().ParallelFor(nBlockRows, (size_t)iBlock * n * iPxlBytes, [&](size_t iBegin, size_t iEnd) {
+            std::vector<unsigned char> tile((size_t)iBlock * iBlock * iPxlBytes);
+            for (int r = (int)iBegin * iBlock; r < (int)iEnd * iBlock && r < n; r += iBlock) {
+                int h = (std::min)(iBlock, n - r);
+                for (int c = r; c < n; c += iBlock) {
+                    int w = (std::min)(iBlock, n - c);
+                    unsigned char* pA = pImage + r * iPitch + (ptrdiff_t)c * iPxlBytes;
+                    unsigned char* pB = pImage + c * iPitch + (ptrdiff_t)r * iPxlBytes;
+                    ptrdiff_t iTilePitch = (ptrdiff_t)w * iPxlBytes;
+                    for (int y = 0; y < h; y++) {
+                        memcpy(&tile[y * iTilePitch], pA + y * iPitch, iTilePitch);
+                    }
+                    if (pA != pB) {
+                        TransposeRect(pB, iPitch, pA, iPitch, 0, h, 0, w, iPxlBytes, 0);
+                    }
+                    TransposeRect(tile.data(), iTilePitch, pB, iPitch, 0, w, 0, h, iPxlBytes, 0);
+                }
+            }
+        });
+    }
+    // In-place transpose of an m x n row-major array, after Catanzaro, Keller and Garland, "A
+    // decomposition for in-place matrix transposition": with g = gcd(m, n) and b = n / g, element
+    // (r, c) ends at linear position c * m + r through three passes over independent pieces,
+    //   1. column c moves up by c / b rows (only when g > 1),
+    //   2. row k sends column c to column (c * m + (k + c / b) % m) % n,
+    //   3. every column gathers its final order,
+    // each needing a row or a column block of scratch instead of a second image. The column passes
+    // work on 64-byte wide blocks copied out whole, so the permuted reads hit a contiguous buffer in
+    // cache rather than one page per row.
+    template <class T>
+    static void TransposeInPlaceT(T* pData, size_t m, size_t n)
+    {
+        size_t g = m;
+        for (size_t t = n; t != 0;) {
+            size_t u = g % t;
+            g = t;
+            t = u;
+        }
+        size_t b = n / g;
+        const size_t nCols = 64 / sizeof(T);
+        size_t nBlocks = (n + nCols - 1) / nCols;
+        GThreadPool& pool = GThreadPool::Instance();
+        auto copyBlock = [&](T* pBlock, size_t j0, size_t nj) {
+            for (size_t i = 0; i < m; i++) {
+                memcpy(pBlock + i * nCols, pData + i * n + j0, nj * sizeof(T));
+            }
+        };
+        if (g > 1) {
+            pool.ParallelFor(nBlocks, m * nCols * sizeof(T) * 2, [&](size_t iBegin, size_t iEnd) {
+                std::vector<T> block(m * nCols);
+                size_t shift[nCols];
+                for (size_t iBlk = iBegin; iBlk < iEnd; iBlk++) {
+                    size_t j0 = iBlk * nCols;
+                    size_t nj = (std::min)(nCols, n - j0);
+                    copyBlock(block.data(), j0, nj);
+                    for (size_t jj = 0; jj < nj; jj++) {
+                        shift[jj] = (j0 + jj) / b;
+                    }
+                    for (size_t k = 0; k < m; k++) {
+                        T* pDst = pData + k * n + j0;
+                        for (size_t jj = 0; jj < nj; jj++) {
+                            size_t r = k + shift[jj];
+                            pDst[jj] = block[(r >= m ? r - m : r) * nCols + jj];
+                        }
+                    }
+                }
+            });
+        }
+        size_t nStep = m % n;
+        pool.ParallelFor(m, n * sizeof(T) * 2, [&](size_t iBegin, size_t iEnd) {
+            std::vector<T> row(n);
+            for (size_t k = iBegin; k < iEnd; k++) {
+                T* pRow = pData + k * n;
+                size_t cm = 0; // c * m % n
+                for (size_t q = 0; q < g; q++) {
+                    size_t rr = (k + q) % m % n;
+                    for (size_t c = q * b; c < q * b + b; c++) {
+                        size_t j = cm + rr;
+                        row[j >= n ? j - n : j] = pRow[c];
+                        cm += nStep;
+                        cm -= cm >= n ? n : 0;
+                    }
+                }
+                memcpy(pRow, row.data(), n * sizeof(T));
+            }
+        });
+        // final (i, j) is linear position p = i * n + j, which holds source (r, c) = (p % m, p / m),
+        // now in row (r - c / b) mod m. r, c / b and c % b follow p along a row and from row to row.
+        size_t nModM = n % m;
+        size_t nDivMDivB = n / m / b;
+        size_t nDivMModB = n / m % b;
+        pool.ParallelFor(nBlocks, m * nCols * sizeof(T) * 2, [&](size_t iBegin, size_t iEnd) {
+            std::vector<T> block(m * nCols);
+            std::vector<T> cols(m * nCols);
+            for (size_t iBlk = iBegin; iBlk < iEnd; iBlk++) {
+                size_t j0 = iBlk * nCols;
+                size_t nj = (std::min)(nCols, n - j0);
+                copyBlock(block.data(), j0, nj);
+                size_t r0 = j0 % m;
+                size_t q0 = j0 / m / b;
+                size_t cb0 = j0 / m % b;
+                for (size_t i = 0; i < m; i++) {
+                    size_t r = r0;
+                    size_t q = q0;
+                    size_t cb = cb0;
+                    T* pDst = &cols[i * nCols];
+                    for (size_t jj = 0; jj < nj; jj++) {
+                        pDst[jj] = block[(r >= q ? r - q : r + m - q) * nCols + jj];
+                        if (++r == m) {
+                            r = 0;
+                            if (++cb == b) {
+                                cb = 0;
+                                q++;
+                            }
+                        }
+                    }
+                    r0 += nModM;
+                    q0 += nDivMDivB;
+                    cb0 += nDivMModB;
+                    if (r0 >= m) {
+                        r0 -= m;
+                        cb0++;
+                    }
+                    if (cb0 >= b) {
+                        cb0 -= b;
+                        q0++;
+                    }
+                }
+                for (size_t i = 0; i < m; i++) {
+                    memcpy(pData + i * n + j0, &cols[i * nCols], nj * sizeof(T));
+                }
+            }
+        });
+    }
+    // The depth a save or encode with iBitCount writes, 0 if it cannot write this image that way.
+    int FileBitCount(int iBitCount) const
+    {
+        int iNative = m_bGray ? 8 : 32;
+        if (iBitCount == 0 || iBitCount == iNative) {
+            return iNative;
+        }
+        return (iBitCount == 24 && !m_bGray) ? 24 : 0;
+    }
+    // Copies the rows to pDst as iBitCount-bit rows padded to 4 bytes, in one piece when they need
+    // neither padding nor packing.
+    void EncodePixels(unsigned char* pDst, int iBitCount)
+    {
+        size_t nLnLen = (size_t)m_iWidth * (m_bGray ? 1 : 4);
+        size_t nFileLen = (size_t)m_iWidth * iBitCount / 8;
+        size_t nLnBytes = (nFileLen + 3) / 4 * 4;
+        if (nLnBytes == nLnLen && nFileLen == nLnLen) {
+            memcpy(pDst, m_pImage, nLnLen * m_iHeight);
+            return;
+        }
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(m_iHeight, nLnLen + nLnBytes, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pLn = pDst + i * nLnBytes;
+                if (iBitCount == 24) {
+                    kernels.pfnRGB32ToRGB24(m_pImage + i * nLnLen, pLn, m_iWidth);
+                } else {
+                    memcpy(pLn, m_pImage + i * nLnLen, nLnLen);
+                }
+                memset(pLn + nFileLen, 0, nLnBytes - nFileLen);
+            }
+        });
+    }
+#ifndef _WIN32
+    // writev until every byte is out, partial writes and EINTR included.
+    static bool WriteFully(int fd, struct iovec* pIov, int nIov)
+    {
+        while (nIov > 0) {
+            ssize_t nWritten = writev(fd, pIov, nIov);
+            if (nWritten < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            while (nIov > 0 && (size_t)nWritten >= pIov->iov_len) {
+                nWritten -= pIov->iov_len;
+                pIov++;
+                nIov--;
+            }
+            if (nIov > 0) {
+                pIov->iov_base = static_cast<char*>(pIov->iov_base) + nWritten;
+                pIov->iov_len -= nWritten;
+            }
+        }
+        return true;
+    }
+#endif
+    bool ReadBmp(FILE* inputFile, GOrientation orient)
+    {
+        unsigned char header[HeaderBytesMax];
+        size_t nHeader = fread(header, 1, sizeof(header), inputFile);
+        if (GBmpSeek(inputFile, 0, SEEK_END) != 0) {
+            return false;
+        }
+        int64_t iFileLen = GBmpTell(inputFile);
+        GBmpLayout layout;
+        if (iFileLen < (int64_t)nHeader || !ParseHeader(header, (size_t)iFileLen, layout)
+            || GBmpSeek(inputFile, (int64_t)layout.nOffBits, SEEK_SET) != 0) {
+            return false;
+        }
+        if (layout.IsRle()) {
+            std::vector<unsigned char> stream(layout.nSrcLen);
+            if (fread(stream.data(), 1, stream.size(), inputFile) != stream.size()) {
+                return false;
+            }
+            DecodeRleImage(stream.data(), stream.size(), layout, orient);
+            return true;
+        }
+        SetDecodeSize(layout, orient);
+        // file rows come in file order, bands of about 256 KB stay in cache between read and decode;
+        // a transposed load takes whole tile rows.
+        size_t nLnBytes = layout.nSrcLnBytes;
+        int iBand = (int)(std::min)((size_t)layout.iHeight, (std::max)((size_t)1, ((size_t)256 << 10) / nLnBytes));
+        if (orient == GORIENT_TRANSPOSE) {
+            iBand = (std::max)(64, iBand / 64 * 64);
+        }
+        std::vector<unsigned char> band((size_t)(std::min)(iBand, layout.iHeight) * nLnBytes);
+        for (int r0 = 0; r0 < layout.iHeight; r0 += iBand) {
+            int n = (std::min)(iBand, layout.iHeight - r0);
+            if (fread(band.data(), 1, n * nLnBytes, inputFile) != n * nLnBytes) {
+                return false;
+            }
+            if (layout.bTopDown) {
+                DecodeRows(band.data(), (ptrdiff_t)nLnBytes, r0, r0 + n, layout, orient);
+            } else {
+                DecodeRows(band.data() + (n - 1) * nLnBytes, -(ptrdiff_t)nLnBytes, layout.iHeight - r0 - n, layout.iHeight - r0, layout, orient);
+            }
+        }
+        return true;
+    }
+    void SetDecodeSize(const GBmpLayout& layout, GOrientation orient)
+    {
+        if (orient == GORIENT_TRANSPOSE) {
+            SetImageSize(layout.iHeight, layout.iWidth, layout.bGray);
+        } else {
+            SetImageSize(layout.iWidth, layout.iHeight, layout.bGray);
+        }
+    }
+    // 1/4/8-bit palettes: biClrUsed entries (2^n when 0) in front of the pixels, missing ones black. Files
+    // without room for a palette get the gray ramp SaveBmp writes; an all gray palette decodes to gray,
+    // the 8-bit ramp by plain copies and black, white 1-bit rows by bit expansion.
+    static void ParsePalette(const unsigned char* pPalette, size_t nRoom, uint32_t iClrUsed, GBmpLayout& layout)
+    {
+        size_t nIndices = (size_t)1 << layout.iBitCount;
+        size_t nColors = (std::min)(iClrUsed != 0 && iClrUsed < nIndices ? (size_t)iClrUsed : nIndices, nRoom);
+        memset(layout.palette, 0, sizeof(layout.palette));
+        memset(layout.gray, 0, sizeof(layout.gray));
+        layout.bGray = true;
+        for (size_t i = 0; i < nIndices; i++) {
+            uint32_t v = (uint32_t)(i * (255 / (nIndices - 1))) * 0x010101;
+            if (nColors != 0) {
+                v = 0;
+                if (i < nColors) {
+                    memcpy(&v, pPalette + i * 4, 4);
+                    v &= 0xFFFFFF;
+                }
+            }
+            layout.palette[i] = v;
+            layout.gray[i] = (unsigned char)v;
+            layout.bGray = layout.bGray && (v & 0xFF) == ((v >> 8) & 0xFF) && (v & 0xFF) == (v >> 16);
+        }
+        bool bRamp = layout.bGray;
+        for (size_t i = 0; i < nIndices && bRamp; i++) {
+            bRamp = layout.gray[i] == i * (255 / (nIndices - 1));
+        }
+        if (nIndices == 2) {
+            layout.iCodec = bRamp ? GROW_BIT1 : GROW_INDEX1;
+        } else if (nIndices == 16) {
+            layout.iCodec = GROW_INDEX4;
+        } else {
+            layout.iCodec = bRamp ? GROW_COPY : GROW_INDEX8;
+        }
+    }
+    // 16/32-bit bit fields: 5-5-5 and B, G, R, 4th byte unless the file gives R, G, B (and alpha) masks,
+    // after a 40-byte info header or inside a longer one. Every mask has to be a single run of bits.
+    static bool ParseMasks(const unsigned char* pBytes, const GBITMAPINFOHEADER& bi, bool bMasks, GBmpLayout& layout)
+    {
+        uint32_t masks[4] = { 0x7C00, 0x3E0, 0x1F, 0 };
+        if (bi.biBitCount == 32) {
+            masks[0] = 0xFF0000, masks[1] = 0xFF00, masks[2] = 0xFF;
+        }
+        if (bMasks) {
+            size_t nMasks = bi.biCompression == GBI_ALPHABITFIELDS || bi.biSize >= 56 ? 4 : 3;
+            size_t iAt = sizeof(GBITMAPFILEHEADER) + sizeof(GBITMAPINFOHEADER);
+            size_t nEnd = bi.biSize == sizeof(GBITMAPINFOHEADER) ? layout.nOffBits : sizeof(GBITMAPFILEHEADER) + bi.biSize;
+            if (iAt + nMasks * 4 > nEnd) {
+                return false;
+            }
+            memcpy(masks, pBytes + iAt, nMasks * 4);
+        }
+        // B, G, R, 4th byte from the R, G, B, A masks.
+        const int order[4] = { 2, 1, 0, 3 };
+        for (int c = 0; c < 4; c++) {
+            uint64_t iMask = masks[order[c]];
+            int iShift = 0;
+            int iBits = 0;
+            while (iMask != 0 && (iMask >> iShift & 1) == 0) {
+                iShift++;
+            }
+            while (iMask >> (iShift + iBits) & 1) {
+                iBits++;
+            }
+            if (iMask >> (iShift + iBits) != 0 || iMask >> bi.biBitCount != 0 || (c < 3 && iMask == 0)) {
+                return false;
+            }
+            layout.iFieldShift[c] = (unsigned char)iShift;
+            layout.iFieldBits[c] = (unsigned char)iBits;
+        }
+        layout.iCodec = GROW_MASKS;
+        if (bi.biBitCount == 16 && masks[3] == 0 && masks[2] == 0x1F) {
+            if (masks[0] == 0x7C00 && masks[1] == 0x3E0) {
+                layout.iCodec = GROW_RGB555;
+            } else if (masks[0] == 0xF800 && masks[1] == 0x7E0) {
+                layout.iCodec = GROW_RGB565;
+            }
+        }
+        if (bi.biBitCount == 32 && (masks[3] == 0 || masks[3] == 0xFF000000) && masks[1] == 0xFF00) {
+            if (masks[0] == 0xFF0000 && masks[2] == 0xFF) {
+                layout.iCodec = GROW_COPY;
+            } else if (masks[0] == 0xFF && masks[2] == 0xFF0000) {
+                layout.iCodec = GROW_SWAPRB32;
+            }
+        }
+        return true;
+    }
+    static void FieldsToRGB32(const unsigned char* pSrc, unsigned char* pDst, const GBmpLayout& layout)
+    {
+        int iPxlBytes = layout.iBitCount / 8;
+        for (int j = 0; j < layout.iWidth; j++) {
+            uint32_t v = 0;
+            memcpy(&v, pSrc + j * iPxlBytes, iPxlBytes);
+            for (int c = 0; c < 4; c++) {
+                pDst[j * 4 + c] = WidenField(v >> layout.iFieldShift[c], layout.iFieldBits[c]);
+            }
+        }
+    }
+    // 1-bit rows through a two-entry palette: gray expands the bits to 0x00/0xFF and picks per byte.
+    static void Index1ToGray8(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const unsigned char* pLut)
+    {
+        Bit1ToGray8(pSrc, pDst, nWidth);
+        unsigned char iDiff = (unsigned char)(pLut[0] ^ pLut[1]);
+        for (int j = 0; j < nWidth; j++) {
+            pDst[j] = (unsigned char)((pDst[j] & iDiff) ^ pLut[0]);
+        }
+    }
+    static void Index1ToRGB32(const unsigned char* pSrc, unsigned char* pDst, int nWidth, const uint32_t* pPalette)
+    {
+        for (int j = 0; j < nWidth; j++) {
+            memcpy(pDst + j * 4, pPalette + ((pSrc[j >> 3] >> (7 - (j & 7))) & 1), 4);
+        }
+    }
+    // The low iBits of v as 8 bits; narrower fields repeat their top bits, 5-bit v gives v << 3 | v >> 2.
+    static unsigned char WidenField(uint32_t v, int iBits)
+    {
+        if (iBits >= 8) {
+            return (unsigned char)(v >> (iBits - 8));
+        }
+        if (iBits == 0) {
+            return 0;
+        }
+        uint32_t r = (v & ((1u << iBits) - 1)) << (8 - iBits);
+        for (int s = iBits; s < 8; s *= 2) {
+            r |= r >> s;
+        }
+        return (unsigned char)r;
+    }
+    // RLE streams are decoded whole: rows go bottom-up straight into their place, flip included, and
+    // a mirror or transpose follows in place.
+    void DecodeRleImage(const unsigned char* pSrc, size_t nSrcLen, const GBmpLayout& layout, GOrientation orient)
+    {
+        SetImageSize(layout.iWidth, layout.iHeight, layout.bGray);
+        DecodeRle(pSrc, nSrcLen, layout, orient == GORIENT_FLIP || orient == GORIENT_ROTATE180);
+        if (orient == GORIENT_MIRROR || orient == GORIENT_ROTATE180) {
+            MirrorH(View());
+        } else if (orient == GORIENT_TRANSPOSE) {
+            TransposeInPlace();
+        }
+    }
+    // Runs and absolute groups are written where they land, so the stream is read once. Pixels it skips
+    // (deltas, early ends of lines and of the bitmap) become 0; runs past the right edge are cut and a
+    // truncated stream ends the image, as other decoders do.
+    void DecodeRle(const unsigned char* pSrc, size_t nSrcLen, const GBmpLayout& layout, bool bFlip)
+    {
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        bool bRle4 = layout.iCompression == GBI_RLE4;
+        int iWidth = m_iWidth;
+        int iHeight = m_iHeight;
+        int iPxlBytes = m_bGray ? 1 : 4;
+        size_t nLnLen = (size_t)iWidth * iPxlBytes;
+        // (x, y) is the stream position, rows counted from the bottom; everything before (xDone, yDone) is written.
+        int x = 0, y = 0, xDone = 0, yDone = 0;
+        auto line = [&](int yy) { return m_pImage + (size_t)(bFlip ? yy : iHeight - 1 - yy) * nLnLen; };
+        auto skipTo = [&]() {
+            for (; yDone < y; yDone++, xDone = 0) {
+                memset(line(yDone) + (size_t)xDone * iPxlBytes, 0, (size_t)(iWidth - xDone) * iPxlBytes);
+            }
+            if (yDone < iHeight && x > xDone) {
+                memset(line(yDone) + (size_t)xDone * iPxlBytes, 0, (size_t)(x - xDone) * iPxlBytes);
+                xDone = x;
+            }
+        };
+        size_t i = 0;
+        while (y < iHeight && i + 2 <= nSrcLen) {
+            int n = pSrc[i];
+            int c = pSrc[i + 1];
+            i += 2;
+            if (n == 0 && c < 3) {
+                if (c == 1 || (c == 2 && i + 2 > nSrcLen)) {
+                    break;
+                }
+                if (c == 0) {
+                    x = 0;
+                    y++;
+                } else {
+                    x = (std::min)(x + pSrc[i], iWidth);
+                    y = (std::min)(y + pSrc[i + 1], iHeight);
+                    i += 2;
+                }
+                continue;
+            }
+            // n pixels of index c (RLE4: its two nibbles in turn), or for n == 0 the c indices that follow.
+            size_t nBytes = n != 0 ? 0 : bRle4 ? (c + 1) / 2 : c;
+            if (i + nBytes > nSrcLen) {
+                break;
+            }
+            skipTo();
+            int nPix = (std::min)(n != 0 ? n : c, iWidth - x);
+            unsigned char* pDst = line(y) + (size_t)x * iPxlBytes;
+            if (n == 0 && bRle4) {
+                if (m_bGray) {
+                    kernels.pfnIndex4ToGray8(pSrc + i, pDst, nPix, layout.gray);
+                } else {
+                    kernels.pfnIndex4ToRGB32(pSrc + i, pDst, nPix, layout.palette);
+                }
+            } else if (n == 0) {
+                if (m_bGray) {
+                    kernels.pfnIndex8ToGray8(pSrc + i, pDst, nPix, layout.gray);
+                } else {
+                    kernels.pfnIndex8ToRGB32(pSrc + i, pDst, nPix, layout.palette);
+                }
+            } else if (bRle4) {
+                const int idx[2] = { c >> 4, c & 0x0F };
+                for (int k = 0; k < nPix; k++) {
+                    if (m_bGray) {
+                        pDst[k] = layout.gray[idx[k & 1]];
+                    } else {
+                        memcpy(pDst + k * 4, layout.palette + idx[k & 1], 4);
+                    }
+                }
+            } else if (m_bGray) {
+                memset(pDst, layout.gray[c], nPix);
+            } else {
+                std::fill_n((uint32_t*)pDst, nPix, layout.palette[c]);
+            }
+            x += nPix;
+            xDone = x;
+            i += (nBytes + 1) & ~(size_t)1;
+        }
+        x = 0;
+        y = iHeight;
+        skipTo();
+    }
+    // Decodes image rows [y0, y1), top-down numbering, whose file rows start at pSrc and lie iSrcPitch
+    // bytes apart, into the rows or (transposed) columns orient puts them in.
+    void DecodeRows(const unsigned char* pSrc, ptrdiff_t iSrcPitch, int y0, int y1, const GBmpLayout& layout, GOrientation orient)
+    {
+        int iWidth = layout.iWidth;
+        int iHeight = layout.iHeight;
+        int iPxlBytes = m_bGray ? 1 : 4;
+        size_t nLnLen = (size_t)iWidth * iPxlBytes;
+        GThreadPool& pool = GThreadPool::Instance();
+        if (orient == GORIENT_TRANSPOSE) {
+            // decoded rows go through a cache-sized band on their way into the destination columns.
+            int iBand = (std::max)(64, (int)(((size_t)256 << 10) / nLnLen) / 64 * 64);
+            GBmp bmpBand;
+            bmpBand.SetImageSize(iWidth, (std::min)(iBand, y1 - y0), m_bGray);
+            for (int yb = y0; yb < y1; yb += iBand) {
+                int n = (std::min)(iBand, y1 - yb);
+                pool.ParallelFor(n, nLnLen * 2, [&](size_t iBegin, size_t iEnd) {
+                    for (size_t i = iBegin; i < iEnd; i++) {
+                        DecodeLine(pSrc + (yb - y0 + (ptrdiff_t)i) * iSrcPitch, bmpBand.m_pImage + i * nLnLen, layout);
+                    }
+                });
+                TransposePixels(bmpBand.m_pImage, (ptrdiff_t)nLnLen, m_pImage + (size_t)yb * iPxlBytes, (ptrdiff_t)iHeight * iPxlBytes,
+                    iWidth, n, iPxlBytes);
+            }
+            return;
+        }
+        bool bFlip = orient == GORIENT_FLIP || orient == GORIENT_ROTATE180;
+        bool bMirror = orient == GORIENT_MIRROR || orient == GORIENT_ROTATE180;
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        pool.ParallelFor(y1 - y0, nLnLen * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                int y = y0 + (int)i;
+                unsigned char* pDst = m_pImage + (size_t)(bFlip ? iHeight - 1 - y : y) * nLnLen;
+                DecodeLine(pSrc + (ptrdiff_t)i * iSrcPitch, pDst, layout);
+                if (!bMirror) {
+                    continue;
+                }
+                if (m_bGray) {
+                    kernels.pfnReverse8(pDst, pDst + iWidth - iWidth / 2, iWidth / 2);
+                } else {
+                    kernels.pfnReverse32((uint32_t*)pDst, (uint32_t*)pDst + iWidth - iWidth / 2, iWidth / 2);
+                }
+            }
+        });
+    }
+    static void RGB24ToRGB32(void* pSrc, void* pDst, int nWidth, int nHeight, unsigned char iAlpha = 0)
+    {
+        size_t nSrcLnBytes = ((size_t)nWidth * 3 + 3) / 4 * 4;
+        GBMP_STAT_SCOPE(GSTAT_RGB24TORGB32, ((uint64_t)nSrcLnBytes + (uint64_t)nWidth * 4) * nHeight);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(nHeight, (size_t)nWidth * 7, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pLSrc = ((unsigned char*)pSrc) + i * nSrcLnBytes;
+                unsigned char* pLDst = ((unsigned char*)pDst) + i * nWidth * 4;
+                kernels.pfnRGB24ToRGB32(pLSrc, pLDst, nWidth, iAlpha);
+            }
+        });
+    }
+
+    static GBmpAllocator*& AllocatorSlot()
+    {
+        static GBmpAllocator* s_pAllocator = &GBufferPool::Instance();
+        return s_pAllocator;
+    }
+    static std::atomic<uint64_t>& RleMaxPixelsSlot()
+    {
+        static std::atomic<uint64_t> s_nPixels((uint64_t)1 << 26);
+        return s_nPixels;
+    }
+    // Makes m_pImage hold at least nBytes, keeping the current buffer when it is big enough and unshared.
+    void Reserve(size_t nBytes)
+    {
+        if (m_pImage && nBytes <= m_nCapacity && !IsShared()) {
+            return;
+        }
+        FreeBuffer();
+        GBMP_STAT_COUNT(GSTAT_ALLOC, nBytes);
+        GBmpAllocator* pAllocator = AllocatorSlot();
+        m_pImage = static_cast<unsigned char*>(pAllocator->Allocate(nBytes));
+        m_pAllocator = pAllocator;
+        m_nCapacity = nBytes;
+    }
+    // The count is made on the first copy; the CAS lets several threads copy one image at once.
+    std::atomic<int>* AddRef() const
+    {
+        std::atomic<int>* pRefs = m_pRefs.load(std::memory_order_acquire);
+        if (!pRefs) {
+            std::atomic<int>* pNewRefs = new std::atomic<int>(1);
+            if (m_pRefs.compare_exchange_strong(pRefs, pNewRefs, std::memory_order_acq_rel)) {
+                pRefs = pNewRefs;
+            } else {
+                delete pNewRefs;
+            }
+        }
+        pRefs->fetch_add(1, std::memory_order_relaxed);
+        return pRefs;
+    }
+    // Drops this image's hold on the buffer, which the last holder frees.
+    void FreeBuffer()
+    {
+        std::atomic<int>* pRefs = m_pRefs.exchange(nullptr, std::memory_order_relaxed);
+        bool bLast = !pRefs || pRefs->fetch_sub(1, std::memory_order_acq_rel) == 1;
+        if (pRefs && bLast) {
+            delete pRefs;
+        }
+        if (m_pImage && bLast) {
+            if (m_pAllocator) {
+                m_pAllocator->Free(m_pImage, m_nCapacity);
+            } else {
+                delete[] m_pImage;
+            }
+        }
+        m_pImage = 0;
+        m_pAllocator = 0;
+        m_nCapacity = 0;
+    }
+
+    int m_iWidth;
+    int m_iHeight;
+    unsigned char* m_pImage;
+    bool m_bGray;
+    size_t m_nCapacity;
+    GBmpAllocator* m_pAllocator; // 0 for buffers handed over with AttachData.
+    mutable std::atomic<std::atomic<int>*> m_pRefs; // GBmps sharing m_pImage, 0 until the first copy.
+};
+
+class GBmpMapped // read-only view of a memory-mapped bmp file, rows are Pitch() bytes apart.
+{
+public:
+    GBmpMapped(void)
+        : m_pMap(0)
+        , m_nMapLen(0)
+        , m_pPixels(0)
+        , m_iPitch(0)
+        , m_iWidth(0)
+        , m_iHeight(0)
+        , m_bGray(0)
+    {
+#ifdef _WIN32
+        m_hFile = INVALID_HANDLE_VALUE;
+        m_hMapping = 0;
+#endif
+    }
+    GBmpMapped(const GBmpMapped&) = delete;
+    GBmpMapped& operator=(const GBmpMapped&) = delete;
+    ~GBmpMapped(void) { Close(); }
+
+    // 8-bit files with the plain gray palette and 32-bit B, G, R, 4th byte files are exposed in place,
+    // bottom-up ones through a negative pitch. Other files are decoded once into an owned top-down buffer.
+    bool Open(const char* strFileName)
+    {
+        Close();
+        if (!MapFile(strFileName)) {
+            return false;
+        }
+        GBmpLayout layout;
+        if (!GBmp::ParseHeader(m_pMap, m_nMapLen, layout)) {
+            Close();
+            return false;
+        }
+        m_iWidth = layout.iWidth;
+        m_iHeight = layout.iHeight;
+        m_bGray = layout.bGray;
+        const unsigned char* pTopLn = m_pMap + layout.nOffBits;
+        ptrdiff_t iSrcPitch = (ptrdiff_t)layout.nSrcLnBytes;
+        if (!layout.bTopDown) {
+            pTopLn += (m_iHeight - 1) * iSrcPitch;
+            iSrcPitch = -iSrcPitch;
+        }
+        if (layout.iCodec == GROW_COPY && !layout.IsRle()) {
+            m_pPixels = pTopLn;
+            m_iPitch = iSrcPitch;
+            return true;
+        }
+
+        m_iPitch = (ptrdiff_t)m_iWidth * (m_bGray ? 1 : 4);
+        if (layout.IsRle()) {
+            if (!m_bmpConverted.DecodeFromBuffer(m_pMap, m_nMapLen)) {
+                Close();
+                return false;
+            }
+            m_pPixels = (const unsigned char*)m_bmpConverted.Data();
+            UnmapFile();
+            return true;
+        }
+        try {
+            m_bmpConverted.SetImageSize(m_iWidth, m_iHeight, m_bGray);
+        } catch (...) {
+            Close();
+            return false;
+        }
+        unsigned char* pDst = (unsigned char*)m_bmpConverted.Data();
+        GThreadPool::Instance().ParallelFor(m_iHeight, (size_t)m_iPitch * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                GBmp::DecodeLine(pTopLn + (ptrdiff_t)i * iSrcPitch, pDst + i * m_iPitch, layout);
+            }
+        });
+        m_pPixels = pDst;
+        UnmapFile();
+        return true;
+    }
+    void Close()
+    {
+        UnmapFile();
+        m_bmpConverted.Release();
+        m_pPixels = 0;
+        m_iPitch = 0;
+        m_iWidth = m_iHeight = 0;
+        m_bGray = false;
+    }
+
+    // Copies the pixels into a packed GBmp, the only copy this class ever makes of 8/32-bit files.
+    void CopyTo(GBmp& bmp) const
+    {
+        size_t nLnLen = (size_t)m_iWidth * (m_bGray ? 1 : 4);
+        bmp.SetImageSize(m_iWidth, m_iHeight, m_bGray);
+        unsigned char* pDst = (unsigned char*)bmp.Data();
+        for (int i = 0; i < m_iHeight; i++) {
+            memcpy(pDst + i * nLnLen, Line(i), nLnLen);
+        }
+    }
+
+    // The pixels as a read-only view, a source for the GBmp operations producing a new image (rotations,
+    // CopyImage, ToGray into another view); the in-place ones (MirrorV, MirrorH, ...) assert on it.
+    GImageView View() const { return GImageView((const void*)m_pPixels, m_iWidth, m_iHeight, m_iPitch, m_bGray ? GPF_GRAY8 : GPF_BGRA32); }
+
+    inline bool IsGray() const { return m_bGray; }
+    inline bool IsZeroCopy() const { return m_pMap != 0; }
+    inline const unsigned char* Data() const { return m_pPixels; }
+    inline const unsigned char* Line(int y) const { return m_pPixels + y * m_iPitch; }
+    inline ptrdiff_t Pitch() const { return m_iPitch; }
+    inline int GetWidth() const { return m_iWidth; }
+    inline int GetHeight() const { return m_iHeight; }
+
+private:
+    bool MapFile(const char* strFileName)
+    {
+#ifdef _WIN32
+        m_hFile = CreateFileA(strFileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+        if (m_hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER liSize;
+        if (!GetFileSizeEx(m_hFile, &liSize) || liSize.QuadPart == 0) {
+            UnmapFile();
+            return false;
+        }
+        m_hMapping = CreateFileMappingA(m_hFile, 0, PAGE_READONLY, 0, 0, 0);
+        void* pView = m_hMapping ? MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0) : 0;
+        if (pView == 0) {
+            UnmapFile();
+            return false;
+        }
+        m_pMap = static_cast<const unsigned char*>(pView);
+        m_nMapLen = (size_t)liSize.QuadPart;
+#else
+        int fd = open(strFileName, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* pView = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (pView == MAP_FAILED) {
+            return false;
+        }
+        madvise(pView, (size_t)st.st_size, MADV_SEQUENTIAL);
+        m_pMap = static_cast<const unsigned char*>(pView);
+        m_nMapLen = (size_t)st.st_size;
+#endif
+        return true;
+    }
+    void UnmapFile()
+    {
+#ifdef _WIN32
+        if (m_pMap) {
+            UnmapViewOfFile(m_pMap);
+        }
+        if (m_hMapping) {
+            CloseHandle(m_hMapping);
+            m_hMapping = 0;
+        }
+        if (m_hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+        }
+#else
+        if (m_pMap) {
+            munmap((void*)m_pMap, m_nMapLen);
+        }
+#endif
+        m_pMap = 0;
+        m_nMapLen = 0;
+    }
+
+#ifdef _WIN32
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+#endif
+    const unsigned char* m_pMap;
+    size_t m_nMapLen;
+    const unsigned char* m_pPixels;
+    ptrdiff_t m_iPitch;
+    int m_iWidth;
+    int m_iHeight;
+    bool m_bGray;
+    GBmp m_bmpConverted;
+};
+
+class GBmpBandReader // decodes a bmp file top to bottom, a band of rows at a time.
+{
+public:
+    GBmpBandReader(void)
+        : m_pFile(0)
+        , m_iNextRow(0)
+    {
+        memset(&m_layout, 0, sizeof(m_layout));
+    }
+    GBmpBandReader(const GBmpBandReader&) = delete;
+    GBmpBandReader& operator=(const GBmpBandReader&) = delete;
+    ~GBmpBandReader(void) { Close(); }
+
+    bool Open(const char* strFileName)
+    {
+        Close();
+        m_pFile = fopen(strFileName, "rb");
+        if (m_pFile == 0) {
+            return false;
+        }
+        unsigned char header[GBmp::HeaderBytesMax];
+        size_t nRead = fread(header, 1, sizeof(header), m_pFile);
+        int64_t iFileLen = GBmpSeek(m_pFile, 0, SEEK_END) == 0 ? GBmpTell(m_pFile) : -1;
+        // RLE files have no rows to seek to, LoadBmp decodes them.
+        if (iFileLen < (int64_t)nRead || !GBmp::ParseHeader(header, (size_t)iFileLen, m_layout) || m_layout.IsRle()) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+    void Close()
+    {
+        if (m_pFile) {
+            fclose(m_pFile);
+            m_pFile = 0;
+        }
+        m_iNextRow = 0;
+        memset(&m_layout, 0, sizeof(m_layout));
+    }
+
+    // Decodes the next nRows rows (fewer at the end) into band, returns the rows decoded or 0
+    // once all rows are consumed or on a read error. Bottom-up files are read back to front,
+    // each band with one read, and their rows land in top-down order without a mirror pass.
+    int ReadBand(GBmp& band, int nRows)
+    {
+        int iRows = (std::min)(nRows, m_layout.iHeight - m_iNextRow);
+        if (m_pFile == 0 || iRows <= 0) {
+            return 0;
+        }
+        size_t nBandLen = m_layout.nSrcLnBytes * iRows;
+        if (nBandLen > m_bandBuf.size()) {
+            m_bandBuf.resize(nBandLen);
+        }
+        int iFirstFileRow = m_layout.bTopDown ? m_iNextRow : m_layout.iHeight - m_iNextRow - iRows;
+        int64_t iOffset = (int64_t)m_layout.nOffBits + (int64_t)m_layout.nSrcLnBytes * iFirstFileRow;
+        if (GBmpSeek(m_pFile, iOffset, SEEK_SET) != 0 || fread(m_bandBuf.data(), 1, nBandLen, m_pFile) != nBandLen) {
+            return 0;
+        }
+        Prefetch(iRows);
+
+        bool bGray = IsGray();
+        band.SetImageSize(m_layout.iWidth, iRows, bGray);
+        size_t nDstLnBytes = (size_t)m_layout.iWidth * (bGray ? 1 : 4);
+        unsigned char* pDst = (unsigned char*)band.Data();
+        GThreadPool::Instance().ParallelFor(iRows, nDstLnBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                size_t iSrcRow = m_layout.bTopDown ? i : iRows - 1 - i;
+                GBmp::DecodeLine(m_bandBuf.data() + m_layout.nSrcLnBytes * iSrcRow, pDst + nDstLnBytes * i, m_layout);
+            }
+        });
+        m_iNextRow += iRows;
+        return iRows;
+    }
+
+    inline bool IsGray() const { return m_layout.bGray; }
+    inline int GetWidth() const { return m_layout.iWidth; }
+    inline int GetHeight() const { return m_layout.iHeight; }
+    inline int GetNextRow() const { return m_iNextRow; }
+
+private:
+    // Asks the kernel to start fetching the following band while the caller works on this one.
+    void Prefetch(int iRows)
+    {
+#ifndef _WIN32
+        int iNext = m_iNextRow + iRows;
+        int iCount = (std::min)(iRows, m_layout.iHeight - iNext);
+        if (iCount <= 0) {
+            return;
+        }
+        int iFirstFileRow = m_layout.bTopDown ? iNext : m_layout.iHeight - iNext - iCount;
+        off_t iOffset = (off_t)(m_layout.nOffBits + m_layout.nSrcLnBytes * iFirstFileRow);
+        posix_fadvise(fileno(m_pFile), iOffset, (off_t)(m_layout.nSrcLnBytes * iCount), POSIX_FADV_WILLNEED);
+#else
+        (void)iRows;
+#endif
+    }
+
+    FILE* m_pFile;
+    GBmpLayout m_layout;
+    int m_iNextRow;
+    std::vector<unsigned char> m_bandBuf;
+};
+
+class GBmpBandWriter // writes a top-down bmp file a band of rows at a time, in SaveBmp's format.
+{
+public:
+    GBmpBandWriter(void)
+        : m_pFile(0)
+        , m_iWidth(0)
+        , m_iHeight(0)
+        , m_iNextRow(0)
+        , m_bGray(0)
+        , m_bFailed(0)
+    {
+    }
+    GBmpBandWriter(const GBmpBandWriter&) = delete;
+    GBmpBandWriter& operator=(const GBmpBandWriter&) = delete;
+    ~GBmpBandWriter(void) { Close(); }
+
+    bool Open(const char* strFileName, int iWidth, int iHeight, bool bGray)
+    {
+        Close();
+        if (iWidth <= 0 || iHeight <= 0) {
+            return false;
+        }
+        m_pFile = fopen(strFileName, "wb");
+        if (m_pFile == 0) {
+            return false;
+        }
+        m_iWidth = iWidth;
+        m_iHeight = iHeight;
+        m_bGray = bGray;
+        m_bFailed = false;
+        unsigned char header[GBmp::HeaderBytesMax];
+        size_t nHeaderLen = GBmp::WriteHeader(header, iWidth, iHeight, bGray);
+        m_bFailed = fwrite(header, 1, nHeaderLen, m_pFile) != nHeaderLen;
+        return !m_bFailed;
+    }
+
+    // Appends nRows packed rows (width * 1 or 4 bytes each), one write per band.
+    bool WriteBand(const void* pRows, int nRows)
+    {
+        if (m_pFile == 0 || m_bFailed || nRows <= 0 || nRows > m_iHeight - m_iNextRow) {
+            return false;
+        }
+        size_t nLnLen = (size_t)m_iWidth * (m_bGray ? 1 : 4);
+        size_t nLnBytes = (nLnLen + 3) / 4 * 4;
+        const unsigned char* pOut = static_cast<const unsigned char*>(pRows);
+        if (nLnBytes != nLnLen) {
+            size_t nBandLen = nLnBytes * nRows;
+            if (nBandLen > m_bandBuf.size()) {
+                m_bandBuf.resize(nBandLen);
+            }
+            for (int i = 0; i < nRows; i++) {
+                unsigned char* pLn = m_bandBuf.data() + nLnBytes * i;
+                memcpy(pLn, pOut + nLnLen * i, nLnLen);
+                memset(pLn + nLnLen, 0, nLnBytes - nLnLen);
+            }
+            pOut = m_bandBuf.data();
+        }
+        size_t nLen = nLnBytes * nRows;
+        m_bFailed = fwrite(pOut, 1, nLen, m_pFile) != nLen;
+        m_iNextRow += nRows;
+        return !m_bFailed;
+    }
+    bool WriteBand(GBmp& band)
+    {
+        if (band.GetWidth() != m_iWidth || band.IsGray() != m_bGray) {
+            return false;
+        }
+        return WriteBand(band.Data(), band.GetHeight());
+    }
+
+    // Returns false if a write failed or fewer rows than promised to Open were written.
+    bool Close()
+    {
+        bool bRet = true;
+        if (m_pFile) {
+            bRet = !m_bFailed && m_iNextRow == m_iHeight;
+            bRet = (fclose(m_pFile) == 0) && bRet;
+            m_pFile = 0;
+        }
+        m_iWidth = m_iHeight = m_iNextRow = 0;
+        return bRet;
+    }
+
+    inline int GetNextRow() const { return m_iNextRow; }
+
+private:
+    FILE* m_pFile;
+    int m_iWidth;
+    int m_iHeight;
+    int m_iNextRow;
+    bool m_bGray;
+    bool m_bFailed;
+    std::vector<unsigned char> m_bandBuf;
+};
+
+struct GBmpBatchItem {
+    size_t iIndex; // position of the file in the list given to Start.
+    bool bOk; // false if the file could not be read or is not a supported bmp.
+    GBmp bmp;
+};
+
+// Loads a list of bmp files on its own threads, each reading a whole file with one call and
+// decoding it from memory, so reads of some files overlap the decoding of others. Next hands the
+// frames back in list order or in completion order; at most the queue depth of them are read,
+// decoded or waiting at any time, which bounds the memory in flight.
+class GBmpBatchLoader
+{
+public:
+    GBmpBatchLoader(void)
+        : m_bOrdered(true)
+        , m_nDepth(0)
+        , m_iNext(0)
+        , m_nDelivered(0)
+        , m_bStop(false)
+    {
+    }
+    GBmpBatchLoader(const GBmpBatchLoader&) = delete;
+    GBmpBatchLoader& operator=(const GBmpBatchLoader&) = delete;
+    ~GBmpBatchLoader(void) { Stop(); }
+
+    // nThreads 0 picks one per hardware thread (at least 2, so I/O overlaps decode);
+    // nQueueDepth 0 picks twice the thread count.
+    void Start(const std::vector<std::string>& paths, bool bOrdered = true, int nThreads = 0, size_t nQueueDepth = 0)
+    {
+        Stop();
+        if (nThreads <= 0) {
+            nThreads = (std::max)(2, (int)std::thread::hardware_concurrency());
+        }
+        m_paths = paths;
+        m_slots.clear();
+        m_slots.resize(m_paths.size());
+        m_completed.clear();
+        m_bOrdered = bOrdered;
+        m_nDepth = nQueueDepth ? nQueueDepth : (size_t)nThreads * 2;
+        m_iNext = 0;
+        m_nDelivered = 0;
+        m_bStop = false;
+        nThreads = (int)(std::min)((size_t)nThreads, (std::max)(m_paths.size(), (size_t)1));
+        for (int i = 0; i < nThreads; i++) {
+            m_workers.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+    // Blocks until the next frame is ready, returns false once every file has been handed out.
+    bool Next(GBmpBatchItem& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        if (m_nDelivered == m_slots.size()) {
+            return false;
+        }
+        size_t iIndex;
+        if (m_bOrdered) {
+            m_cvDone.wait(lock, [this] { return m_slots[m_nDelivered].bDone; });
+            iIndex = m_nDelivered;
+        } else {
+            m_cvDone.wait(lock, [this] { return !m_completed.empty(); });
+            iIndex = m_completed.front();
+            m_completed.pop_front();
+        }
+        Slot& slot = m_slots[iIndex];
+        item.iIndex = iIndex;
+        item.bOk = slot.bOk;
+        item.bmp = std::move(slot.bmp); // the frame item held before goes back to the buffer pool.
+        m_nDelivered++;
+        lock.unlock();
+        m_cvSpace.notify_one();
+        return true;
+    }
+    // Abandons the files not yet loaded, Next must not be called again before Start. Called by Start and the destructor.
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_bStop = true;
+        }
+        m_cvSpace.notify_all();
+        for (std::thread& worker : m_workers) {
+            worker.join();
+        }
+        m_workers.clear();
+    }
+
+    inline size_t GetCount() const { return m_paths.size(); }
+
+    // Reads a whole file into buf with as few calls as the OS allows.
+    static bool ReadFile(const char* strFileName, std::vector<unsigned char>& buf)
+    {
+#ifdef _WIN32
+        FILE* pFile = fopen(strFileName, "rb");
+        if (pFile == 0) {
+            return false;
+        }
+        bool bRet = false;
+        if (GBmpSeek(pFile, 0, SEEK_END) == 0) {
+            int64_t iFileLen = GBmpTell(pFile);
+            if (iFileLen >= 0 && GBmpSeek(pFile, 0, SEEK_SET) == 0) {
+                buf.resize((size_t)iFileLen);
+                bRet = fread(buf.data(), 1, buf.size(), pFile) == buf.size();
+            }
+        }
+        fclose(pFile);
+        return bRet;
+#else
+        int fd = open(strFileName, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool bRet = fstat(fd, &st) == 0 && st.st_size >= 0;
+        if (bRet) {
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            buf.resize((size_t)st.st_size);
+            size_t nDone = 0;
+            while (nDone < buf.size()) {
+                ssize_t nRead = pread(fd, buf.data() + nDone, buf.size() - nDone, (off_t)nDone);
+                if (nRead <= 0) {
+                    bRet = false;
+                    break;
+                }
+                nDone += (size_t)nRead;
+            }
+        }
+        close(fd);
+        return bRet;
+#endif
+    }
+
+private:
+    struct Slot {
+        Slot(void)
+            : bDone(false)
+            , bOk(false)
+        {
+        }
+        bool bDone;
+        bool bOk;
+        GBmp bmp;
+    };
+
+    void WorkerLoop()
+    {
+        GThreadPool::SetSerialThread(true); // parallel across files, not within one.
+        std::vector<unsigned char> buf; // reused across files, only grows.
+        for (;;) {
+            size_t iIndex;
+            {
+                std::unique_lock<std::mutex> lock(m_mtx);
+                m_cvSpace.wait(lock, [this] { return m_bStop || m_iNext == m_slots.size() || m_iNext - m_nDelivered < m_nDepth; });
+                if (m_bStop || m_iNext == m_slots.size()) {
+                    return;
+                }
+                iIndex = m_iNext++;
+            }
+            GBmp bmp;
+            bool bOk = false;
+            try {
+                bOk = ReadFile(m_paths[iIndex].c_str(), buf) && bmp.DecodeFromBuffer(buf.data(), buf.size());
+            } catch (...) {
+                bOk = false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                Slot& slot = m_slots[iIndex];
+                slot.bmp = std::move(bmp);
+                slot.bOk = bOk;
+                slot.bDone = true;
+                if (!m_bOrdered) {
+                    m_completed.push_back(iIndex);
+                }
+            }
+            m_cvDone.notify_all();
+        }
+    }
+
+    std::vector<std::string> m_paths;
+    std::vector<Slot> m_slots;
+    std::deque<size_t> m_completed; // finished, not yet handed out; unordered mode only.
+    bool m_bOrdered;
+    size_t m_nDepth;
+    size_t m_iNext; // next file a worker claims.
+    size_t m_nDelivered;
+    bool m_bStop;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mtx;
+    std::condition_variable m_cvSpace;
+    std::condition_variable m_cvDone;
+};
+
+// Pixel formats for GBmpT. DecodeLine turns a 1/8/24/32-bit file row into a row of the format,
+// EncodeLine turns a row of the format into the FileBitCount-bit row SaveBmp writes. The branch on
+// the file's bit count is taken once per row, the loops under it are per format.
+template <int N>
+struct GPixelBytes { // one pixel of an N byte format, moved as a unit.
+    unsigned char b[N];
+};
+
+struct GPixelGray8 {
+    typedef uint8_t Channel;
+    enum { PixelBytes = 1, FileBitCount = 8, ViewFormat = GPF_GRAY8 };
+    static unsigned char GrayOf(const unsigned char* pBGR) { return (unsigned char)((pBGR[2] * 9798 + pBGR[1] * 19235 + pBGR[0] * 3736 + 16384) >> 15); }
+    static void DecodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth, int iBitCount)
+    {
+        switch (iBitCount) {
+        case 1:
+            GBmp::Bit1ToGray8(pSrc, pDst, iWidth);
+            break;
+        case 8:
+            memcpy(pDst, pSrc, iWidth);
+            break;
+        case 24:
+            for (int j = 0; j < iWidth; j++) {
+                pDst[j] = GrayOf(pSrc + j * 3);
+            }
+            break;
+        case 32:
+            GBmpKernels::Get().pfnToGray((const uint32_t*)pSrc, pDst, iWidth);
+            break;
+        }
+    }
+    static void EncodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth) { memcpy(pDst, pSrc, iWidth); }
+};
+
+struct GPixelBGR24 {
+    typedef uint8_t Channel;
+    enum { PixelBytes = 3, FileBitCount = 24, ViewFormat = -1 };
+    static void DecodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth, int iBitCount)
+    {
+        switch (iBitCount) {
+        case 1:
+        case 8: {
+            // gray goes to the last third of the row and spreads forward, never past an unread byte.
+            unsigned char* pGray = pDst + (size_t)iWidth * 2;
+            GPixelGray8::DecodeLine(pSrc, pGray, iWidth, iBitCount);
+            for (int j = 0; j < iWidth; j++) {
+                unsigned char v = pGray[j];
+                pDst[j * 3] = pDst[j * 3 + 1] = pDst[j * 3 + 2] = v;
+            }
+            break;
+        }
+        case 24:
+            memcpy(pDst, pSrc, (size_t)iWidth * 3);
+            break;
+        case 32:
+            GBmpKernels::Get().pfnRGB32ToRGB24(pSrc, pDst, iWidth);
+            break;
+        }
+    }
+    static void EncodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth) { memcpy(pDst, pSrc, (size_t)iWidth * 3); }
+};
+
+struct GPixelBGRA32 {
+    typedef uint8_t Channel;
+    enum { PixelBytes = 4, FileBitCount = 32, ViewFormat = GPF_BGRA32 };
+    static void DecodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth, int iBitCount)
+    {
+        switch (iBitCount) {
+        case 1:
+        case 8: {
+            unsigned char* pGray = pDst + (size_t)iWidth * 3;
+            GPixelGray8::DecodeLine(pSrc, pGray, iWidth, iBitCount);
+            GBmpKernels::Get().pfnGrayToRGB32(pGray, pDst, iWidth, 0);
+            break;
+        }
+        case 24:
+            GBmpKernels::Get().pfnRGB24ToRGB32(pSrc, pDst, iWidth, 0);
+            break;
+        case 32:
+            memcpy(pDst, pSrc, (size_t)iWidth * 4);
+            break;
+        }
+    }
+    static void EncodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth) { memcpy(pDst, pSrc, (size_t)iWidth * 4); }
+};
+
+struct GPixelGray16 { // native-endian 16-bit gray, files carry its high byte as 8-bit gray.
+    typedef uint16_t Channel;
+    enum { PixelBytes = 2, FileBitCount = 8, ViewFormat = -1 };
+    static void DecodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth, int iBitCount)
+    {
+        unsigned char* pGray = pDst + iWidth;
+        GPixelGray8::DecodeLine(pSrc, pGray, iWidth, iBitCount);
+        for (int j = 0; j < iWidth; j++) {
+            uint16_t v = (uint16_t)(pGray[j] * 257);
+            memcpy(pDst + j * 2, &v, 2);
+        }
+    }
+    static void EncodeLine(const unsigned char* pSrc, unsigned char* pDst, int iWidth)
+    {
+        for (int j = 0; j < iWidth; j++) {
+            uint16_t v;
+            memcpy(&v, pSrc + j * 2, 2);
+            pDst[j] = (unsigned char)(v >> 8);
+        }
+    }
+};
+
+// An image whose pixel format is fixed at compile time, e.g. GBmpT<GPixelBGR24> keeps 24-bit files at
+// 3 bytes a pixel. Rows are packed, buffers come from GBmp's allocator, and every operation is
+// generated for the one pixel size. Gray8 and BGRA32 images trade buffers with GBmp through
+// MoveFrom/MoveTo and reach the GBmp operations through View().
+template <class Format>
+class GBmpT
+{
+public:
+    typedef Format PixelFormat;
+    typedef typename Format::Channel Channel;
+    typedef GPixelBytes<Format::PixelBytes> Pixel;
+    enum { PixelBytes = Format::PixelBytes };
+
+    GBmpT(void)
+        : m_iWidth(0)
+        , m_iHeight(0)
+        , m_pImage(0)
+        , m_nCapacity(0)
+        , m_pAllocator(0)
+    {
+    }
+    GBmpT(int iWid, int iHei)
+        : GBmpT()
+    {
+        SetImageSize(iWid, iHei);
+    }
+    GBmpT(const GBmpT&) = delete;
+    GBmpT(GBmpT&& o) noexcept
+        : GBmpT()
+    {
+        Swap(o);
+    }
+    GBmpT& operator=(GBmpT&& o) noexcept
+    {
+        if (this != &o) {
+            Release();
+            Swap(o);
+        }
+        return *this;
+    }
+    ~GBmpT(void) { Release(); }
+    void Swap(GBmpT& o) noexcept
+    {
+        std::swap(m_iWidth, o.m_iWidth);
+        std::swap(m_iHeight, o.m_iHeight);
+        std::swap(m_pImage, o.m_pImage);
+        std::swap(m_nCapacity, o.m_nCapacity);
+        std::swap(m_pAllocator, o.m_pAllocator);
+    }
+
+    void SetImageSize(int iWid, int iHei)
+    {
+        size_t nBytes = (size_t)iWid * iHei * PixelBytes;
+        if (m_pImage == 0 || nBytes > m_nCapacity) {
+            FreeBuffer();
+            GBMP_STAT_COUNT(GSTAT_ALLOC, nBytes);
+            GBmpAllocator* pAllocator = GBmp::GetAllocator();
+            m_pImage = static_cast<unsigned char*>(pAllocator->Allocate(nBytes));
+            m_pAllocator = pAllocator;
+            m_nCapacity = nBytes;
+        }
+        m_iWidth = iWid;
+        m_iHeight = iHei;
+    }
+    void Release()
+    {
+        FreeBuffer();
+        m_iWidth = m_iHeight = 0;
+    }
+
+    inline unsigned char* Data() { return m_pImage; }
+    inline unsigned char* Line(int y) { return m_pImage + (size_t)y * LineBytes(); }
+    inline size_t LineBytes() const { return (size_t)m_iWidth * PixelBytes; }
+    inline int GetWidth() const { return m_iWidth; }
+    inline int GetHeight() const { return m_iHeight; }
+
+    // Only for the formats GImageView knows, GPixelGray8 and GPixelBGRA32.
+    GImageView View()
+    {
+        static_assert((int)Format::ViewFormat >= 0, "GImageView has no such pixel format");
+        return GImageView(m_pImage, m_iWidth, m_iHeight, (ptrdiff_t)LineBytes(), (GPixelFormat)Format::ViewFormat);
+    }
+    // Takes over the buffer of a GBmp holding the same format, false if bmp holds the other one.
+    bool MoveFrom(GBmp& bmp)
+    {
+        if ((int)Format::ViewFormat != (bmp.IsGray() ? (int)GPF_GRAY8 : (int)GPF_BGRA32)) {
+            return false;
+        }
+        bmp.MakeUnique();
+        Release();
+        std::swap(m_iWidth, bmp.m_iWidth);
+        std::swap(m_iHeight, bmp.m_iHeight);
+        std::swap(m_pImage, bmp.m_pImage);
+        std::swap(m_nCapacity, bmp.m_nCapacity);
+        std::swap(m_pAllocator, bmp.m_pAllocator);
+        return true;
+    }
+    void MoveTo(GBmp& bmp)
+    {
+        static_assert((int)Format::ViewFormat >= 0, "GBmp has no such pixel format");
+        bmp.Release();
+        std::swap(m_iWidth, bmp.m_iWidth);
+        std::swap(m_iHeight, bmp.m_iHeight);
+        std::swap(m_pImage, bmp.m_pImage);
+        std::swap(m_nCapacity, bmp.m_nCapacity);
+        std::swap(m_pAllocator, bmp.m_pAllocator);
+        bmp.m_bGray = (int)Format::ViewFormat == (int)GPF_GRAY8;
+    }
+
+    bool LoadBmp(const char* strFileName, GOrientation orient = GORIENT_NONE)
+    {
+        std::vector<unsigned char> file;
+        try {
+            if (GBmpBatchLoader::ReadFile(strFileName, file)) {
+                return DecodeFromBuffer(file.data(), file.size(), orient);
+            }
+        } catch (...) {
+        }
+        Release();
+        return false;
+    }
+    // Decodes 1/8/24/32-bit files into this format, see the DecodeLine of the format. Palette, bit field
+    // and RLE files are decoded by GBmp first.
+    bool DecodeFromBuffer(const void* pFile, size_t nFileLen, GOrientation orient = GORIENT_NONE)
+    {
+        GBmpLayout layout;
+        if (!GBmp::ParseHeader(pFile, nFileLen, layout)) {
+            return false;
+        }
+        if (layout.IsRle() || (layout.iCodec != GROW_BIT1 && layout.iCodec != GROW_COPY && layout.iCodec != GROW_BGR24)) {
+            return DecodeThroughGBmp(pFile, nFileLen, orient);
+        }
+        if (orient == GORIENT_TRANSPOSE) {
+            GBmpT bmpLoaded;
+            if (!bmpLoaded.DecodeFromBuffer(pFile, nFileLen)) {
+                return false;
+            }
+            *this = bmpLoaded.Transpose();
+            return true;
+        }
+        try {
+            SetImageSize(layout.iWidth, layout.iHeight);
+        } catch (...) {
+            Release();
+            return false;
+        }
+        const unsigned char* pTopLn = static_cast<const unsigned char*>(pFile) + layout.nOffBits;
+        ptrdiff_t iSrcPitch = (ptrdiff_t)layout.nSrcLnBytes;
+        if (!layout.bTopDown) {
+            pTopLn += (layout.iHeight - 1) * iSrcPitch;
+            iSrcPitch = -iSrcPitch;
+        }
+        bool bFlip = orient == GORIENT_FLIP || orient == GORIENT_ROTATE180;
+        bool bMirror = orient == GORIENT_MIRROR || orient == GORIENT_ROTATE180;
+        GThreadPool::Instance().ParallelFor(m_iHeight, LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pDst = Line(bFlip ? m_iHeight - 1 - (int)i : (int)i);
+                Format::DecodeLine(pTopLn + (ptrdiff_t)i * iSrcPitch, pDst, m_iWidth, layout.iBitCount);
+                if (bMirror) {
+                    MirrorLine(pDst, m_iWidth);
+                }
+            }
+        });
+        return true;
+    }
+
+    size_t EncodedSize() const
+    {
+        size_t nLnBytes = ((size_t)m_iWidth * Format::FileBitCount + 31) / 32 * 4;
+        return GBmp::HeaderBytes(Format::FileBitCount) + nLnBytes * m_iHeight;
+    }
+    // Writes the whole bmp file into caller memory, returns its size or 0 if nDstLen is below EncodedSize().
+    size_t EncodeToBuffer(void* pDst, size_t nDstLen)
+    {
+        size_t nSize = EncodedSize();
+        if (nDstLen < nSize) {
+            return 0;
+        }
+        unsigned char* pBytes = static_cast<unsigned char*>(pDst);
+        unsigned char* pPixels = pBytes + GBmp::WriteHeader(pBytes, m_iWidth, m_iHeight, (int)Format::FileBitCount);
+        size_t nLnBytes = ((size_t)m_iWidth * Format::FileBitCount + 31) / 32 * 4;
+        size_t nLnLen = ((size_t)m_iWidth * Format::FileBitCount + 7) / 8;
+        GThreadPool::Instance().ParallelFor(m_iHeight, nLnBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pLn = pPixels + i * nLnBytes;
+                Format::EncodeLine(Line((int)i), pLn, m_iWidth);
+                memset(pLn + nLnLen, 0, nLnBytes - nLnLen);
+            }
+        });
+        return nSize;
+    }
+    bool SaveBmp(const char* strFileName)
+    {
+        std::vector<unsigned char> file;
+        try {
+            file.resize(EncodedSize());
+        } catch (...) {
+            return false;
+        }
+        EncodeToBuffer(file.data(), file.size());
+        FILE* outputFile = fopen(strFileName, "wb");
+        if (outputFile == 0) {
+            return false;
+        }
+        bool bRet = fwrite(file.data(), 1, file.size(), outputFile) == file.size();
+        return (fclose(outputFile) == 0) && bRet;
+    }
+
+    void MirrorV()
+    {
+        size_t nLnBytes = LineBytes();
+        GThreadPool::Instance().ParallelFor(m_iHeight / 2, nLnBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                std::swap_ranges(Line((int)i), Line((int)i) + nLnBytes, Line(m_iHeight - 1 - (int)i));
+            }
+        });
+    }
+    void MirrorH()
+    {
+        GThreadPool::Instance().ParallelFor(m_iHeight, LineBytes(), [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                MirrorLine(Line((int)i), m_iWidth);
+            }
+        });
+    }
+    // Rotates by 180 degrees in place.
+    void ReverseImage()
+    {
+        MirrorV();
+        MirrorH();
+    }
+    GBmpT Rotate180()
+    {
+        GBmpT bmpRot(m_iWidth, m_iHeight);
+        GThreadPool::Instance().ParallelFor(m_iHeight, LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                const Pixel* pLnSrc = (const Pixel*)Line(m_iHeight - 1 - (int)i);
+                std::reverse_copy(pLnSrc, pLnSrc + m_iWidth, (Pixel*)bmpRot.Line((int)i));
+            }
+        });
+        return bmpRot;
+    }
+    GBmpT Transpose()
+    {
+        GBmpT bmpRot(m_iHeight, m_iWidth);
+        TransposePixels(m_pImage, (ptrdiff_t)LineBytes(), bmpRot.m_pImage, (ptrdiff_t)bmpRot.LineBytes());
+        return bmpRot;
+    }
+    GBmpT Rotate90()
+    {
+        GBmpT bmpRot(m_iHeight, m_iWidth);
+        ptrdiff_t iDstPitch = (ptrdiff_t)bmpRot.LineBytes();
+        TransposePixels(m_pImage, (ptrdiff_t)LineBytes(), bmpRot.Line(m_iWidth - 1), -iDstPitch);
+        return bmpRot;
+    }
+    GBmpT Rotate270()
+    {
+        GBmpT bmpRot(m_iHeight, m_iWidth);
+        TransposePixels(Line(m_iHeight - 1), -(ptrdiff_t)LineBytes(), bmpRot.m_pImage, (ptrdiff_t)bmpRot.LineBytes());
+        return bmpRot;
+    }
+    // Copies the rectangle [iLeft, iRight) x [iTop, iBottom), clipped to the image.
+    GBmpT CropImage(int iLeft, int iTop, int iRight, int iBottom)
+    {
+        iLeft = (std::max)(iLeft, 0);
+        iTop = (std::max)(iTop, 0);
+        iRight = (std::min)(iRight, m_iWidth);
+        iBottom = (std::min)(iBottom, m_iHeight);
+        GBmpT bmpCrop;
+        if (iRight <= iLeft || iBottom <= iTop) {
+            return bmpCrop;
+        }
+        bmpCrop.SetImageSize(iRight - iLeft, iBottom - iTop);
+        for (int i = 0; i < bmpCrop.m_iHeight; i++) {
+            memcpy(bmpCrop.Line(i), Line(iTop + i) + (size_t)iLeft * PixelBytes, bmpCrop.LineBytes());
+        }
+        return bmpCrop;
+    }
+
+private:
+    // GBmp decodes to gray or 32-bit, which this format takes over when it is one of them.
+    bool DecodeThroughGBmp(const void* pFile, size_t nFileLen, GOrientation orient)
+    {
+        GBmp bmp;
+        if (!bmp.DecodeFromBuffer(pFile, nFileLen, orient)) {
+            Release();
+            return false;
+        }
+        if (MoveFrom(bmp)) {
+            return true;
+        }
+        try {
+            SetImageSize(bmp.GetWidth(), bmp.GetHeight());
+        } catch (...) {
+            Release();
+            return false;
+        }
+        GImageView view = bmp.ConstView();
+        int iBitCount = view.IsGray() ? 8 : 32;
+        GThreadPool::Instance().ParallelFor(m_iHeight, LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                Format::DecodeLine(view.Line((int)i), Line((int)i), m_iWidth, iBitCount);
+            }
+        });
+        return true;
+    }
+    static void MirrorLine(unsigned char* pLn, int iWidth)
+    {
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        if (PixelBytes == 1) {
+            kernels.pfnReverse8(pLn, pLn + iWidth - iWidth / 2, iWidth / 2);
+        } else if (PixelBytes == 4) {
+            kernels.pfnReverse32((uint32_t*)pLn, (uint32_t*)pLn + iWidth - iWidth / 2, iWidth / 2);
+        } else {
+            std::reverse((Pixel*)pLn, (Pixel*)pLn + iWidth);
+        }
+    }
+    // Transposes the whole image into pDst, pitches as for GBmp::TransposePixels. The SIMD tiles cover
+    // 1 and 4 byte pixels, other sizes go through the same blocking with plain pixel moves.
+    void TransposePixels(const unsigned char* pSrc, ptrdiff_t iSrcPitch, unsigned char* pDst, ptrdiff_t iDstPitch)
+    {
+        if (PixelBytes == 1 || PixelBytes == 4) {
+            GBmp::TransposePixels(pSrc, iSrcPitch, pDst, iDstPitch, m_iWidth, m_iHeight, PixelBytes);
+            return;
+        }
+        const int iBlock = 32;
+        size_t nBlockRows = (m_iHeight + iBlock - 1) / iBlock;
+        GThreadPool::Instance().ParallelFor(nBlockRows, (size_t)iBlock * LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            for (int by = (int)iBegin * iBlock; by < (int)iEnd * iBlock && by < m_iHeight; by += iBlock) {
+                int y1 = (std::min)(by + iBlock, m_iHeight);
+                for (int bx = 0; bx < m_iWidth; bx += iBlock) {
+                    int x1 = (std::min)(bx + iBlock, m_iWidth);
+                    for (int x = bx; x < x1; x++) {
+                        Pixel* pLnDst = (Pixel*)(pDst + x * iDstPitch);
+                        for (int y = by; y < y1; y++) {
+                            pLnDst[y] = ((const Pixel*)(pSrc + y * iSrcPitch))[x];
+                        }
+                    }
+                }
+            }
+        });
+    }
+    void FreeBuffer()
+    {
+        if (m_pImage) {
+            if (m_pAllocator) {
+                m_pAllocator->Free(m_pImage, m_nCapacity);
+            } else {
+                delete[] m_pImage; // a GBmp::AttachData buffer taken over by MoveFrom.
+            }
+        }
+        m_pImage = 0;
+        m_pAllocator = 0;
+        m_nCapacity = 0;
+    }
+
+    int m_iWidth;
+    int m_iHeight;
+    unsigned char* m_pImage;
+    size_t m_nCapacity;
+    GBmpAllocator* m_pAllocator;
+};
+
+typedef GBmpT<GPixelGray8> GBmpGray8;
+typedef GBmpT<GPixelBGR24> GBmpBGR24;
+typedef GBmpT<GPixelBGRA32> GBmpBGRA32;
+typedef GBmpT<GPixelGray16> GBmpGray16;
+
+// 1 bit per pixel, kept packed the way 1-bit bmp files store it: rows padded to 4 bytes, the leftmost
+// pixel in bit 7 of byte 0, set bits white. Bits past the width are always 0, so rows load, save and
+// count without unpacking.
+class GBmpBitonal
+{
+public:
+    GBmpBitonal(void)
+        : m_iWidth(0)
+        , m_iHeight(0)
+    {
+    }
+    GBmpBitonal(int iWid, int iHei)
+        : GBmpBitonal()
+    {
+        SetImageSize(iWid, iHei);
+    }
+    GBmpBitonal(const GBmpBitonal&) = delete;
+    GBmpBitonal(GBmpBitonal&& o) noexcept
+        : GBmpBitonal()
+    {
+        Swap(o);
+    }
+    GBmpBitonal& operator=(GBmpBitonal&& o) noexcept
+    {
+        if (this != &o) {
+            Release();
+            Swap(o);
+        }
+        return *this;
+    }
+    void Swap(GBmpBitonal& o) noexcept
+    {
+        m_bits.Swap(o.m_bits);
+        std::swap(m_iWidth, o.m_iWidth);
+        std::swap(m_iHeight, o.m_iHeight);
+    }
+
+    // The image starts out black.
+    void SetImageSize(int iWid, int iHei)
+    {
+        m_bits.SetImageSize((int)LineBytesOf(iWid), iHei);
+        memset(m_bits.Data(), 0, LineBytesOf(iWid) * iHei);
+        m_iWidth = iWid;
+        m_iHeight = iHei;
+    }
+    void Release()
+    {
+        m_bits.Release();
+        m_iWidth = m_iHeight = 0;
+    }
+
+    static size_t LineBytesOf(int iWidth) { return ((size_t)iWidth + 31) / 32 * 4; }
+    inline unsigned char* Data() { return m_bits.Data(); }
+    inline unsigned char* Line(int y) { return m_bits.Line(y); }
+    inline size_t LineBytes() const { return LineBytesOf(m_iWidth); }
+    inline int GetWidth() const { return m_iWidth; }
+    inline int GetHeight() const { return m_iHeight; }
+    inline bool GetPixel(int x, int y) { return (Line(y)[x >> 3] >> (7 - (x & 7))) & 1; }
+    inline void SetPixel(int x, int y, bool bWhite)
+    {
+        unsigned char iBit = (unsigned char)(0x80 >> (x & 7));
+        Line(y)[x >> 3] = bWhite ? (Line(y)[x >> 3] | iBit) : (Line(y)[x >> 3] & ~iBit);
+    }
+
+    bool LoadBmp(const char* strFileName)
+    {
+        std::vector<unsigned char> file;
+        try {
+            if (GBmpBatchLoader::ReadFile(strFileName, file)) {
+                return DecodeFromBuffer(file.data(), file.size());
+            }
+        } catch (...) {
+        }
+        Release();
+        return false;
+    }
+    // 1-bit files are taken row by row as they are, inverted when palette entry 0 is the brighter one
+    // (min-is-white files); deeper ones go through gray and a threshold of 128.
+    bool DecodeFromBuffer(const void* pFile, size_t nFileLen)
+    {
+        GBmpLayout layout;
+        if (!GBmp::ParseHeader(pFile, nFileLen, layout)) {
+            return false;
+        }
+        try {
+            if (layout.iBitCount != 1) {
+                GBmpGray8 bmpGray;
+                if (!bmpGray.DecodeFromBuffer(pFile, nFileLen)) {
+                    return false;
+                }
+                Binarize(bmpGray.View(), 128);
+                return true;
+            }
+            SetImageSize(layout.iWidth, layout.iHeight);
+        } catch (...) {
+            Release();
+            return false;
+        }
+        const unsigned char* pPixels = static_cast<const unsigned char*>(pFile) + layout.nOffBits;
+        size_t nLnBytes = LineBytes();
+        unsigned char iLastMask = (unsigned char)(0xFF << ((8 - m_iWidth % 8) % 8));
+        size_t iLast = (m_iWidth - 1) / 8;
+        bool bInvert = IsMinIsWhite(layout);
+        for (int i = 0; i < m_iHeight; i++) {
+            unsigned char* pLn = Line(layout.bTopDown ? i : m_iHeight - 1 - i);
+            memcpy(pLn, pPixels + i * nLnBytes, iLast + 1); // the file's padding bits may be anything.
+            if (bInvert) {
+                for (size_t j = 0; j <= iLast; j++) {
+                    pLn[j] = (unsigned char)~pLn[j];
+                }
+            }
+            pLn[iLast] &= iLastMask;
+        }
+        return true;
+    }
+
+    size_t EncodedSize() const { return GBmp::HeaderBytes(1) + LineBytes() * m_iHeight; }
+    // Writes a 1-bit bmp file into caller memory, returns its size or 0 if nDstLen is below EncodedSize().
+    size_t EncodeToBuffer(void* pDst, size_t nDstLen)
+    {
+        size_t nSize = EncodedSize();
+        if (nDstLen < nSize) {
+            return 0;
+        }
+        unsigned char* pBytes = static_cast<unsigned char*>(pDst);
+        size_t nHeader = GBmp::WriteHeader(pBytes, m_iWidth, m_iHeight, 1);
+        memcpy(pBytes + nHeader, Data(), LineBytes() * m_iHeight);
+        return nSize;
+    }
+    bool SaveBmp(const char* strFileName)
+    {
+        unsigned char header[GBmp::HeaderBytesMax];
+        size_t nHeader = GBmp::WriteHeader(header, m_iWidth, m_iHeight, 1);
+        size_t nPixels = LineBytes() * m_iHeight;
+        FILE* outputFile = fopen(strFileName, "wb");
+        if (outputFile == 0) {
+            return false;
+        }
+        bool bRet = fwrite(header, 1, nHeader, outputFile) == nHeader;
+        bRet = bRet && fwrite(Data(), 1, nPixels, outputFile) == nPixels;
+        return (fclose(outputFile) == 0) && bRet;
+    }
+
+    // Sets the pixels of a gray view that are at least iThreshold.
+    void Binarize(const GImageView& gray, unsigned char iThreshold)
+    {
+        SetImageSize(gray.iWidth, gray.iHeight);
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(m_iHeight, (size_t)m_iWidth + LineBytes(), [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                kernels.pfnGrayToBit1(gray.Line((int)i), Line((int)i), m_iWidth, iThreshold);
+            }
+        });
+    }
+    // Unpacks into 8-bit gray, 0 and 255.
+    void ToGray(GBmp& bmp)
+    {
+        bmp.SetImageSize(m_iWidth, m_iHeight, true);
+        unsigned char* pDst = (unsigned char*)bmp.Data();
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(m_iHeight, (size_t)m_iWidth + LineBytes(), [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                kernels.pfnBit1ToGray8(Line((int)i), pDst + i * m_iWidth, m_iWidth);
+            }
+        });
+    }
+
+    size_t CountWhite()
+    {
+        // padding bits are 0, so whole rows are counted 8 bytes at a time.
+        std::atomic<size_t> nWhite(0);
+        size_t nLnBytes = LineBytes();
+        GThreadPool::Instance().ParallelFor(m_iHeight, nLnBytes, [&](size_t iBegin, size_t iEnd) {
+            const unsigned char* pBytes = Line((int)iBegin);
+            size_t nBytes = (iEnd - iBegin) * nLnBytes;
+            size_t nCount = 0;
+            size_t j = 0;
+            for (; j + 8 <= nBytes; j += 8) {
+                uint64_t iWord;
+                memcpy(&iWord, pBytes + j, 8);
+                nCount += PopCount64(iWord);
+            }
+            for (; j < nBytes; j += 4) {
+                uint32_t iWord;
+                memcpy(&iWord, pBytes + j, 4);
+                nCount += PopCount64(iWord);
+            }
+            nWhite += nCount;
+        });
+        return nWhite;
+    }
+    size_t CountBlack() { return (size_t)m_iWidth * m_iHeight - CountWhite(); }
+
+    void MirrorV()
+    {
+        size_t nLnBytes = LineBytes();
+        for (int i = 0; i < m_iHeight / 2; i++) {
+            std::swap_ranges(Line(i), Line(i) + nLnBytes, Line(m_iHeight - 1 - i));
+        }
+    }
+    // Reverses the bits of every row: bytes in reverse order through the bit reverse table, then
+    // shifted left over the padding that ends up in front.
+    void MirrorH()
+    {
+        size_t nUsed = ((size_t)m_iWidth + 7) / 8;
+        int iShift = (int)(nUsed * 8 - m_iWidth);
+        const unsigned char* pReverse = GBmpKernels::BitReverseTable();
+        GThreadPool::Instance().ParallelFor(m_iHeight, LineBytes() * 2, [&](size_t iBegin, size_t iEnd) {
+            std::vector<unsigned char> tmp(nUsed + 1, 0);
+            for (size_t i = iBegin; i < iEnd; i++) {
+                unsigned char* pLn = Line((int)i);
+                for (size_t j = 0; j < nUsed; j++) {
+                    tmp[j] = pReverse[pLn[nUsed - 1 - j]];
+                }
+                for (size_t j = 0; j < nUsed; j++) {
+                    pLn[j] = iShift ? (unsigned char)((tmp[j] << iShift) | (tmp[j + 1] >> (8 - iShift))) : tmp[j];
+                }
+            }
+        });
+    }
+    // Rotates by 180 degrees in place.
+    void ReverseImage()
+    {
+        MirrorV();
+        MirrorH();
+    }
+    GBmpBitonal Rotate180()
+    {
+        GBmpBitonal bmpRot = CropImage(0, 0, m_iWidth, m_iHeight);
+        bmpRot.ReverseImage();
+        return bmpRot;
+    }
+    // 8x8 blocks of bits: 8 rows of one byte column gather into a word, transpose in registers and
+    // scatter as 8 destination rows.
+    GBmpBitonal Transpose()
+    {
+        GBmpBitonal bmpRot(m_iHeight, m_iWidth);
+        int nBlockCols = (m_iWidth + 7) / 8;
+        int nBlockRows = (m_iHeight + 7) / 8;
+        GThreadPool::Instance().ParallelFor(nBlockRows, LineBytes() * 16, [&](size_t iBegin, size_t iEnd) {
+            for (int by = (int)iBegin; by < (int)iEnd; by++) {
+                for (int bx = 0; bx < nBlockCols; bx++) {
+                    uint64_t iBlock = 0;
+                    for (int r = 0; r < 8; r++) {
+                        int y = by * 8 + r;
+                        iBlock = (iBlock << 8) | (y < m_iHeight ? Line(y)[bx] : 0);
+                    }
+                    iBlock = Transpose8x8(iBlock);
+                    for (int r = 0; r < 8 && bx * 8 + r < m_iWidth; r++) {
+                        bmpRot.Line(bx * 8 + r)[by] = (unsigned char)(iBlock >> (56 - r * 8));
+                    }
+                }
+            }
+        });
+        return bmpRot;
+    }
+    GBmpBitonal Rotate90()
+    {
+        GBmpBitonal bmpRot = Transpose();
+        bmpRot.MirrorV();
+        return bmpRot;
+    }
+    GBmpBitonal Rotate270()
+    {
+        GBmpBitonal bmpRot = Transpose();
+        bmpRot.MirrorH();
+        return bmpRot;
+    }
+    // Copies the rectangle [iLeft, iRight) x [iTop, iBottom), clipped to the image, shifting the bits
+    // of each row into place a byte at a time.
+    GBmpBitonal CropImage(int iLeft, int iTop, int iRight, int iBottom)
+    {
+        iLeft = (std::max)(iLeft, 0);
+        iTop = (std::max)(iTop, 0);
+        iRight = (std::min)(iRight, m_iWidth);
+        iBottom = (std::min)(iBottom, m_iHeight);
+        GBmpBitonal bmpCrop;
+        if (iRight <= iLeft || iBottom <= iTop) {
+            return bmpCrop;
+        }
+        int nWidth = iRight - iLeft;
+        bmpCrop.SetImageSize(nWidth, iBottom - iTop);
+        size_t iFirst = iLeft / 8;
+        int iShift = iLeft % 8;
+        size_t nDstBytes = ((size_t)nWidth + 7) / 8;
+        size_t nSrcBytes = LineBytes();
+        unsigned char iLastMask = (unsigned char)(0xFF << ((8 - nWidth % 8) % 8));
+        for (int i = 0; i < bmpCrop.m_iHeight; i++) {
+            const unsigned char* pSrc = Line(iTop + i) + iFirst;
+            unsigned char* pDst = bmpCrop.Line(i);
+            if (iShift == 0) {
+                memcpy(pDst, pSrc, nDstBytes);
+            } else {
+                for (size_t j = 0; j < nDstBytes; j++) {
+                    unsigned char iNext = iFirst + j + 1 < nSrcBytes ? pSrc[j + 1] : 0;
+                    pDst[j] = (unsigned char)((pSrc[j] << iShift) | (iNext >> (8 - iShift)));
+                }
+            }
+            pDst[nDstBytes - 1] &= iLastMask;
+        }
+        return bmpCrop;
+    }
+
+private:
+    static int PopCount64(uint64_t iWord)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        return (int)__popcnt64(iWord);
+#elif defined(_MSC_VER)
+        return (int)(__popcnt((uint32_t)iWord) + __popcnt((uint32_t)(iWord >> 32)));
+#else
+        return __builtin_popcountll(iWord);
+#endif
+    }
+    // True when the 1-bit palette gives index 0 the brighter color, so set bits are the dark pixels.
+    static bool IsMinIsWhite(const GBmpLayout& layout)
+    {
+        int iLuma[2];
+        for (int i = 0; i < 2; i++) {
+            uint32_t v = layout.palette[i]; // B, G, R, 0
+            iLuma[i] = (int)(v >> 16 & 0xFF) * 9798 + (int)(v >> 8 & 0xFF) * 19235 + (int)(v & 0xFF) * 3736;
+        }
+        return iLuma[0] > iLuma[1];
+    }
+    // Row r of the block is byte 7 - r, column c is bit 7 - c of it; swaps rows and columns.
+    static uint64_t Transpose8x8(uint64_t x)
+    {
+        uint64_t t;
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+        x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+        x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+        x = x ^ t ^ (t << 28);
+        return x;
+    }
+
+    GBmpGray8 m_bits; // LineBytes() wide, one byte per 8 pixels.
+    int m_iWidth;
+    int m_iHeight;
+};
+
+// Records a chain of crops, flips, rotations and ToGray over a view and runs it as one pass: the
+// geometric steps compose into a single source coordinate map and the gray conversion happens on
+// the way out, so the chain reads the source once and writes the result once.
+//     GBmp out = GBmpPipeline(bmp.View()).Crop(l, t, r, b).Rotate90().ToGray().MirrorH().Run();
+class GBmpPipeline
+{
+public:
+    explicit GBmpPipeline(const GImageView& src)
+        : m_src(src)
+        , m_iWidth(src.iWidth)
+        , m_iHeight(src.iHeight)
+        , m_bToGray(false)
+    {
+        // output (x, y) reads source (m_x0 + m_a * x + m_b * y, m_y0 + m_c * x + m_d * y).
+        m_x0 = m_y0 = 0;
+        m_a = m_d = 1;
+        m_b = m_c = 0;
+    }
+
+    // Same rectangle rules as GBmp::CropImage, clipped to the current size.
+    GBmpPipeline& Crop(int iLeft, int iTop, int iRight, int iBottom)
+    {
+        iLeft = (std::max)(iLeft, 0);
+        iTop = (std::max)(iTop, 0);
+        iRight = (std::min)(iRight, m_iWidth);
+        iBottom = (std::min)(iBottom, m_iHeight);
+        Compose(iLeft, iTop, 1, 0, 0, 1, (std::max)(iRight - iLeft, 0), (std::max)(iBottom - iTop, 0));
+        return *this;
+    }
+    GBmpPipeline& MirrorH() { return Compose(m_iWidth - 1, 0, -1, 0, 0, 1, m_iWidth, m_iHeight); }
+    GBmpPipeline& MirrorV() { return Compose(0, m_iHeight - 1, 1, 0, 0, -1, m_iWidth, m_iHeight); }
+    GBmpPipeline& Rotate180() { return Compose(m_iWidth - 1, m_iHeight - 1, -1, 0, 0, -1, m_iWidth, m_iHeight); }
+    GBmpPipeline& Transpose() { return Compose(0, 0, 0, 1, 1, 0, m_iHeight, m_iWidth); }
+    // Same directions as GBmp::Rotate90 and GBmp::Rotate270.
+    GBmpPipeline& Rotate90() { return Compose(m_iWidth - 1, 0, 0, -1, 1, 0, m_iHeight, m_iWidth); }
+    GBmpPipeline& Rotate270() { return Compose(0, m_iHeight - 1, 0, 1, -1, 0, m_iHeight, m_iWidth); }
+    // Per-pixel, so it runs last whatever its place in the chain.
+    GBmpPipeline& ToGray()
+    {
+        m_bToGray = !m_src.IsGray();
+        return *this;
+    }
+
+    inline int GetWidth() const { return m_iWidth; }
+    inline int GetHeight() const { return m_iHeight; }
+
+    GBmp Run()
+    {
+        GBmp bmpOut;
+        Run(bmpOut);
+        return bmpOut;
+    }
+    // The result is built in a fresh buffer, so dst may be the image the source view points into.
+    void Run(GBmp& dst)
+    {
+        GBmp bmpOut;
+        bool bGrayOut = m_src.IsGray() || m_bToGray;
+        GBMP_STAT_SCOPE(GSTAT_PIPELINE, (uint64_t)m_src.LineBytes() * m_src.iHeight + (uint64_t)m_iWidth * m_iHeight * (bGrayOut ? 1 : 4));
+        bmpOut.SetImageSize(m_iWidth, m_iHeight, bGrayOut);
+        if (m_iWidth > 0 && m_iHeight > 0) {
+            if (m_a != 0) {
+                RunRows(bmpOut);
+            } else {
+                RunTransposed(bmpOut);
+            }
+        }
+        dst = std::move(bmpOut);
+    }
+
+private:
+    // Output (x, y) of the step reads (x0 + a * x + b * y, y0 + c * x + d * y) of the chain so far.
+    GBmpPipeline& Compose(int x0, int y0, int a, int b, int c, int d, int iWidth, int iHeight)
+    {
+        int x0New = m_x0 + m_a * x0 + m_b * y0;
+        int y0New = m_y0 + m_c * x0 + m_d * y0;
+        int aNew = m_a * a + m_b * c, bNew = m_a * b + m_b * d;
+        int cNew = m_c * a + m_d * c, dNew = m_c * b + m_d * d;
+        m_x0 = x0New, m_y0 = y0New;
+        m_a = aNew, m_b = bNew, m_c = cNew, m_d = dNew;
+        m_iWidth = iWidth;
+        m_iHeight = iHeight;
+        return *this;
+    }
+    // Output rows are source rows, read forwards or backwards: one copy or gray conversion per row
+    // and a reverse while the row is still in cache.
+    void RunRows(GBmp& bmpOut)
+    {
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        int iPxlBytes = m_src.PixelBytes();
+        int iWidth = m_iWidth;
+        size_t nDstLnBytes = bmpOut.View().LineBytes();
+        unsigned char* pOut = bmpOut.m_pImage;
+        GThreadPool::Instance().ParallelFor(m_iHeight, (size_t)iWidth * iPxlBytes + nDstLnBytes, [&](size_t iBegin, size_t iEnd) {
+            for (size_t i = iBegin; i < iEnd; i++) {
+                int y = (int)i;
+                int sy = m_y0 + m_d * y;
+                int sx = m_a > 0 ? m_x0 : m_x0 - (iWidth - 1); // leftmost source pixel of the row.
+                const unsigned char* pSrc = m_src.Line(sy) + (ptrdiff_t)sx * iPxlBytes;
+                unsigned char* pDst = pOut + i * nDstLnBytes;
+                if (m_bToGray) {
+                    kernels.pfnToGray((const uint32_t*)pSrc, pDst, iWidth);
+                } else {
+                    memcpy(pDst, pSrc, (size_t)iWidth * iPxlBytes);
+                }
+                if (m_a > 0) {
+                    continue;
+                }
+                if (nDstLnBytes == (size_t)iWidth) {
+                    kernels.pfnReverse8(pDst, pDst + iWidth - iWidth / 2, iWidth / 2);
+                } else {
+                    kernels.pfnReverse32((uint32_t*)pDst, (uint32_t*)pDst + iWidth - iWidth / 2, iWidth / 2);
+                }
+            }
+        });
+    }
+    // Output rows are source columns. Bands of output rows go through the tiled transpose, whose signed
+    // pitches absorb the flips; with ToGray the band is transposed into a cached scratch band first.
+    void RunTransposed(GBmp& bmpOut)
+    {
+        const int iBand = 32;
+        int iPxlBytes = m_src.PixelBytes();
+        size_t nDstLnBytes = bmpOut.View().LineBytes();
+        size_t nBands = (m_iHeight + iBand - 1) / iBand;
+        const GBmpKernels& kernels = GBmpKernels::Get();
+        GThreadPool::Instance().ParallelFor(nBands, (size_t)iBand * m_iWidth * iPxlBytes * 2, [&](size_t iBegin, size_t iEnd) {
+            GBmp bmpBand;
+            if (m_bToGray) {
+                bmpBand.SetImageSize(m_iWidth, iBand, false);
+            }
+            for (size_t iBandNo = iBegin; iBandNo < iEnd; iBandNo++) {
+                int y0 = (int)iBandNo * iBand;
+                int y1 = (std::min)(y0 + iBand, m_iHeight);
+                int n = y1 - y0;
+                // output row y reads source column m_x0 + m_b * y, output column x source row m_y0 + m_c * x.
+                int sxFirst = m_b > 0 ? m_x0 + y0 : m_x0 - (y1 - 1);
+                const unsigned char* pSrc = m_src.Line(m_y0) + (ptrdiff_t)sxFirst * iPxlBytes;
+                ptrdiff_t iSrcPitch = m_c * m_src.iPitch;
+                unsigned char* pDst;
+                ptrdiff_t iDstPitch;
+                if (m_bToGray) {
+                    pDst = bmpBand.m_pImage;
+                    iDstPitch = (ptrdiff_t)m_iWidth * 4;
+                } else {
+                    pDst = bmpOut.m_pImage + y0 * nDstLnBytes;
+                    iDstPitch = (ptrdiff_t)nDstLnBytes;
+                }
+                if (m_b < 0) {
+                    pDst += (n - 1) * iDstPitch;
+                    iDstPitch = -iDstPitch;
+                }
+                GBmp::TransposePixels(pSrc, iSrcPitch, pDst, iDstPitch, n, m_iWidth, iPxlBytes);
+                if (m_bToGray) {
+                    for (int i = 0; i < n; i++) {
+                        kernels.pfnToGray((const uint32_t*)(bmpBand.m_pImage + (size_t)i * m_iWidth * 4),
+                            bmpOut.m_pImage + (y0 + i) * nDstLnBytes, m_iWidth);
+                    }
+                }
+            }
+        });
+    }
+
+    GImageView m_src;
+    int m_iWidth;
+    int m_iHeight;
+    bool m_bToGray;
+    int m_x0, m_y0;
+    int m_a, m_b, m_c, m_d;
 };
@@ -0,0 +1,346 @@
+// Throughput of the GBmp operations and file paths, one JSON object per line on stdout.
+//     g++ -O2 -std=c++17 -I.. bench_gbmp.cpp -o bench_gbmp -lpthread
+//     ./bench_gbmp [--max-mp 200] [--threads 1] [--min-time 0.2] [--dir /dev/shm] [--filter Rotate]
+// Every kernel level the host supports is measured in the same run; build with -DGBMP_NO_SIMD for a
+// scalar-only binary.
+#include "../GBmp.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+    double dMaxMp = 16;
+    int nThreads = 1;
+    double dMinTime = 0.2;
+    std::string strDir;
+    std::string strFilter;
+};
+
+const char* LevelName(GSimdLevel level)
+{
+    switch (level) {
+    case GSIMD_SCALAR:
+        return "scalar";
+    case GSIMD_SSE2:
+        return "sse2";
+    case GSIMD_SSSE3:
+        return "ssse3";
+    case GSIMD_AVX2:
+        return "avx2";
+    case GSIMD_AVX512BW:
+        return "avx512bw";
+    }
+    return "?";
+}
+
+// Best time of one call over repeats filling dMinTime, at least 3 of them.
+template <class Fn>
+double TimeBest(const Options& opt, const Fn& fn)
+{
+    typedef std::chrono::steady_clock Clock;
+    double dBest = 1e30;
+    double dTotal = 0;
+    for (int i = 0; i < 3 || dTotal < opt.dMinTime; i++) {
+        Clock::time_point t0 = Clock::now();
+        fn();
+        double dSec = std::chrono::duration<double>(Clock::now() - t0).count();
+        dBest = (std::min)(dBest, dSec);
+        dTotal += dSec;
+    }
+    return dBest;
+}
+
+// nBytes is what one call reads plus writes, the basis of the GB/s figure.
+void Report(const char* strBench, const char* strLevel, int iWidth, int iHeight, const char* strFormat, int nThreads,
+    double dSec, double nBytes)
+{
+    double nPixels = (double)iWidth * iHeight;
+    printf("{\"bench\":\"%s\",\"level\":\"%s\",\"format\":\"%s\",\"width\":%d,\"height\":%d,\"threads\":%d,"
+           "\"ns_per_pixel\":%.4f,\"gb_per_s\":%.3f,\"ms\":%.4f}\n",
+        strBench, strLevel, strFormat, iWidth, iHeight, nThreads, dSec * 1e9 / nPixels, nBytes / dSec / 1e9, dSec * 1e3);
+    fflush(stdout);
+}
+
+bool Wanted(const Options& opt, const char* strBench)
+{
+    return opt.strFilter.empty() || strstr(strBench, opt.strFilter.c_str()) != 0;
+}
+
+void FillRandom(unsigned char* p, size_t n)
+{
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        p[i] = (unsigned char)x;
+    }
+}
+
+void BenchPixelOps(const Options& opt, int iWidth, int iHeight, const char* strLevel)
+{
+    size_t nPixels = (size_t)iWidth * iHeight;
+    for (int iGray = 0; iGray < 2; iGray++) {
+        bool bGray = iGray != 0;
+        const char* strFormat = bGray ? "gray8" : "bgra32";
+        double nImage = (double)nPixels * (bGray ? 1 : 4);
+        GBmp bmp;
+        bmp.SetImageSize(iWidth, iHeight, bGray);
+        FillRandom((unsigned char*)bmp.Data(), (size_t)nImage);
+
+        struct Case {
+            const char* strName;
+            std::function<void()> fn;
+            double nBytes;
+        };
+        GBmp bmpOut;
+        // the in-place rotations turn their own copy, so the cases after them see bmp as it was.
+        GBmp bmpInPlace;
+        bmpInPlace.CopyImage(bmp.ConstView());
+        GBmp bmpGray;
+        GBmp bmpColor;
+        std::vector<GBmp> pyramid;
+        std::vector<unsigned char> file;
+        GHistogram hist;
+        GImageStats stats;
+        std::vector<Case> cases;
+        cases.push_back({ "MirrorH", [&] { bmp.MirrorH(); }, nImage * 2 });
+        cases.push_back({ "MirrorV", [&] { bmp.MirrorV(); }, nImage * 2 });
+        cases.push_back({ "ReverseImage", [&] { bmp.ReverseImage(); }, nImage * 2 });
+        cases.push_back({ "Rotate90", [&] { bmpOut = bmp.Rotate90(); }, nImage * 2 });
+        cases.push_back({ "Rotate270", [&] { bmpOut = bmp.Rotate270(); }, nImage * 2 });
+        cases.push_back({ "Rotate180", [&] { bmpOut = bmp.Rotate180(); }, nImage * 2 });
+        cases.push_back({ "Transpose", [&] { bmpOut = bmp.Transpose(); }, nImage * 2 });
+        cases.push_back({ "Rotate90.InPlace", [&] { bmpInPlace.Rotate90InPlace(); }, nImage * 2 });
+        cases.push_back({ "Transpose.InPlace", [&] { bmpInPlace.TransposeInPlace(); }, nImage * 2 });
+        cases.push_back({ "Resize.Bilinear.Half", [&] { bmpOut = bmp.Resize(iWidth / 2, iHeight / 2, GRESIZE_BILINEAR); }, nImage * 5 / 4 });
+        cases.push_back({ "Resize.Area.Third", [&] { bmpOut = bmp.Resize(iWidth / 3, iHeight / 3, GRESIZE_AREA); }, nImage * 10 / 9 });
+        cases.push_back({ "Resize.Nearest.Double", [&] { bmpOut = bmp.Resize(iWidth * 2, iHeight * 2, GRESIZE_NEAREST); }, nImage * 5 });
+        cases.push_back({ "Downsample2x", [&] { bmpOut = bmp.Downsample2x(); }, nImage * 5 / 4 });
+        cases.push_back({ "BuildPyramid", [&] { bmp.BuildPyramid(pyramid); }, nImage * 4 / 3 });
+        cases.push_back({ "Histogram", [&] { hist = bmp.Histogram(); }, nImage });
+        cases.push_back({ "Statistics", [&] { stats = bmp.Statistics(); }, nImage });
+        cases.push_back({ "CopyImage.Shared", [&] { bmpOut.CopyImage(bmp); }, nImage });
+        cases.push_back({ "CropImage", [&] { bmpOut.CopyImage(bmp.CropImage(iWidth / 4, iHeight / 4, iWidth * 3 / 4, iHeight * 3 / 4)); }, nImage / 2 });
+        if (!bGray) {
+            bmpGray.SetImageSize(iWidth, iHeight, true);
+            cases.push_back({ "ToGray", [&] { GBmp::ToGray(bmp.View(), bmpGray.View()); }, (double)nPixels * 5 });
+            cases.push_back({ "ToGray.Histogram", [&] { GBmp::ToGray(bmp.View(), bmpGray.View(), hist); }, (double)nPixels * 5 });
+            cases.push_back({ "SwapRB", [&] { bmp.SwapRB(); }, nImage * 2 });
+            cases.push_back({ "EncodeToBuffer.BGR24", [&] { bmp.EncodeToBuffer(file, 24); }, (double)nPixels * 7 });
+            cases.push_back({ "Pipeline.Rotate90.ToGray", [&] { GBmpPipeline(bmp.View()).Rotate90().ToGray().Run(bmpOut); },
+                (double)nPixels * 5 });
+        } else {
+            bmpColor.SetImageSize(iWidth, iHeight, false);
+            cases.push_back({ "ToBGRA", [&] { GBmp::ToBGRA(bmp.View(), bmpColor.View()); }, (double)nPixels * 5 });
+        }
+        for (const Case& c : cases) {
+            if (Wanted(opt, c.strName)) {
+                Report(c.strName, strLevel, iWidth, iHeight, strFormat, opt.nThreads, TimeBest(opt, c.fn), c.nBytes);
+            }
+        }
+    }
+
+    if (Wanted(opt, "RGB24ToRGB32")) {
+        size_t nSrcLn = ((size_t)iWidth * 3 + 3) / 4 * 4;
+        std::vector<unsigned char> src(nSrcLn * iHeight);
+        FillRandom(src.data(), src.size());
+        GBmp bmp;
+        bmp.SetImageSize(iWidth, iHeight, false);
+        unsigned char* pDst = (unsigned char*)bmp.Data();
+        double dSec = TimeBest(opt, [&] {
+            GThreadPool::Instance().ParallelFor(iHeight, (size_t)iWidth * 7, [&](size_t iBegin, size_t iEnd) {
+                for (size_t i = iBegin; i < iEnd; i++) {
+                    GBmp::DecodeLine(src.data() + i * nSrcLn, pDst + i * iWidth * 4, iWidth, 24);
+                }
+            });
+        });
+        Report("RGB24ToRGB32", strLevel, iWidth, iHeight, "bgr24", opt.nThreads, dSec, (double)nPixels * 7);
+    }
+}
+
+// Load and save of every bit depth; the corpus file is written once through the class that keeps the depth.
+void BenchFiles(const Options& opt, int iWidth, int iHeight, const char* strLevel)
+{
+    const int bitCounts[] = { 1, 8, 24, 32 };
+    for (int iBitCount : bitCounts) {
+        std::string strPath = opt.strDir + "/bench_gbmp_" + std::to_string(iBitCount) + ".bmp";
+        std::string strOut = opt.strDir + "/bench_gbmp_out.bmp";
+        char strFormat[16];
+        snprintf(strFormat, sizeof(strFormat), "file%d", iBitCount);
+        std::function<bool()> fnSave;
+        GBmpBitonal bmp1;
+        GBmpBGR24 bmp24;
+        GBmp bmp;
+        if (iBitCount == 1) {
+            bmp1.SetImageSize(iWidth, iHeight);
+            FillRandom(bmp1.Data(), bmp1.LineBytes() * iHeight);
+            GBmp bmpGray;
+            bmp1.ToGray(bmpGray);
+            bmp1.Binarize(bmpGray.View(), 128); // clears the padding bits the fill touched.
+            fnSave = [&] { return bmp1.SaveBmp(strOut.c_str()); };
+            bmp1.SaveBmp(strPath.c_str());
+        } else if (iBitCount == 24) {
+            bmp24.SetImageSize(iWidth, iHeight);
+            FillRandom(bmp24.Data(), bmp24.LineBytes() * iHeight);
+            fnSave = [&] { return bmp24.SaveBmp(strOut.c_str()); };
+            bmp24.SaveBmp(strPath.c_str());
+        } else {
+            bmp.SetImageSize(iWidth, iHeight, iBitCount == 8);
+            FillRandom((unsigned char*)bmp.Data(), (size_t)iWidth * iHeight * (iBitCount / 8));
+            fnSave = [&] { return bmp.SaveBmp(strOut.c_str()); };
+            bmp.SaveBmp(strPath.c_str());
+        }
+        std::vector<unsigned char> file;
+        if (!GBmpBatchLoader::ReadFile(strPath.c_str(), file)) {
+            fprintf(stderr, "cannot write the corpus in %s\n", opt.strDir.c_str());
+            exit(1);
+        }
+        double nFileLen = (double)file.size();
+        file.clear();
+        file.shrink_to_fit();
+
+        if (Wanted(opt, "LoadBmp")) {
+            GBmp bmpLoaded;
+            Report("LoadBmp", strLevel, iWidth, iHeight, strFormat, opt.nThreads,
+                TimeBest(opt, [&] { bmpLoaded.LoadBmp(strPath.c_str()); }), nFileLen);
+        }
+        if (Wanted(opt, "SaveBmp")) {
+            Report("SaveBmp", strLevel, iWidth, iHeight, strFormat, opt.nThreads, TimeBest(opt, [&] { fnSave(); }), nFileLen);
+        }
+        remove(strPath.c_str());
+        remove(strOut.c_str());
+    }
+}
+
+void PutLE(std::vector<unsigned char>& file, size_t iAt, uint32_t v, int nBytes)
+{
+    for (int k = 0; k < nBytes; k++) {
+        file[iAt + k] = (unsigned char)(v >> (8 * k));
+    }
+}
+
+// A bmp file held in memory in one of the formats only the decoders take: 4/8-bit color palettes,
+// 16-bit 5-6-5 bit fields, or RLE8 with short runs and an end of line per row.
+std::vector<unsigned char> MakeFile(int iWidth, int iHeight, int iBitCount, int iCompression)
+{
+    size_t nColors = iBitCount <= 8 ? (size_t)1 << iBitCount : 0;
+    size_t nOffBits = 14 + 40 + (iCompression == GBI_BITFIELDS ? 12 : 0) + nColors * 4;
+    std::vector<unsigned char> file(nOffBits);
+    file[0] = 'B';
+    file[1] = 'M';
+    PutLE(file, 10, (uint32_t)nOffBits, 4);
+    PutLE(file, 14, 40, 4);
+    PutLE(file, 18, (uint32_t)iWidth, 4);
+    PutLE(file, 22, (uint32_t)iHeight, 4);
+    PutLE(file, 26, 1, 2);
+    PutLE(file, 28, (uint32_t)iBitCount, 2);
+    PutLE(file, 30, (uint32_t)iCompression, 4);
+    FillRandom(file.data() + 54, nColors * 4);
+    if (iCompression == GBI_BITFIELDS) {
+        PutLE(file, 54, 0xF800, 4);
+        PutLE(file, 58, 0x7E0, 4);
+        PutLE(file, 62, 0x1F, 4);
+    }
+    if (iCompression == GBI_RLE8) {
+        std::vector<unsigned char> runs(256);
+        FillRandom(runs.data(), runs.size());
+        size_t iRun = 0;
+        for (int y = 0; y < iHeight; y++) {
+            for (int x = 0; x < iWidth;) {
+                int n = (std::min)(1 + runs[iRun++ % 256] % 16, iWidth - x);
+                file.push_back((unsigned char)n);
+                file.push_back(runs[iRun++ % 256]);
+                x += n;
+            }
+            file.push_back(0);
+            file.push_back(0);
+        }
+        file.push_back(0);
+        file.push_back(1);
+        return file;
+    }
+    size_t nLnBytes = ((size_t)iWidth * iBitCount + 31) / 32 * 4;
+    file.resize(nOffBits + nLnBytes * iHeight);
+    FillRandom(file.data() + nOffBits, nLnBytes * iHeight);
+    return file;
+}
+
+// DecodeFromBuffer of the palette, bit field and RLE formats.
+void BenchDecoders(const Options& opt, int iWidth, int iHeight, const char* strLevel)
+{
+    if (!Wanted(opt, "DecodeFromBuffer")) {
+        return;
+    }
+    struct Format {
+        const char* strName;
+        int iBitCount;
+        int iCompression;
+    };
+    const Format formats[] = { { "pal4", 4, GBI_RGB }, { "pal8", 8, GBI_RGB }, { "rgb565", 16, GBI_BITFIELDS }, { "rle8", 8, GBI_RLE8 } };
+    for (const Format& f : formats) {
+        std::vector<unsigned char> file = MakeFile(iWidth, iHeight, f.iBitCount, f.iCompression);
+        GBmp bmp;
+        double dSec = TimeBest(opt, [&] { bmp.DecodeFromBuffer(file.data(), file.size()); });
+        Report("DecodeFromBuffer", strLevel, iWidth, iHeight, f.strName, opt.nThreads, dSec,
+            (double)file.size() + (double)iWidth * iHeight * (bmp.IsGray() ? 1 : 4));
+    }
+}
+
+std::string DefaultDir()
+{
+    // tmpfs keeps the disk out of the figures.
+    FILE* pFile = fopen("/dev/shm/bench_gbmp_probe", "wb");
+    if (pFile) {
+        fclose(pFile);
+        remove("/dev/shm/bench_gbmp_probe");
+        return "/dev/shm";
+    }
+    return ".";
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    opt.strDir = DefaultDir();
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string strArg = argv[i];
+        if (strArg == "--max-mp") {
+            opt.dMaxMp = atof(argv[i + 1]);
+        } else if (strArg == "--threads") {
+            opt.nThreads = atoi(argv[i + 1]);
+        } else if (strArg == "--min-time") {
+            opt.dMinTime = atof(argv[i + 1]);
+        } else if (strArg == "--dir") {
+            opt.strDir = argv[i + 1];
+        } else if (strArg == "--filter") {
+            opt.strFilter = argv[i + 1];
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    GThreadPool::Instance().SetThreadCount(opt.nThreads);
+
+    // from L1-resident up to 200 MP.
+    const int sizes[][2] = { { 64, 64 }, { 256, 256 }, { 1024, 1024 }, { 2048, 2048 }, { 4096, 4096 }, { 8192, 8192 }, { 16384, 12288 } };
+    for (int iLevel = GSIMD_SCALAR; iLevel <= GCpu::Detect(); iLevel++) {
+        const char* strLevel = LevelName(GBmpKernels::SetLevel((GSimdLevel)iLevel));
+        for (const auto& size : sizes) {
+            if ((double)size[0] * size[1] > opt.dMaxMp * 1e6) {
+                break;
+            }
+            BenchPixelOps(opt, size[0], size[1], strLevel);
+            BenchFiles(opt, size[0], size[1], strLevel);
+            BenchDecoders(opt, size[0], size[1], strLevel);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,993 @@
+// Behavior checks of GBmp.hpp: every kernel level against the scalar kernels, the rotations and mirrors
+// against a per-pixel reference (in place and out of place), the resizes of every level against the
+// scalar ones, and the decoders against hand-built files, whole and cut short at every length.
+//     g++ -O1 -g -std=c++17 -fsanitize=address,undefined -I.. test_gbmp.cpp -o test_gbmp -lpthread
+//     ./test_gbmp
+// Kernel inputs and file buffers are allocated at their exact size, so in an AddressSanitizer build a
+// read or write past them fails as well. Every failed check is printed; the exit code is 1 if any failed.
+#include "../GBmp.hpp"
+
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::vector<unsigned char> Bytes;
+
+int g_nChecks = 0;
+int g_nFailures = 0;
+
+void Check(bool bOk, const char* strFormat, ...)
+{
+    g_nChecks++;
+    if (bOk) {
+        return;
+    }
+    g_nFailures++;
+    va_list args;
+    va_start(args, strFormat);
+    fprintf(stderr, "FAIL ");
+    vfprintf(stderr, strFormat, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+const char* LevelName(GSimdLevel level)
+{
+    switch (level) {
+    case GSIMD_SCALAR:
+        return "scalar";
+    case GSIMD_SSE2:
+        return "sse2";
+    case GSIMD_SSSE3:
+        return "ssse3";
+    case GSIMD_AVX2:
+        return "avx2";
+    case GSIMD_AVX512BW:
+        return "avx512bw";
+    }
+    return "?";
+}
+
+uint32_t Random()
+{
+    static uint32_t s_x = 2463534242u;
+    s_x ^= s_x << 13;
+    s_x ^= s_x >> 17;
+    s_x ^= s_x << 5;
+    return s_x;
+}
+
+Bytes RandomBytes(size_t n)
+{
+    Bytes v(n);
+    for (size_t i = 0; i < n; i++) {
+        v[i] = (unsigned char)Random();
+    }
+    return v;
+}
+
+template <class T>
+bool Same(const std::vector<T>& a, const std::vector<T>& b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+// Kernels ------------------------------------------------------------------------------------------
+
+void CheckPixelKernels(const GBmpKernels& ref, const GBmpKernels& k, const char* strLevel, size_t n)
+{
+    int iWidth = (int)n;
+    Bytes bgra = RandomBytes(n * 4);
+    Bytes a, b, c;
+
+    a = Bytes(n), b = Bytes(n);
+    ref.pfnToGray((const uint32_t*)bgra.data(), a.data(), n);
+    k.pfnToGray((const uint32_t*)bgra.data(), b.data(), n);
+    Check(Same(a, b), "%s ToGray n=%zu", strLevel, n);
+    c = Bytes(bgra);
+    k.pfnToGray((const uint32_t*)c.data(), c.data(), n);
+    Check(std::equal(a.begin(), a.end(), c.begin()), "%s ToGray in place n=%zu", strLevel, n);
+    // rows of a mapped file may start at any byte.
+    c = Bytes(n * 4 + 1);
+    std::copy(bgra.begin(), bgra.end(), c.begin() + 1);
+    b = Bytes(n);
+    k.pfnToGray((const uint32_t*)(c.data() + 1), b.data(), n);
+    Check(Same(a, b), "%s ToGray unaligned n=%zu", strLevel, n);
+
+    Bytes bgr = RandomBytes(n * 3);
+    a = Bytes(n * 4), b = Bytes(n * 4);
+    ref.pfnRGB24ToRGB32(bgr.data(), a.data(), iWidth, 0xA5);
+    k.pfnRGB24ToRGB32(bgr.data(), b.data(), iWidth, 0xA5);
+    Check(Same(a, b), "%s RGB24ToRGB32 n=%zu", strLevel, n);
+
+    a = Bytes(n * 3), b = Bytes(n * 3);
+    ref.pfnRGB32ToRGB24(bgra.data(), a.data(), iWidth);
+    k.pfnRGB32ToRGB24(bgra.data(), b.data(), iWidth);
+    Check(Same(a, b), "%s RGB32ToRGB24 n=%zu", strLevel, n);
+
+    a = Bytes(n * 4), b = Bytes(n * 4);
+    ref.pfnSwapRB32(bgra.data(), a.data(), n);
+    k.pfnSwapRB32(bgra.data(), b.data(), n);
+    Check(Same(a, b), "%s SwapRB32 n=%zu", strLevel, n);
+    c = Bytes(bgra);
+    k.pfnSwapRB32(c.data(), c.data(), n);
+    Check(Same(a, c), "%s SwapRB32 in place n=%zu", strLevel, n);
+
+    Bytes gray = RandomBytes(n);
+    a = Bytes(n * 4), b = Bytes(n * 4);
+    ref.pfnGrayToRGB32(gray.data(), a.data(), n, 0x3C);
+    k.pfnGrayToRGB32(gray.data(), b.data(), n, 0x3C);
+    Check(Same(a, b), "%s GrayToRGB32 n=%zu", strLevel, n);
+    c = Bytes(n * 4);
+    std::copy(gray.begin(), gray.end(), c.begin() + n * 3);
+    k.pfnGrayToRGB32(c.data() + n * 3, c.data(), n, 0x3C);
+    Check(Same(a, c), "%s GrayToRGB32 in place n=%zu", strLevel, n);
+
+    // two separate rows trade reversed contents, then one row is mirrored onto itself.
+    Bytes lo = RandomBytes(n), hi = RandomBytes(n);
+    Bytes lo2 = lo, hi2 = hi;
+    ref.pfnReverse8(lo.data(), hi.data(), n);
+    k.pfnReverse8(lo2.data(), hi2.data(), n);
+    Check(Same(lo, lo2) && Same(hi, hi2), "%s Reverse8 n=%zu", strLevel, n);
+    a = Bytes(gray), b = Bytes(gray);
+    ref.pfnReverse8(a.data(), a.data() + n - n / 2, n / 2);
+    k.pfnReverse8(b.data(), b.data() + n - n / 2, n / 2);
+    Check(Same(a, b) && (n == 0 || b[0] == gray[n - 1]), "%s Reverse8 row n=%zu", strLevel, n);
+
+    std::vector<uint32_t> lo32(n), hi32(n);
+    for (size_t i = 0; i < n; i++) {
+        lo32[i] = Random(), hi32[i] = Random();
+    }
+    std::vector<uint32_t> row32 = lo32;
+    std::vector<uint32_t> lo32b = lo32, hi32b = hi32, row32b = row32;
+    ref.pfnReverse32(lo32.data(), hi32.data(), n);
+    k.pfnReverse32(lo32b.data(), hi32b.data(), n);
+    Check(Same(lo32, lo32b) && Same(hi32, hi32b), "%s Reverse32 n=%zu", strLevel, n);
+    ref.pfnReverse32(row32.data(), row32.data() + n - n / 2, n / 2);
+    k.pfnReverse32(row32b.data(), row32b.data() + n - n / 2, n / 2);
+    Check(Same(row32, row32b), "%s Reverse32 row n=%zu", strLevel, n);
+}
+
+void CheckBitAndSumKernels(const GBmpKernels& ref, const GBmpKernels& k, const char* strLevel, size_t n)
+{
+    int iWidth = (int)n;
+    size_t nBitBytes = (n + 7) / 8;
+    Bytes bits = RandomBytes(nBitBytes);
+    Bytes a(n), b(n);
+    ref.pfnBit1ToGray8(bits.data(), a.data(), iWidth);
+    k.pfnBit1ToGray8(bits.data(), b.data(), iWidth);
+    Check(Same(a, b), "%s Bit1ToGray8 n=%zu", strLevel, n);
+
+    Bytes gray = RandomBytes(n);
+    const unsigned char thresholds[] = { 0, 1, 128, 255, (unsigned char)Random() };
+    for (unsigned char iThreshold : thresholds) {
+        a = Bytes(nBitBytes), b = Bytes(nBitBytes);
+        ref.pfnGrayToBit1(gray.data(), a.data(), iWidth, iThreshold);
+        k.pfnGrayToBit1(gray.data(), b.data(), iWidth, iThreshold);
+        Check(Same(a, b), "%s GrayToBit1 n=%zu threshold=%d", strLevel, n, iThreshold);
+    }
+
+    Bytes ln0 = RandomBytes(n * 8), ln1 = RandomBytes(n * 8);
+    Bytes ln0Gray(ln0.begin(), ln0.begin() + n * 2), ln1Gray(ln1.begin(), ln1.begin() + n * 2);
+    a = Bytes(n), b = Bytes(n);
+    ref.pfnHalve8(ln0Gray.data(), ln1Gray.data(), a.data(), n);
+    k.pfnHalve8(ln0Gray.data(), ln1Gray.data(), b.data(), n);
+    Check(Same(a, b), "%s Halve8 n=%zu", strLevel, n);
+    a = Bytes(n * 4), b = Bytes(n * 4);
+    ref.pfnHalve32(ln0.data(), ln1.data(), a.data(), n);
+    k.pfnHalve32(ln0.data(), ln1.data(), b.data(), n);
+    Check(Same(a, b), "%s Halve32 n=%zu", strLevel, n);
+
+    // twice over, so the second call adds to sums that are not at their initial values.
+    Bytes src = RandomBytes(n * 3);
+    GByteSums sumsA, sumsB;
+    memset(&sumsA, 0, sizeof(sumsA));
+    memset(sumsA.iMin, 255, sizeof(sumsA.iMin));
+    sumsB = sumsA;
+    for (int i = 0; i < 2; i++) {
+        ref.pfnByteSums(src.data(), src.size(), sumsA);
+        k.pfnByteSums(src.data(), src.size(), sumsB);
+    }
+    bool bSame = true;
+    for (int c = 0; c < 4; c++) {
+        bSame = bSame && sumsA.iMin[c] == sumsB.iMin[c] && sumsA.iMax[c] == sumsB.iMax[c];
+        bSame = bSame && sumsA.nSum[c] == sumsB.nSum[c] && sumsA.nSumSq[c] == sumsB.nSumSq[c];
+    }
+    Check(bSame, "%s ByteSums n=%zu", strLevel, n * 3);
+
+    const uint32_t weights[] = { 1, 255, 0xFFFF, 0x10000, 70000 };
+    for (uint32_t w : weights) {
+        std::vector<uint32_t> sumA(n), sumB;
+        for (size_t i = 0; i < n; i++) {
+            sumA[i] = Random() >> 4;
+        }
+        sumB = sumA;
+        ref.pfnAreaSum(gray.data(), w, sumA.data(), n);
+        k.pfnAreaSum(gray.data(), w, sumB.data(), n);
+        Check(Same(sumA, sumB), "%s AreaSum n=%zu w=%u", strLevel, n, w);
+    }
+}
+
+// nTaps weights summing to iOne, none negative.
+void RandomWeights(int16_t* pWeights, int nTaps, int iOne)
+{
+    int iLeft = iOne;
+    for (int t = 0; t < nTaps - 1; t++) {
+        int w = (int)(Random() % (uint32_t)(iLeft + 1));
+        pWeights[t] = (int16_t)w;
+        iLeft -= w;
+    }
+    pWeights[nTaps - 1] = (int16_t)iLeft;
+}
+
+void CheckResizeKernels(const GBmpKernels& ref, const GBmpKernels& k, const char* strLevel, size_t n)
+{
+    int iWidth = (int)n;
+    for (int nTaps = 1; nTaps <= 4; nTaps++) {
+        // taps around x * nSrc / n, as BuildResizeTaps gives for a shrink and for an enlargement, then
+        // anywhere in the row.
+        const int srcWidths[] = { iWidth * 2 + 1, iWidth / 2 + 1, 37 };
+        for (int iCase = 0; iCase < 3; iCase++) {
+            int nSrc = srcWidths[iCase];
+            std::vector<int> index(n * nTaps);
+            std::vector<int16_t> weights(n * nTaps);
+            for (size_t x = 0; x < n; x++) {
+                int iCenter = (int)(x * nSrc / n);
+                for (int t = 0; t < nTaps; t++) {
+                    int i = iCase == 2 ? (int)(Random() % (uint32_t)nSrc) : iCenter + t - (nTaps - 1) / 2;
+                    index[x * nTaps + t] = (std::max)(0, (std::min)(i, nSrc - 1));
+                }
+                RandomWeights(&weights[x * nTaps], nTaps, 128);
+            }
+            Bytes src8 = RandomBytes(nSrc), src32 = RandomBytes((size_t)nSrc * 4);
+            std::vector<int16_t> a(n), b(n);
+            ref.pfnResizeH8(src8.data(), a.data(), index.data(), weights.data(), nTaps, iWidth);
+            k.pfnResizeH8(src8.data(), b.data(), index.data(), weights.data(), nTaps, iWidth);
+            Check(Same(a, b), "%s ResizeH8 n=%zu taps=%d src=%d", strLevel, n, nTaps, nSrc);
+            std::vector<int16_t> a32(n * 4), b32(n * 4);
+            ref.pfnResizeH32(src32.data(), a32.data(), index.data(), weights.data(), nTaps, iWidth);
+            k.pfnResizeH32(src32.data(), b32.data(), index.data(), weights.data(), nTaps, iWidth);
+            Check(Same(a32, b32), "%s ResizeH32 n=%zu taps=%d src=%d", strLevel, n, nTaps, nSrc);
+        }
+    }
+
+    const int tapCounts[] = { 1, 2, 3, 4, 6 };
+    for (int nTaps : tapCounts) {
+        std::vector<std::vector<int16_t>> rows(nTaps, std::vector<int16_t>(n));
+        std::vector<const int16_t*> pRows(nTaps);
+        for (int t = 0; t < nTaps; t++) {
+            for (size_t i = 0; i < n; i++) {
+                rows[t][i] = (int16_t)(Random() % (255 * 128 + 1));
+            }
+            pRows[t] = rows[t].data();
+        }
+        int16_t weights[6];
+        RandomWeights(weights, nTaps, 1 << 14);
+        Bytes a(n), b(n);
+        ref.pfnResizeV(pRows.data(), weights, nTaps, a.data(), n);
+        k.pfnResizeV(pRows.data(), weights, nTaps, b.data(), n);
+        Check(Same(a, b), "%s ResizeV n=%zu taps=%d", strLevel, n, nTaps);
+    }
+}
+
+void CheckPaletteKernels(const GBmpKernels& ref, const GBmpKernels& k, const char* strLevel, size_t n)
+{
+    int iWidth = (int)n;
+    Bytes lut = RandomBytes(256), lut16 = RandomBytes(16);
+    std::vector<uint32_t> palette(256), palette16(16);
+    for (uint32_t& v : palette) {
+        v = Random();
+    }
+    for (uint32_t& v : palette16) {
+        v = Random();
+    }
+    Bytes idx8 = RandomBytes(n), idx4 = RandomBytes((n + 1) / 2);
+    Bytes a(n), b(n);
+    ref.pfnIndex8ToGray8(idx8.data(), a.data(), iWidth, lut.data());
+    k.pfnIndex8ToGray8(idx8.data(), b.data(), iWidth, lut.data());
+    Check(Same(a, b), "%s Index8ToGray8 n=%zu", strLevel, n);
+    a = Bytes(n), b = Bytes(n);
+    ref.pfnIndex4ToGray8(idx4.data(), a.data(), iWidth, lut16.data());
+    k.pfnIndex4ToGray8(idx4.data(), b.data(), iWidth, lut16.data());
+    Check(Same(a, b), "%s Index4ToGray8 n=%zu", strLevel, n);
+    a = Bytes(n * 4), b = Bytes(n * 4);
+    ref.pfnIndex8ToRGB32(idx8.data(), a.data(), iWidth, palette.data());
+    k.pfnIndex8ToRGB32(idx8.data(), b.data(), iWidth, palette.data());
+    Check(Same(a, b), "%s Index8ToRGB32 n=%zu", strLevel, n);
+    a = Bytes(n * 4), b = Bytes(n * 4);
+    ref.pfnIndex4ToRGB32(idx4.data(), a.data(), iWidth, palette16.data());
+    k.pfnIndex4ToRGB32(idx4.data(), b.data(), iWidth, palette16.data());
+    Check(Same(a, b), "%s Index4ToRGB32 n=%zu", strLevel, n);
+
+    Bytes rgb16 = RandomBytes(n * 2);
+    for (int b565 = 0; b565 < 2; b565++) {
+        a = Bytes(n * 4), b = Bytes(n * 4);
+        ref.pfnRGB16ToRGB32(rgb16.data(), a.data(), iWidth, b565 != 0);
+        k.pfnRGB16ToRGB32(rgb16.data(), b.data(), iWidth, b565 != 0);
+        Check(Same(a, b), "%s RGB16ToRGB32 n=%zu 565=%d", strLevel, n, b565);
+    }
+}
+
+// Each transpose tile against a per-pixel transpose, with a padded source pitch and a bottom-up
+// destination.
+void CheckTransposeTiles(const GBmpKernels& k, const char* strLevel)
+{
+    for (int iPxlBytes = 1; iPxlBytes <= 4; iPxlBytes += 3) {
+        for (int i = 0; i < 2; i++) {
+            GTransposeTileFn pfnTile = iPxlBytes == 1 ? k.pfnTranspose8[i] : k.pfnTranspose32[i];
+            int iTile = iPxlBytes == 1 ? k.iTranspose8Tile[i] : k.iTranspose32Tile[i];
+            if (pfnTile == 0) {
+                continue;
+            }
+            ptrdiff_t iSrcPitch = (ptrdiff_t)(iTile + 3) * iPxlBytes;
+            ptrdiff_t iDstPitch = (ptrdiff_t)(iTile + 1) * iPxlBytes;
+            Bytes src = RandomBytes((iTile - 1) * iSrcPitch + iTile * iPxlBytes);
+            Bytes dst((iTile - 1) * iDstPitch + iTile * iPxlBytes);
+            pfnTile(src.data(), iSrcPitch, dst.data() + (iTile - 1) * iDstPitch, -iDstPitch);
+            bool bOk = true;
+            for (int y = 0; y < iTile; y++) {
+                for (int x = 0; x < iTile; x++) {
+                    const unsigned char* pSrc = src.data() + y * iSrcPitch + x * iPxlBytes;
+                    const unsigned char* pDst = dst.data() + (iTile - 1 - x) * iDstPitch + y * iPxlBytes;
+                    bOk = bOk && memcmp(pSrc, pDst, iPxlBytes) == 0;
+                }
+            }
+            Check(bOk, "%s Transpose tile %dx%d, %d bytes a pixel", strLevel, iTile, iTile, iPxlBytes);
+        }
+    }
+}
+
+void CheckKernels(const GBmpKernels& ref, const GBmpKernels& k, const char* strLevel)
+{
+    std::vector<size_t> widths;
+    for (size_t n = 0; n <= 70; n++) {
+        widths.push_back(n);
+    }
+    const size_t wide[] = { 95, 127, 128, 129, 255, 256, 257, 1000, 4099 };
+    widths.insert(widths.end(), wide, wide + sizeof(wide) / sizeof(wide[0]));
+    for (size_t n : widths) {
+        CheckPixelKernels(ref, k, strLevel, n);
+        CheckBitAndSumKernels(ref, k, strLevel, n);
+        CheckResizeKernels(ref, k, strLevel, n);
+        CheckPaletteKernels(ref, k, strLevel, n);
+    }
+    CheckTransposeTiles(k, strLevel);
+}
+
+// Whole-image operations -----------------------------------------------------------------------------
+
+GBmp RandomImage(int iWidth, int iHeight, bool bGray)
+{
+    GBmp bmp;
+    bmp.SetImageSize(iWidth, iHeight, bGray);
+    Bytes v = RandomBytes((size_t)iWidth * iHeight * (bGray ? 1 : 4));
+    memcpy(bmp.Data(), v.data(), v.size());
+    return bmp;
+}
+
+bool SameImage(const GBmp& a, const GBmp& b)
+{
+    if (a.GetWidth() != b.GetWidth() || a.GetHeight() != b.GetHeight() || a.IsGray() != b.IsGray()) {
+        return false;
+    }
+    size_t nLen = (size_t)a.GetWidth() * a.GetHeight() * (a.IsGray() ? 1 : 4);
+    return nLen == 0 || memcmp(a.Data(), b.Data(), nLen) == 0;
+}
+
+enum Geometry { GEO_TRANSPOSE, GEO_ROTATE90, GEO_ROTATE180, GEO_ROTATE270, GEO_MIRRORH, GEO_MIRRORV };
+const char* const g_strGeometry[] = { "Transpose", "Rotate90", "Rotate180", "Rotate270", "MirrorH", "MirrorV" };
+
+// The geometry one pixel at a time: output pixel (x, y) of each kind is the source pixel named below.
+GBmp ReferenceGeometry(const GBmp& src, Geometry geo)
+{
+    int w = src.GetWidth(), h = src.GetHeight();
+    bool bSwap = geo == GEO_TRANSPOSE || geo == GEO_ROTATE90 || geo == GEO_ROTATE270;
+    int iPxlBytes = src.IsGray() ? 1 : 4;
+    GBmp dst;
+    dst.SetImageSize(bSwap ? h : w, bSwap ? w : h, src.IsGray());
+    const unsigned char* pSrc = (const unsigned char*)src.Data();
+    unsigned char* pDst = (unsigned char*)dst.Data();
+    for (int y = 0; y < dst.GetHeight(); y++) {
+        for (int x = 0; x < dst.GetWidth(); x++) {
+            int sx = x, sy = y;
+            switch (geo) {
+            case GEO_TRANSPOSE:
+                sx = y, sy = x;
+                break;
+            case GEO_ROTATE90:
+                sx = w - 1 - y, sy = x;
+                break;
+            case GEO_ROTATE180:
+                sx = w - 1 - x, sy = h - 1 - y;
+                break;
+            case GEO_ROTATE270:
+                sx = y, sy = h - 1 - x;
+                break;
+            case GEO_MIRRORH:
+                sx = w - 1 - x;
+                break;
+            case GEO_MIRRORV:
+                sy = h - 1 - y;
+                break;
+            }
+            memcpy(pDst + ((size_t)y * dst.GetWidth() + x) * iPxlBytes, pSrc + ((size_t)sy * w + sx) * iPxlBytes, iPxlBytes);
+        }
+    }
+    return dst;
+}
+
+GBmp OutOfPlace(const GBmp& src, Geometry geo)
+{
+    switch (geo) {
+    case GEO_TRANSPOSE:
+        return src.Transpose();
+    case GEO_ROTATE90:
+        return src.Rotate90();
+    case GEO_ROTATE180:
+        return src.Rotate180();
+    case GEO_ROTATE270:
+        return src.Rotate270();
+    default:
+        break;
+    }
+    GBmp dst = src;
+    if (geo == GEO_MIRRORH) {
+        GBmp::MirrorH(dst.View());
+    } else {
+        GBmp::MirrorV(dst.View());
+    }
+    return dst;
+}
+
+void InPlace(GBmp& bmp, Geometry geo)
+{
+    switch (geo) {
+    case GEO_TRANSPOSE:
+        bmp.TransposeInPlace();
+        break;
+    case GEO_ROTATE90:
+        bmp.Rotate90InPlace();
+        break;
+    case GEO_ROTATE180:
+        bmp.Rotate180InPlace();
+        break;
+    case GEO_ROTATE270:
+        bmp.Rotate270InPlace();
+        break;
+    case GEO_MIRRORH:
+        GBmp::MirrorH(bmp.View());
+        break;
+    case GEO_MIRRORV:
+        GBmp::MirrorV(bmp.View());
+        break;
+    }
+}
+
+const int g_imageSizes[][2] = { { 1, 1 }, { 1, 9 }, { 9, 1 }, { 2, 2 }, { 3, 5 }, { 16, 16 }, { 17, 17 }, { 33, 65 },
+    { 64, 64 }, { 100, 37 }, { 129, 130 }, { 256, 256 }, { 255, 257 }, { 600, 7 } };
+
+// Out of place and in place, on a buffer of its own and on one a copy shares, against the reference.
+void CheckGeometry(const char* strLevel)
+{
+    for (const auto& size : g_imageSizes) {
+        for (int iGray = 0; iGray < 2; iGray++) {
+            GBmp src = RandomImage(size[0], size[1], iGray != 0);
+            for (int iGeo = GEO_TRANSPOSE; iGeo <= GEO_MIRRORV; iGeo++) {
+                Geometry geo = (Geometry)iGeo;
+                GBmp expected = ReferenceGeometry(src, geo);
+                Check(SameImage(OutOfPlace(src, geo), expected), "%s %s %dx%d gray=%d", strLevel, g_strGeometry[geo],
+                    size[0], size[1], iGray);
+                GBmp own = src;
+                own.Data();
+                InPlace(own, geo);
+                Check(SameImage(own, expected), "%s %s in place %dx%d gray=%d", strLevel, g_strGeometry[geo], size[0],
+                    size[1], iGray);
+                GBmp keep = src;
+                GBmp shared = src;
+                InPlace(shared, geo);
+                Check(SameImage(shared, expected) && SameImage(keep, src), "%s %s in place on a shared buffer %dx%d gray=%d",
+                    strLevel, g_strGeometry[geo], size[0], size[1], iGray);
+            }
+        }
+    }
+}
+
+// Resizes of every level have to match the scalar ones bit for bit; the scalar level runs first and
+// leaves its results in scalar.
+void CheckResize(const char* strLevel, std::vector<GBmp>& scalar)
+{
+    bool bScalar = scalar.empty();
+    size_t iResult = 0;
+    const char* const strModes[] = { "nearest", "bilinear", "area" };
+    for (const auto& size : g_imageSizes) {
+        for (int iGray = 0; iGray < 2; iGray++) {
+            int w = size[0], h = size[1];
+            // the same pixels at every level.
+            uint32_t iSeed = (uint32_t)(w * 7919 + h * 31 + iGray);
+            GBmp src;
+            src.SetImageSize(w, h, iGray != 0);
+            unsigned char* p = (unsigned char*)src.Data();
+            for (size_t i = 0; i < (size_t)w * h * (iGray ? 1 : 4); i++) {
+                iSeed = iSeed * 1103515245u + 12345u;
+                p[i] = (unsigned char)(iSeed >> 16);
+            }
+            const int targets[][2] = { { (std::max)(1, w / 3), (std::max)(1, h / 2) }, { w * 2 + 1, h + 3 },
+                { (std::max)(1, w - 1), h * 2 }, { 1, 1 } };
+            for (const auto& target : targets) {
+                for (int iMode = GRESIZE_NEAREST; iMode <= GRESIZE_AREA; iMode++) {
+                    GBmp out = src.Resize(target[0], target[1], (GResizeMode)iMode);
+                    if (bScalar) {
+                        scalar.push_back(out);
+                    } else {
+                        Check(iResult < scalar.size() && SameImage(out, scalar[iResult]), "%s Resize %s %dx%d to %dx%d gray=%d",
+                            strLevel, strModes[iMode], w, h, target[0], target[1], iGray);
+                    }
+                    iResult++;
+                }
+            }
+        }
+    }
+}
+
+// Decoders ------------------------------------------------------------------------------------------
+
+// A hand-built file and the pixels it has to decode to, top-down, 1 or 4 bytes a pixel.
+struct Sample {
+    std::string strName;
+    Bytes file;
+    size_t nOffBits;
+    int iWidth;
+    int iHeight;
+    bool bGray;
+    bool bRle;
+    Bytes pixels;
+};
+
+void PutLE(Bytes& file, size_t iAt, uint32_t v, int nBytes)
+{
+    for (int k = 0; k < nBytes; k++) {
+        file[iAt + k] = (unsigned char)(v >> (8 * k));
+    }
+}
+
+// File and info headers up to biClrUsed, followed by nExtra zero bytes for masks or a palette.
+Bytes MakeHeaders(int iWidth, int iHeight, int iBitCount, int iCompression, size_t nInfoBytes, size_t nExtra, uint32_t iClrUsed)
+{
+    size_t nOffBits = 14 + nInfoBytes + nExtra;
+    Bytes file(nOffBits);
+    file[0] = 'B';
+    file[1] = 'M';
+    PutLE(file, 10, (uint32_t)nOffBits, 4);
+    PutLE(file, 14, (uint32_t)nInfoBytes, 4);
+    PutLE(file, 18, (uint32_t)iWidth, 4);
+    PutLE(file, 22, (uint32_t)iHeight, 4);
+    PutLE(file, 26, 1, 2);
+    PutLE(file, 28, (uint32_t)iBitCount, 2);
+    PutLE(file, 30, (uint32_t)iCompression, 4);
+    PutLE(file, 46, iClrUsed, 4);
+    return file;
+}
+
+void FinishFile(Sample& s)
+{
+    PutLE(s.file, 2, (uint32_t)s.file.size(), 4);
+}
+
+// The palette the decoder has to use: the file's entries, 0 past them, or without any the gray ramp.
+std::vector<uint32_t> FullPalette(const std::vector<uint32_t>& palette, int iBitCount, bool* pGray)
+{
+    size_t nIndices = (size_t)1 << iBitCount;
+    std::vector<uint32_t> full(nIndices, 0);
+    *pGray = true;
+    for (size_t i = 0; i < nIndices; i++) {
+        full[i] = palette.empty() ? (uint32_t)(i * (255 / (nIndices - 1))) * 0x010101 : i < palette.size() ? palette[i] & 0xFFFFFF : 0;
+        *pGray = *pGray && (full[i] & 0xFF) == ((full[i] >> 8) & 0xFF) && (full[i] & 0xFF) == (full[i] >> 16);
+    }
+    return full;
+}
+
+void PutPixel(Sample& s, int x, int y, uint32_t v)
+{
+    size_t i = (size_t)y * s.iWidth + x;
+    if (s.bGray) {
+        s.pixels[i] = (unsigned char)v;
+    } else {
+        memcpy(&s.pixels[i * 4], &v, 4);
+    }
+}
+
+// 1/4/8-bit rows of random indices below the palette size; an empty palette leaves no room for one.
+Sample PaletteSample(const char* strName, int iBitCount, const std::vector<uint32_t>& palette, bool bClrUsed, int iWidth,
+    int iHeight, bool bTopDown)
+{
+    Sample s;
+    s.strName = strName;
+    s.iWidth = iWidth;
+    s.iHeight = iHeight;
+    s.bRle = false;
+    std::vector<uint32_t> full = FullPalette(palette, iBitCount, &s.bGray);
+    s.file = MakeHeaders(iWidth, bTopDown ? -iHeight : iHeight, iBitCount, GBI_RGB, 40, palette.size() * 4,
+        bClrUsed ? (uint32_t)palette.size() : 0);
+    for (size_t i = 0; i < palette.size(); i++) {
+        PutLE(s.file, 54 + i * 4, palette[i], 4);
+    }
+    s.nOffBits = s.file.size();
+    s.pixels.assign((size_t)iWidth * iHeight * (s.bGray ? 1 : 4), 0);
+    size_t nLnBytes = ((size_t)iWidth * iBitCount + 31) / 32 * 4;
+    uint32_t nColors = palette.empty() ? 1u << iBitCount : (uint32_t)palette.size();
+    for (int y = 0; y < iHeight; y++) {
+        Bytes row(nLnBytes, 0);
+        for (int x = 0; x < iWidth; x++) {
+            uint32_t i = Random() % nColors;
+            size_t iBit = (size_t)x * iBitCount;
+            row[iBit / 8] |= (unsigned char)(i << (8 - iBitCount - iBit % 8));
+            PutPixel(s, x, bTopDown ? y : iHeight - 1 - y, full[i]);
+        }
+        s.file.insert(s.file.end(), row.begin(), row.end());
+    }
+    FinishFile(s);
+    return s;
+}
+
+// v's field under iMask widened to 8 bits by repeating its bits from the top, 0 for an empty mask.
+unsigned char ReferenceField(uint32_t v, uint32_t iMask)
+{
+    if (iMask == 0) {
+        return 0;
+    }
+    int iShift = 0, iBits = 0;
+    while ((iMask >> iShift & 1) == 0) {
+        iShift++;
+    }
+    while (iShift + iBits < 32 && (iMask >> (iShift + iBits) & 1)) {
+        iBits++;
+    }
+    uint32_t f = (v & iMask) >> iShift;
+    int r = 0;
+    for (int i = 0; i < 8; i++) {
+        int iSrcBit = iBits >= 8 ? iBits - 1 - i : iBits - 1 - i % iBits;
+        r |= (int)((f >> iSrcBit) & 1) << (7 - i);
+    }
+    return (unsigned char)r;
+}
+
+// 16/24/32-bit rows of random pixels. masks (R, G, B, A) go after a 40-byte header for BI_BITFIELDS
+// and BI_ALPHABITFIELDS, or inside a V4/V5 header, at offset 54 either way.
+Sample DirectSample(const char* strName, int iBitCount, int iCompression, size_t nInfoBytes, const uint32_t masks[4],
+    int iWidth, int iHeight, bool bTopDown)
+{
+    Sample s;
+    s.strName = strName;
+    s.iWidth = iWidth;
+    s.iHeight = iHeight;
+    s.bGray = false;
+    s.bRle = false;
+    size_t nMasks = iCompression == GBI_BITFIELDS ? 3 : iCompression == GBI_ALPHABITFIELDS ? 4 : 0;
+    size_t nExtra = nInfoBytes == 40 ? nMasks * 4 : 0;
+    s.file = MakeHeaders(iWidth, bTopDown ? -iHeight : iHeight, iBitCount, iCompression, nInfoBytes, nExtra, 0);
+    if (nMasks != 0) {
+        for (size_t i = 0; i < (nInfoBytes == 40 ? nMasks : 4); i++) {
+            PutLE(s.file, 54 + i * 4, masks[i], 4);
+        }
+    }
+    s.nOffBits = s.file.size();
+    s.pixels.assign((size_t)iWidth * iHeight * 4, 0);
+    int iPxlBytes = iBitCount / 8;
+    size_t nLnBytes = ((size_t)iWidth * iBitCount + 31) / 32 * 4;
+    const uint32_t rgb555[4] = { 0x7C00, 0x3E0, 0x1F, 0 };
+    for (int y = 0; y < iHeight; y++) {
+        Bytes row = RandomBytes(nLnBytes);
+        for (int x = 0; x < iWidth; x++) {
+            uint32_t v = 0;
+            memcpy(&v, &row[x * iPxlBytes], iPxlBytes);
+            uint32_t px = v;
+            if (iBitCount == 24) {
+                px = v & 0xFFFFFF;
+            } else if (iBitCount == 16 || nMasks != 0) {
+                const uint32_t* pMasks = nMasks != 0 ? masks : rgb555;
+                px = ReferenceField(v, pMasks[2]) | ReferenceField(v, pMasks[1]) << 8 | ReferenceField(v, pMasks[0]) << 16
+                    | (uint32_t)ReferenceField(v, pMasks[3]) << 24;
+            }
+            PutPixel(s, x, bTopDown ? y : iHeight - 1 - y, px);
+        }
+        s.file.insert(s.file.end(), row.begin(), row.end());
+    }
+    FinishFile(s);
+    return s;
+}
+
+// An RLE8 or RLE4 stream of random runs, absolute groups, deltas and early ends of lines, ending the
+// bitmap early when bEarlyEnd. Pixels the stream skips decode to 0.
+Sample RleSample(const char* strName, int iBitCount, const std::vector<uint32_t>& palette, int iWidth, int iHeight, bool bEarlyEnd)
+{
+    Sample s;
+    s.strName = strName;
+    s.iWidth = iWidth;
+    s.iHeight = iHeight;
+    s.bRle = true;
+    std::vector<uint32_t> full = FullPalette(palette, iBitCount, &s.bGray);
+    s.file = MakeHeaders(iWidth, iHeight, iBitCount, iBitCount == 8 ? GBI_RLE8 : GBI_RLE4, 40, palette.size() * 4, 0);
+    for (size_t i = 0; i < palette.size(); i++) {
+        PutLE(s.file, 54 + i * 4, palette[i], 4);
+    }
+    s.nOffBits = s.file.size();
+    s.pixels.assign((size_t)iWidth * iHeight * (s.bGray ? 1 : 4), 0);
+    bool bRle4 = iBitCount == 4;
+    uint32_t nColors = (uint32_t)full.size();
+    auto put = [&](int x, int y, uint32_t i) {
+        if (x < iWidth) {
+            PutPixel(s, x, iHeight - 1 - y, full[i]);
+        }
+    };
+    int x = 0, y = 0;
+    while (y < iHeight) {
+        if (bEarlyEnd && y == iHeight / 2 && x > 0) {
+            break;
+        }
+        uint32_t r = Random() % 10;
+        if (x >= iWidth) {
+            r = 9;
+        }
+        if (r < 5) {
+            int n = 1 + (int)(Random() % 20);
+            unsigned char c = bRle4 ? (unsigned char)Random() : (unsigned char)(Random() % nColors);
+            s.file.push_back((unsigned char)n);
+            s.file.push_back(c);
+            for (int k = 0; k < n; k++) {
+                put(x + k, y, bRle4 ? (k & 1 ? c & 0x0F : c >> 4) : c);
+            }
+            x = (std::min)(x + n, iWidth);
+        } else if (r < 7) {
+            int n = 3 + (int)(Random() % 20);
+            s.file.push_back(0);
+            s.file.push_back((unsigned char)n);
+            Bytes group(bRle4 ? (n + 1) / 2 : n, 0);
+            for (int k = 0; k < n; k++) {
+                uint32_t i = Random() % nColors;
+                if (bRle4) {
+                    group[k / 2] |= (unsigned char)(i << (k & 1 ? 0 : 4));
+                } else {
+                    group[k] = (unsigned char)i;
+                }
+                put(x + k, y, i);
+            }
+            group.resize((group.size() + 1) & ~(size_t)1);
+            s.file.insert(s.file.end(), group.begin(), group.end());
+            x = (std::min)(x + n, iWidth);
+        } else if (r < 8) {
+            int dx = (int)(Random() % 5);
+            int dy = (int)(Random() % 4 == 0);
+            const unsigned char delta[] = { 0, 2, (unsigned char)dx, (unsigned char)dy };
+            s.file.insert(s.file.end(), delta, delta + 4);
+            x = (std::min)(x + dx, iWidth);
+            y += dy;
+        } else {
+            s.file.push_back(0);
+            s.file.push_back(0);
+            x = 0;
+            y++;
+        }
+    }
+    s.file.push_back(0);
+    s.file.push_back(1);
+    FinishFile(s);
+    return s;
+}
+
+std::vector<uint32_t> RandomPalette(size_t n, bool bGray)
+{
+    std::vector<uint32_t> palette(n);
+    for (uint32_t& v : palette) {
+        v = bGray ? (Random() & 0xFF) * 0x010101 : Random() & 0xFFFFFF;
+    }
+    return palette;
+}
+
+std::vector<Sample> MakeSamples()
+{
+    std::vector<Sample> samples;
+    std::vector<uint32_t> ramp8(256);
+    for (uint32_t i = 0; i < 256; i++) {
+        ramp8[i] = i * 0x010101;
+    }
+    samples.push_back(PaletteSample("1-bit black, white", 1, { 0, 0xFFFFFF }, false, 13, 5, false));
+    samples.push_back(PaletteSample("1-bit white, black", 1, { 0xFFFFFF, 0 }, false, 33, 4, true));
+    samples.push_back(PaletteSample("1-bit two grays", 1, { 0x303030, 0xD0D0D0 }, false, 9, 3, false));
+    samples.push_back(PaletteSample("1-bit two colors", 1, { 0x0000FF, 0x00FF00 }, true, 17, 6, false));
+    samples.push_back(PaletteSample("4-bit gray", 4, RandomPalette(16, true), false, 23, 7, false));
+    samples.push_back(PaletteSample("4-bit color", 4, RandomPalette(16, false), false, 31, 5, true));
+    samples.push_back(PaletteSample("4-bit 5 colors", 4, RandomPalette(5, false), true, 7, 9, false));
+    samples.push_back(PaletteSample("8-bit ramp", 8, ramp8, false, 45, 6, false));
+    samples.push_back(PaletteSample("8-bit without palette", 8, {}, false, 19, 4, false));
+    samples.push_back(PaletteSample("8-bit color", 8, RandomPalette(256, false), false, 64, 3, true));
+    samples.push_back(PaletteSample("8-bit 3 grays", 8, RandomPalette(3, true), true, 5, 5, false));
+
+    const uint32_t none[4] = { 0, 0, 0, 0 };
+    const uint32_t rgb565[4] = { 0xF800, 0x7E0, 0x1F, 0 };
+    const uint32_t argb4444[4] = { 0xF00, 0xF0, 0xF, 0xF000 };
+    const uint32_t bgra[4] = { 0xFF0000, 0xFF00, 0xFF, 0xFF000000 };
+    const uint32_t rgba[4] = { 0xFF, 0xFF00, 0xFF0000, 0xFF000000 };
+    const uint32_t rgb10a2[4] = { 0x3FF00000, 0xFFC00, 0x3FF, 0xC0000000 };
+    samples.push_back(DirectSample("24-bit", 24, GBI_RGB, 40, none, 37, 5, false));
+    samples.push_back(DirectSample("24-bit 1x1", 24, GBI_RGB, 40, none, 1, 1, true));
+    samples.push_back(DirectSample("16-bit 5-5-5", 16, GBI_RGB, 40, none, 11, 7, false));
+    samples.push_back(DirectSample("16-bit 5-6-5 bit fields", 16, GBI_BITFIELDS, 40, rgb565, 13, 6, true));
+    samples.push_back(DirectSample("16-bit 4-4-4-4 alpha bit fields", 16, GBI_ALPHABITFIELDS, 40, argb4444, 10, 4, false));
+    samples.push_back(DirectSample("32-bit", 32, GBI_RGB, 40, none, 7, 3, false));
+    samples.push_back(DirectSample("V4 16-bit 5-6-5", 16, GBI_BITFIELDS, 108, rgb565, 9, 5, false));
+    samples.push_back(DirectSample("V5 32-bit BGRA", 32, GBI_BITFIELDS, 124, bgra, 6, 4, false));
+    samples.push_back(DirectSample("V5 32-bit RGBA", 32, GBI_BITFIELDS, 124, rgba, 21, 3, true));
+    samples.push_back(DirectSample("V5 32-bit 10-10-10-2", 32, GBI_BITFIELDS, 124, rgb10a2, 8, 8, false));
+
+    samples.push_back(RleSample("RLE8 color", 8, RandomPalette(256, false), 29, 11, false));
+    samples.push_back(RleSample("RLE8 ramp, early end", 8, ramp8, 17, 6, true));
+    samples.push_back(RleSample("RLE4 color", 4, RandomPalette(16, false), 23, 9, false));
+    samples.push_back(RleSample("RLE4 gray, early end", 4, RandomPalette(16, true), 15, 4, true));
+    return samples;
+}
+
+bool Matches(const GBmp& bmp, const Sample& s)
+{
+    return bmp.GetWidth() == s.iWidth && bmp.GetHeight() == s.iHeight && bmp.IsGray() == s.bGray
+        && memcmp(bmp.Data(), s.pixels.data(), s.pixels.size()) == 0;
+}
+
+GBmp Expected(const Sample& s)
+{
+    GBmp bmp;
+    bmp.SetImageSize(s.iWidth, s.iHeight, s.bGray);
+    memcpy(bmp.Data(), s.pixels.data(), s.pixels.size());
+    return bmp;
+}
+
+bool WriteFile(const char* strPath, const unsigned char* pData, size_t nLen)
+{
+    FILE* pFile = fopen(strPath, "wb");
+    if (pFile == 0) {
+        return false;
+    }
+    bool bOk = fwrite(pData, 1, nLen, pFile) == nLen;
+    return (fclose(pFile) == 0) && bOk;
+}
+
+const char* const g_strTempFile = "test_gbmp.tmp.bmp";
+
+// Every reader of a file on disk: LoadBmp, GBmpMapped and, for row formats, GBmpBandReader.
+void CheckFileReaders(const char* strLevel, const Sample& s)
+{
+    if (!WriteFile(g_strTempFile, s.file.data(), s.file.size())) {
+        Check(false, "cannot write %s", g_strTempFile);
+        return;
+    }
+    GBmp bmp;
+    Check(bmp.LoadBmp(g_strTempFile) && Matches(bmp, s), "%s LoadBmp %s", strLevel, s.strName.c_str());
+
+    GBmpMapped mapped;
+    bool bOk = mapped.Open(g_strTempFile) && mapped.GetWidth() == s.iWidth && mapped.GetHeight() == s.iHeight
+        && mapped.IsGray() == s.bGray;
+    size_t nLnLen = (size_t)s.iWidth * (s.bGray ? 1 : 4);
+    for (int y = 0; bOk && y < s.iHeight; y++) {
+        bOk = memcmp(mapped.Line(y), &s.pixels[y * nLnLen], nLnLen) == 0;
+    }
+    Check(bOk, "%s GBmpMapped %s", strLevel, s.strName.c_str());
+    mapped.Close();
+
+    if (!s.bRle) {
+        GBmpBandReader reader;
+        bOk = reader.Open(g_strTempFile) && reader.GetWidth() == s.iWidth && reader.GetHeight() == s.iHeight
+            && reader.IsGray() == s.bGray;
+        int iRow = 0, nRows;
+        GBmp band;
+        while (bOk && (nRows = reader.ReadBand(band, 3)) > 0) {
+            bOk = memcmp(band.Data(), &s.pixels[iRow * nLnLen], nLnLen * nRows) == 0;
+            iRow += nRows;
+        }
+        Check(bOk && iRow == s.iHeight, "%s GBmpBandReader %s", strLevel, s.strName.c_str());
+    }
+}
+
+// The file cut short at every length: the headers alone never decode, nor do rows without all
+// their bytes; a cut RLE stream ends the image early.
+void CheckTruncated(const char* strLevel, const Sample& s)
+{
+    for (size_t nLen = 0; nLen < s.file.size(); nLen++) {
+        Bytes cut(s.file.begin(), s.file.begin() + nLen);
+        GBmp bmp;
+        bool bOk = bmp.DecodeFromBuffer(cut.data(), cut.size());
+        Check(!bOk || (s.bRle && nLen >= s.nOffBits), "%s DecodeFromBuffer %s cut to %zu bytes", strLevel, s.strName.c_str(), nLen);
+    }
+    const size_t cuts[] = { 0, 14, 53, 14 + 40 - 1, s.nOffBits - 1, s.nOffBits, s.file.size() - 1 };
+    for (size_t nLen : cuts) {
+        if (nLen >= s.file.size() || (s.bRle && nLen >= s.nOffBits)) {
+            continue;
+        }
+        if (!WriteFile(g_strTempFile, s.file.data(), nLen)) {
+            Check(false, "cannot write %s", g_strTempFile);
+            return;
+        }
+        GBmp bmp;
+        GBmpMapped mapped;
+        GBmpBandReader reader;
+        Check(!bmp.LoadBmp(g_strTempFile), "%s LoadBmp %s cut to %zu bytes", strLevel, s.strName.c_str(), nLen);
+        Check(!mapped.Open(g_strTempFile), "%s GBmpMapped %s cut to %zu bytes", strLevel, s.strName.c_str(), nLen);
+        Check(!reader.Open(g_strTempFile), "%s GBmpBandReader %s cut to %zu bytes", strLevel, s.strName.c_str(), nLen);
+    }
+}
+
+void CheckDecoders(const char* strLevel, const std::vector<Sample>& samples)
+{
+    for (const Sample& s : samples) {
+        Bytes file = s.file;
+        GBmp bmp;
+        Check(bmp.DecodeFromBuffer(file.data(), file.size()) && Matches(bmp, s), "%s DecodeFromBuffer %s", strLevel,
+            s.strName.c_str());
+        // each orientation against the same geometry applied to the expected image.
+        GBmp expected = Expected(s);
+        const Geometry geos[] = { GEO_MIRRORV, GEO_MIRRORH, GEO_ROTATE180, GEO_TRANSPOSE };
+        for (int iOrient = GORIENT_FLIP; iOrient <= GORIENT_TRANSPOSE; iOrient++) {
+            Check(bmp.DecodeFromBuffer(file.data(), file.size(), (GOrientation)iOrient)
+                    && SameImage(bmp, ReferenceGeometry(expected, geos[iOrient - GORIENT_FLIP])),
+                "%s DecodeFromBuffer %s orientation %d", strLevel, s.strName.c_str(), iOrient);
+        }
+        if (s.iWidth > 0 && s.file[28] == 1 && s.bGray && (s.file[54] == 0 || s.file[54] == 0xFF)) {
+            GBmpBitonal bitonal;
+            GBmp gray;
+            bool bOk = bitonal.DecodeFromBuffer(file.data(), file.size());
+            if (bOk) {
+                bitonal.ToGray(gray);
+            }
+            Check(bOk && Matches(gray, s), "%s GBmpBitonal %s", strLevel, s.strName.c_str());
+        }
+        CheckFileReaders(strLevel, s);
+        CheckTruncated(strLevel, s);
+    }
+    remove(g_strTempFile);
+}
+
+// A V5 header cut off before its masks, with bfOffBits pointing at the end of the buffer so only
+// the info header length gives it away.
+void CheckShortInfoHeader()
+{
+    Bytes headers = MakeHeaders(1, 1, 32, GBI_BITFIELDS, 124, 0, 0);
+    PutLE(headers, 2, 60, 4);
+    PutLE(headers, 10, 60, 4);
+    Bytes file(headers.begin(), headers.begin() + 60);
+    GBmp bmp;
+    GBmpT<GPixelBGRA32> bmpT;
+    GBmpBitonal bitonal;
+    Check(!bmp.DecodeFromBuffer(file.data(), file.size()), "GBmp decodes a V5 header cut to 60 bytes");
+    Check(!bmpT.DecodeFromBuffer(file.data(), file.size()), "GBmpT decodes a V5 header cut to 60 bytes");
+    Check(!bitonal.DecodeFromBuffer(file.data(), file.size()), "GBmpBitonal decodes a V5 header cut to 60 bytes");
+    if (WriteFile(g_strTempFile, file.data(), file.size())) {
+        GBmpMapped mapped;
+        GBmpBandReader reader;
+        Check(!bmp.LoadBmp(g_strTempFile), "LoadBmp reads a V5 header cut to 60 bytes");
+        Check(!mapped.Open(g_strTempFile), "GBmpMapped opens a V5 header cut to 60 bytes");
+        Check(!reader.Open(g_strTempFile), "GBmpBandReader opens a V5 header cut to 60 bytes");
+        remove(g_strTempFile);
+    }
+}
+
+} // namespace
+
+int main()
+{
+    GBmpKernels::SetLevel(GSIMD_SCALAR);
+    const GBmpKernels ref = GBmpKernels::Get();
+    std::vector<Sample> samples = MakeSamples();
+    std::vector<GBmp> scalarResizes;
+    for (int iLevel = GSIMD_SCALAR; iLevel <= GCpu::Detect(); iLevel++) {
+        const char* strLevel = LevelName(GBmpKernels::SetLevel((GSimdLevel)iLevel));
+        CheckKernels(ref, GBmpKernels::Get(), strLevel);
+        CheckGeometry(strLevel);
+        CheckResize(strLevel, scalarResizes);
+        CheckDecoders(strLevel, samples);
+    }
+    CheckShortInfoHeader();
+    printf("%d checks, %d failed\n", g_nChecks, g_nFailures);
+    return g_nFailures != 0;
+}